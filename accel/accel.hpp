@@ -3,6 +3,7 @@
 
 #include "numtype.h"
 #include "ray.hpp"
+#include "ray_stream.hpp"
 #include "object.hpp"
 #include "bbox.hpp"
 
@@ -57,22 +58,22 @@ public:
 
 	/**
 	 * @brief Initializes the traverser for traversing with
-	 * the given WorldRays.
+	 * the rays in positions [begin, end) of the given RayStream.
 	 *
 	 * This resets any traversal already in progress.
 	 */
-	virtual void init_rays(Ray* begin, Ray* end) = 0;
+	virtual void init_rays(RayStream* rays, size_t begin, size_t end) = 0;
 
 	/**
 	 * @brief Traverses to the next relevant object.
 	 *
-	 * Returns a tuple with a pair of iterators to the begin and end of the
-	 * relevant Rays, and an index to the object instance they need to be
-	 * tested against.
+	 * Returns a tuple with the begin and end positions of the relevant
+	 * rays in the RayStream, and an index to the object instance they
+	 * need to be tested against.
 	 *
 	 * When traversal is complete, begin == end and object == 0.
 	 */
-	virtual std::tuple<Ray*, Ray*, size_t>
+	virtual std::tuple<size_t, size_t, size_t>
 	next_object() = 0;
 };
 
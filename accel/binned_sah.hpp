@@ -0,0 +1,207 @@
+#ifndef BINNED_SAH_HPP
+#define BINNED_SAH_HPP
+
+#include "numtype.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <vector>
+#include <cassert>
+#include <thread>
+
+#include "vector.hpp"
+#include "bbox.hpp"
+
+
+namespace BinnedSAH {
+
+static constexpr int BIN_COUNT = 16;
+
+// The minimum number of primitives per thread to bother binning in
+// parallel
+static constexpr size_t PARALLEL_BIN_MIN = 1 << 14;
+
+
+/**
+ * Calls fn(chunk_begin, chunk_end, chunk_index) for chunk_count roughly
+ * equal chunks of [begin, end), each on its own thread.  The first chunk
+ * is run on the calling thread.
+ */
+template <typename RandIt, typename F>
+void for_each_chunk(RandIt begin, RandIt end, size_t chunk_count, F fn) {
+	const size_t count = std::distance(begin, end);
+	std::vector<std::thread> threads;
+	for (size_t c = 1; c < chunk_count; ++c)
+		threads.emplace_back(fn, begin + (count * c / chunk_count), begin + (count * (c + 1) / chunk_count), c);
+	fn(begin, begin + (count / chunk_count), 0);
+	for (auto& thread: threads)
+		thread.join();
+}
+
+
+/**
+ * Splits a range of primitives into two groups for BVH construction,
+ * using a binned surface area heuristic.
+ *
+ * The primitives are binned along each axis by their centroids, and the
+ * split between bins with the lowest SAH cost is chosen.  To account for
+ * motion blur, the surface area of a group is the average of its surface
+ * areas over all time samples, so groups whose bounds sweep across large
+ * parts of the scene are penalized.
+ *
+ * If no split can be found (e.g. all centroids are the same) the
+ * primitives are split in half.
+ *
+ * @param begin, end The range of primitives to split.  Must contain at
+ *                   least two primitives.  Is reordered in-place.
+ * @param time_samples The number of time samples of the primitives'
+ *                     bounds.  The same for all primitives.
+ * @param centroid A callable that takes a primitive and returns its
+ *                 centroid as a Vec3.
+ * @param bounds A callable that takes a primitive and a time sample index
+ *               and returns the primitive's bounds at that time sample.
+ * @param threads The number of threads to bin the primitives with, if
+ *                there are enough of them.  centroid and bounds must be
+ *                safe to call concurrently if this is more than one.  The
+ *                result is the same regardless of thread count.
+ * @param[out] split_axis If not null, receives the axis the primitives
+ *                        were split along, with the first group on its
+ *                        low side.  Or -1 if they were split in half.
+ *
+ * @returns The start of the second group, which is never begin or end.
+ */
+template <typename RandIt, typename CentroidFn, typename BoundsFn>
+RandIt split(RandIt begin, RandIt end, size_t time_samples, CentroidFn centroid, BoundsFn bounds, size_t threads = 1, int* split_axis = nullptr) {
+	const size_t count = std::distance(begin, end);
+	assert(count >= 2);
+	assert(time_samples > 0);
+
+	const size_t chunk_count = std::max<size_t>(1, std::min(threads, count / PARALLEL_BIN_MIN));
+
+	// Bounds of the centroids
+	std::vector<BBox> chunk_cbounds(chunk_count);
+	for_each_chunk(begin, end, chunk_count, [&](RandIt chunk_begin, RandIt chunk_end, size_t chunk_i) {
+		BBox cb;
+		for (auto itr = chunk_begin; itr != chunk_end; ++itr)
+			cb = cb | centroid(*itr);
+		chunk_cbounds[chunk_i] = cb;
+	});
+	BBox cbounds;
+	for (const auto& cb: chunk_cbounds)
+		cbounds = cbounds | cb;
+	const Vec3 extent = cbounds.max - cbounds.min;
+
+	// Returns the bin of a primitive on the given axis
+	auto bin_of = [&](int axis, const Vec3& c) {
+		if (!(extent[axis] > 0.0f))
+			return 0;
+		const int bin = static_cast<int>(((c[axis] - cbounds.min[axis]) / extent[axis]) * BIN_COUNT);
+		return std::max(0, std::min(bin, BIN_COUNT - 1));
+	};
+
+	// Average surface area over the time samples of a group of bounds
+	auto area = [time_samples](const BBox* bbs) {
+		float sum = 0.0f;
+		for (size_t t = 0; t < time_samples; ++t)
+			sum += bbs[t].surface_area();
+		return sum / time_samples;
+	};
+
+	// Bin the primitives along all axes.  Bounds are indexed by
+	// [axis][bin][time sample].
+	struct Bins {
+		size_t counts[3][BIN_COUNT];
+		std::vector<BBox> bounds;
+	};
+	std::vector<Bins> chunk_bins(chunk_count);
+	for_each_chunk(begin, end, chunk_count, [&](RandIt chunk_begin, RandIt chunk_end, size_t chunk_i) {
+		Bins& bins = chunk_bins[chunk_i];
+		std::fill(&bins.counts[0][0], &bins.counts[0][0] + (3 * BIN_COUNT), 0);
+		bins.bounds.resize(3 * BIN_COUNT * time_samples);
+		for (auto itr = chunk_begin; itr != chunk_end; ++itr) {
+			const Vec3 c = centroid(*itr);
+			for (int axis = 0; axis < 3; ++axis) {
+				const int bin = bin_of(axis, c);
+				++bins.counts[axis][bin];
+				BBox* bbs = &bins.bounds[((axis * BIN_COUNT) + bin) * time_samples];
+				for (size_t t = 0; t < time_samples; ++t)
+					bbs[t] = bbs[t] | bounds(*itr, t);
+			}
+		}
+	});
+	Bins& bins = chunk_bins[0];
+	for (size_t c = 1; c < chunk_count; ++c) {
+		for (int axis = 0; axis < 3; ++axis) {
+			for (int bin = 0; bin < BIN_COUNT; ++bin)
+				bins.counts[axis][bin] += chunk_bins[c].counts[axis][bin];
+		}
+		for (size_t i = 0; i < bins.bounds.size(); ++i)
+			bins.bounds[i] = bins.bounds[i] | chunk_bins[c].bounds[i];
+	}
+
+	// Find the best split over all axes
+	int best_axis = -1;
+	int best_bin = 0;
+	float best_cost = std::numeric_limits<float>::infinity();
+	std::vector<BBox> right_bounds(BIN_COUNT * time_samples);
+	std::vector<BBox> left(time_samples);
+	for (int axis = 0; axis < 3; ++axis) {
+		if (!(extent[axis] > 0.0f))
+			continue;
+
+		const size_t* bin_counts = bins.counts[axis];
+		const BBox* bin_bounds = &bins.bounds[axis * BIN_COUNT * time_samples];
+
+		// Sweep from the right, accumulating the bounds of the right side
+		// of each split
+		size_t right_counts[BIN_COUNT];
+		right_counts[BIN_COUNT - 1] = bin_counts[BIN_COUNT - 1];
+		std::copy(bin_bounds + ((BIN_COUNT - 1) * time_samples), bin_bounds + (BIN_COUNT * time_samples), right_bounds.end() - time_samples);
+		for (int bin = BIN_COUNT - 2; bin >= 0; --bin) {
+			right_counts[bin] = right_counts[bin + 1] + bin_counts[bin];
+			for (size_t t = 0; t < time_samples; ++t)
+				right_bounds[bin * time_samples + t] = right_bounds[(bin + 1) * time_samples + t] | bin_bounds[bin * time_samples + t];
+		}
+
+		// Sweep from the left, evaluating the cost of splitting before
+		// each bin
+		size_t left_count = 0;
+		std::fill(left.begin(), left.end(), BBox());
+		for (int bin = 1; bin < BIN_COUNT; ++bin) {
+			left_count += bin_counts[bin - 1];
+			for (size_t t = 0; t < time_samples; ++t)
+				left[t] = left[t] | bin_bounds[(bin - 1) * time_samples + t];
+
+			if (left_count == 0 || right_counts[bin] == 0)
+				continue;
+
+			const float cost = (area(&left[0]) * left_count) + (area(&right_bounds[bin * time_samples]) * right_counts[bin]);
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = bin;
+			}
+		}
+	}
+
+	// Split
+	RandIt mid;
+	if (best_axis >= 0) {
+		mid = std::partition(begin, end, [&](const typename std::iterator_traits<RandIt>::value_type& prim) {
+			return bin_of(best_axis, centroid(prim)) < best_bin;
+		});
+	} else {
+		mid = begin + (count / 2);
+	}
+
+	if (split_axis != nullptr)
+		*split_axis = best_axis;
+
+	assert(mid != begin && mid != end);
+	return mid;
+}
+
+}
+
+#endif // BINNED_SAH_HPP
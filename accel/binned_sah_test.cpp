@@ -0,0 +1,114 @@
+#include "test.hpp"
+
+#include <vector>
+#include "vector.hpp"
+#include "bbox.hpp"
+#include "binned_sah.hpp"
+
+
+/*
+ ************************************************************************
+ * Testing suite for BinnedSAH.
+ ************************************************************************
+ */
+
+struct SAHTestPrim {
+	int id;
+	std::vector<BBox> bbs;
+
+	Vec3 centroid() const {
+		return bbs[0].center();
+	}
+};
+
+static SAHTestPrim make_prim(int id, Vec3 p, Vec3 motion = Vec3(0.0f, 0.0f, 0.0f)) {
+	const Vec3 r(0.5f, 0.5f, 0.5f);
+	return SAHTestPrim {id, {BBox(p - r, p + r), BBox(p + motion - r, p + motion + r)}};
+}
+
+static std::vector<SAHTestPrim>::iterator split_prims(std::vector<SAHTestPrim>* prims, size_t threads = 1) {
+	return BinnedSAH::split(prims->begin(), prims->end(), 2,
+	[](const SAHTestPrim & prim) {
+		return prim.centroid();
+	},
+	[](const SAHTestPrim & prim, size_t t) {
+		return prim.bbs[t];
+	}, threads);
+}
+
+TEST_CASE("binned_sah") {
+	SECTION("separates_clusters") {
+		// Two tight clusters far apart on the x axis
+		std::vector<SAHTestPrim> prims;
+		for (int i = 0; i < 8; ++i)
+			prims.push_back(make_prim(i, Vec3(i * 0.1f, (i % 3) * 1.0f, 0.0f)));
+		for (int i = 8; i < 16; ++i)
+			prims.push_back(make_prim(i, Vec3(10.0f + i * 0.1f, (i % 3) * 1.0f, 0.0f)));
+
+		int axis = -2;
+		auto mid = BinnedSAH::split(prims.begin(), prims.end(), 2,
+		[](const SAHTestPrim & prim) {
+			return prim.centroid();
+		},
+		[](const SAHTestPrim & prim, size_t t) {
+			return prim.bbs[t];
+		}, 1, &axis);
+
+		REQUIRE(mid != prims.begin());
+		REQUIRE(mid != prims.end());
+		REQUIRE(axis == 0);
+
+		// The first cluster ends up alone on one side
+		REQUIRE(std::distance(prims.begin(), mid) == 8);
+		for (auto itr = prims.begin(); itr != mid; ++itr)
+			REQUIRE(itr->id < 8);
+	}
+
+	SECTION("accounts_for_motion") {
+		// Two groups that are separated along y at time 0, but where one
+		// of them moves far along y, while they are cleanly separated
+		// along x at all times.
+		std::vector<SAHTestPrim> prims;
+		for (int i = 0; i < 8; ++i)
+			prims.push_back(make_prim(i, Vec3(i * 0.1f, 0.0f, (i % 2) * 1.5f)));
+		for (int i = 8; i < 16; ++i)
+			prims.push_back(make_prim(i, Vec3(1.5f + i * 0.1f, 4.0f, (i % 2) * 1.5f), Vec3(0.0f, -8.0f, 0.0f)));
+
+		auto mid = split_prims(&prims);
+
+		REQUIRE(std::distance(prims.begin(), mid) == 8);
+		for (auto itr = prims.begin(); itr != mid; ++itr)
+			REQUIRE(itr->id < 8);
+	}
+
+	SECTION("coincident_centroids") {
+		std::vector<SAHTestPrim> prims;
+		for (int i = 0; i < 5; ++i)
+			prims.push_back(make_prim(i, Vec3(1.0f, 2.0f, 3.0f)));
+
+		auto mid = split_prims(&prims);
+
+		REQUIRE(mid != prims.begin());
+		REQUIRE(mid != prims.end());
+	}
+
+	SECTION("parallel_matches_serial") {
+		std::vector<SAHTestPrim> prims;
+		const uint32_t count = BinnedSAH::PARALLEL_BIN_MIN * 4 + 7;
+		for (uint32_t i = 0; i < count; ++i) {
+			const float x = (i * 7919u) % 1013u;
+			const float y = (i * 104729u) % 617u;
+			prims.push_back(make_prim(i, Vec3(x, y * 0.5f, x * 0.25f), Vec3(0.0f, (i % 5) * 3.0f, 0.0f)));
+		}
+		std::vector<SAHTestPrim> prims2 = prims;
+
+		auto mid = split_prims(&prims);
+		auto mid2 = split_prims(&prims2, 4);
+
+		REQUIRE(std::distance(prims.begin(), mid) == std::distance(prims2.begin(), mid2));
+		bool same_order = true;
+		for (uint32_t i = 0; i < count; ++i)
+			same_order = same_order && (prims[i].id == prims2[i].id);
+		REQUIRE(same_order);
+	}
+}
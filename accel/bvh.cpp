@@ -10,35 +10,18 @@
 #include "utils.hpp"
 #include "ray.hpp"
 #include "assembly.hpp"
+#include "config.hpp"
 
 void BVH::build(const Assembly& _assembly) {
 	assembly = &_assembly;
-
-	// Abbreviating subsequent code
-	const auto& instances = assembly->instances;
-
-	// Create BVHPrimitive bag
-	bag.reserve(instances.size());
-	for (size_t i = 0; i < instances.size(); ++i) {
-		// Get instance bounds at time 0.5
-		BBox bb = assembly->instance_bounds_at(0.5f, i);
-
-		// Create primitive
-		BVHPrimitive prim;
-		prim.instance_index = i;
-		prim.bmin = bb.min;
-		prim.bmax = bb.max;
-		prim.c = lerp(0.5f, bb.min, bb.max);
-
-		// Add it to the bag
-		bag.push_back(prim);
-	}
+	fill_bag(_assembly);
 
 	if (bag.size() == 0)
 		return;
 
-	recursive_build(0, 0, bag.size()-1);
-	bag.resize(0);
+	nodes.push_back(Node());
+	recursive_build(&nodes, &bboxes, 0, 0, bag.size()-1, Config::build_threads);
+	clear_bag();
 
 	// Calculate total bounds
 	auto bbbegin = bboxes.begin() + nodes[0].bbox_index;
@@ -52,143 +35,59 @@ bool BVH::finalize() {
 	return true;
 }
 
-struct CompareToMid {
-	int32_t dim;
-	float mid;
-
-	CompareToMid(int32_t d, float m) {
-		dim = d;
-		mid = m;
-	}
-
-	bool operator()(BVH::BVHPrimitive &a) const {
-		return a.c[dim] < mid;
-	}
-};
-
-struct CompareDim {
-	int32_t dim;
-
-	CompareDim(int32_t d) {
-		dim = d;
-	}
-
-	bool operator()(BVH::BVHPrimitive &a, BVH::BVHPrimitive &b) const {
-		return a.c[dim] < b.c[dim];
-	}
-};
-
-
 
 /*
- * Determines the split of the primitives in bag starting
- * at first and ending at last.  May reorder that section of the
- * list.  Used in recursive_build for BVH construction.
- * Returns the split index (last index of the first group).
+ * Fills in nodes[node_i] as a leaf for prim, appending its bounding boxes
+ * to out_bboxes (see BVHBuilder).
  */
-size_t BVH::split_primitives(size_t first_prim, size_t last_prim) {
-	// Find the minimum and maximum centroid values on each axis
-	Vec3 min, max;
-	min = bag[first_prim].c;
-	max = bag[first_prim].c;
-	for (uint32_t i = first_prim+1; i <= last_prim; i++) {
-		for (int32_t d = 0; d < 3; d++) {
-			min[d] = min[d] < bag[i].c[d] ? min[d] : bag[i].c[d];
-			max[d] = max[d] > bag[i].c[d] ? max[d] : bag[i].c[d];
-		}
-	}
-
-	// Find the axis with the maximum extent
-	int32_t max_axis = 0;
-	if ((max.y - min.y) > (max.x - min.x))
-		max_axis = 1;
-	if ((max.z - min.z) > (max.y - min.y))
-		max_axis = 2;
-
-	// Sort and split the list
-	float pmid = .5f * (min[max_axis] + max[max_axis]);
-	auto mid_itr = std::partition(bag.begin()+first_prim,
-	                              bag.begin()+last_prim+1,
-	                              CompareToMid(max_axis, pmid));
-
-	size_t split = std::distance(bag.begin(), mid_itr);
-	if (split > 0)
-		split--;
-
-	if (split < first_prim)
-		split = first_prim;
-
-	return split;
+std::vector<BBox> BVH::pack_leaf(std::vector<Node>* out_nodes, std::vector<BBox>* out_bboxes, size_t node_i, const BVHPrimitive& prim) {
+	auto& nodes = *out_nodes;
+	auto& bboxes = *out_bboxes;
+	const auto& bbs = instance_bbs[prim.instance_index];
+
+	nodes[node_i].flags = IS_LEAF;
+	nodes[node_i].data_index = prim.instance_index;
+	nodes[node_i].bbox_index = bboxes.size();
+	nodes[node_i].ts = bbs.size();
+	bboxes.insert(bboxes.end(), bbs.begin(), bbs.end());
+
+	return bbs;
 }
 
 
-
 /*
- * Recursively builds the BVH starting at the given node with the given
- * first and last primitive indices (in bag).
+ * Fills in nodes[node_i] as the parent of the two nodes from first_child_i
+ * on, appending its bounding boxes to out_bboxes (see BVHBuilder).  If
+ * both children have the same number of time samples its bounds are their
+ * per-time-sample union, otherwise it's a single box that encloses both.
  */
-size_t BVH::recursive_build(size_t parent, size_t first_prim, size_t last_prim) {
-	// Allocate the node
-	const size_t me = nodes.size();
-	nodes.push_back(Node());
-
-
-	nodes[me].flags = 0;
-	nodes[me].parent_index = parent;
-
-	if (first_prim == last_prim) {
-		// Leaf node
-		nodes[me].flags |= IS_LEAF;
-		nodes[me].data_index = bag[first_prim].instance_index;
-
-		// Copy bounding boxes
-		auto bbs = assembly->instance_bounds(bag[first_prim].instance_index);
-		nodes[me].bbox_index = bboxes.size();
-		nodes[me].ts = bbs.size();
-		// Append bbs to bboxes
-		bboxes.insert(bboxes.end(), bbs.begin(), bbs.end());
-	} else {
-		// Not a leaf node
-
-		// Create child nodes
-		uint32_t split_index = split_primitives(first_prim, last_prim);
-		const size_t child1i = recursive_build(me, first_prim, split_index);
-		const size_t child2i = recursive_build(me, split_index+1, last_prim);
-
-		nodes[me].child_index = child2i;
-
-
-		// Calculate bounds
-		nodes[me].bbox_index = bboxes.size();
-		// If both children have same number of time samples
-		if (nodes[child1i].ts == nodes[child2i].ts) {
-			nodes[me].ts = nodes[child1i].ts;
-
-			// Copy merged bounding boxes
-			for (size_t i = 0; i < nodes[me].ts; i++) {
-				bboxes.push_back(bboxes[nodes[child1i].bbox_index+i]);
-				bboxes.back().merge_with(bboxes[nodes[child2i].bbox_index+i]);
-			}
+std::vector<BBox> BVH::pack_node(std::vector<Node>* out_nodes, std::vector<BBox>* out_bboxes, size_t node_i, size_t first_child_i, int child_count, const std::vector<BBox>* child_bbs, const int* split_axes) {
+	auto& nodes = *out_nodes;
+	auto& bboxes = *out_bboxes;
+	const auto bbs = union_bounds(child_bbs, child_count);
+
+	nodes[node_i].flags = 0;
+	nodes[node_i].child_index = first_child_i;
+	nodes[node_i].bbox_index = bboxes.size();
+	nodes[node_i].ts = bbs.size();
+	bboxes.insert(bboxes.end(), bbs.begin(), bbs.end());
+
+	return bbs;
+}
 
-		}
-		// If children have different number of time samples
-		else {
-			nodes[me].ts = 1;
-
-			// Merge children's bboxes to get our bbox
-			bboxes.push_back(bboxes[nodes[child1i].bbox_index]);
-			for (size_t i = 1; i < nodes[child1i].ts; i++)
-				bboxes.back().merge_with(bboxes[nodes[child1i].bbox_index+i]);
-			for (size_t i = 0; i < nodes[child2i].ts; i++)
-				bboxes.back().merge_with(bboxes[nodes[child2i].bbox_index+i]);
-		}
-	}
 
-	return me;
+/*
+ * Offsets the indices of a node built into its own buffers (see
+ * BVHBuilder).
+ */
+void BVH::offset_node(Node* node, size_t node_offset, size_t bbox_offset) {
+	node->bbox_index += bbox_offset;
+	if (!(node->flags & IS_LEAF))
+		node->child_index += node_offset;
 }
 
 
-std::tuple<Ray*, Ray*, size_t> BVHStreamTraverser::next_object() {
+std::tuple<size_t, size_t, size_t> BVHStreamTraverser::next_object() {
 	// If there aren't any objects in the scene, return finished
 	if (bvh->nodes.size() == 0)
 		return std::make_tuple(rays_end, rays_end, 0);
@@ -197,20 +96,20 @@ std::tuple<Ray*, Ray*, size_t> BVHStreamTraverser::next_object() {
 
 	while (stack_ptr >= 0) {
 		// Test rays against current node, partitioning as we go
-		ray_stack[stack_ptr].first = mutable_partition(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, [this, &near_t, &far_t](const Ray& ray) {
-			if (ray.is_done()) {
+		ray_stack[stack_ptr].first = rays->partition(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, [this, &near_t, &far_t](size_t i) {
+			if (rays->is_done(i)) {
 				return true;
 			} else {
-				return !bvh->intersect_node(node_stack[stack_ptr], ray, &near_t, &far_t);
+				return !bvh->intersect_node(node_stack[stack_ptr], *rays, i, &near_t, &far_t);
 			}
 		});
 
-		const auto hit_count = std::distance(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second);
+		const auto hit_count = ray_stack[stack_ptr].second - ray_stack[stack_ptr].first;
 
 		if (hit_count > 0) {
 			// If it's a leaf
 			if (bvh->is_leaf(node_stack[stack_ptr])) {
-				auto rv = std::make_tuple(&(*ray_stack[stack_ptr].first), &(*ray_stack[stack_ptr].second), bvh->nodes[node_stack[stack_ptr]].data_index);
+				auto rv = std::make_tuple(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, bvh->nodes[node_stack[stack_ptr]].data_index);
 				--stack_ptr;
 				return rv;
 			}
@@ -224,8 +123,8 @@ std::tuple<Ray*, Ray*, size_t> BVHStreamTraverser::next_object() {
 				// Test nodes against first ray, and traverse into the nearer hit first
 				float near_t1, far_t1;
 				float near_t2, far_t2;
-				const bool hit1 = bvh->intersect_node(node_stack[stack_ptr], *ray_stack[stack_ptr].first, &near_t1, &far_t1);
-				const bool hit2 = bvh->intersect_node(node_stack[stack_ptr+1], *ray_stack[stack_ptr].first, &near_t2, &far_t2);
+				const bool hit1 = bvh->intersect_node(node_stack[stack_ptr], *rays, ray_stack[stack_ptr].first, &near_t1, &far_t1);
+				const bool hit2 = bvh->intersect_node(node_stack[stack_ptr+1], *rays, ray_stack[stack_ptr].first, &near_t2, &far_t2);
 				if (hit1 && hit2) {
 					if (near_t1 < near_t2)
 						std::swap(node_stack[stack_ptr], node_stack[stack_ptr+1]);
@@ -10,6 +10,7 @@
 #include "global.hpp"
 
 #include "accel.hpp"
+#include "bvh_builder.hpp"
 #include "object.hpp"
 #include "ray.hpp"
 #include "bbox.hpp"
@@ -21,7 +22,7 @@
 /*
  * A bounding volume hierarchy.
  */
-class BVH: public Accel {
+class BVH: public Accel, private BVHBuilder<BVH, 2> {
 	std::vector<BBox> _bounds {BBox()};
 public:
 	virtual ~BVH() {};
@@ -32,6 +33,7 @@ public:
 
 	// Traversers need access to private data
 	friend class BVHStreamTraverser;
+	friend class BVHBuilder<BVH, 2>;
 
 	enum {
 		IS_LEAF = 1 << 0
@@ -40,8 +42,9 @@ public:
 	/*
 	 * A node of a bounding volume hierarchy.
 	 * Contains a bounding box, a flag for whether
-	 * it's a leaf or not, a pointer to its first
-	 * child, and it's data if it's a leaf.
+	 * it's a leaf or not, the index of its first
+	 * child (the second follows it), and it's data
+	 * if it's a leaf.
 	 */
 	struct Node {
 		size_t bbox_index = 0;
@@ -49,25 +52,13 @@ public:
 			size_t child_index = 0;
 			size_t data_index;
 		};
-		size_t parent_index = 0;
 		uint16_t ts = 0; // Time sample count
 		uint16_t flags = 0;
 	};
 
-	/*
-	 * Used to store objects that have yet to be
-	 * inserted into the hierarchy.
-	 * Contains the time 0.5 bounds of the object and it's centroid.
-	 */
-	struct BVHPrimitive {
-		size_t instance_index;
-		Vec3 bmin, bmax, c;
-	};
-
 public:
 	// This stuff is public because BVH is used as the basis
-	// for building other BVH's like BVH2 and BVH4, and they need
-	// direct access.
+	// for building BVH2, which needs direct access.
 	std::vector<Node> nodes;
 	std::vector<BBox> bboxes;
 
@@ -76,7 +67,7 @@ public:
 	 * of the node with the given index.
 	 */
 	inline size_t child1(const size_t node_i) const {
-		return node_i + 1;
+		return nodes[node_i].child_index;
 	}
 
 	/**
@@ -84,19 +75,7 @@ public:
 	 * of the node with the given index.
 	 */
 	inline size_t child2(const size_t node_i) const {
-		return nodes[node_i].child_index;
-	}
-
-	/**
-	 * @brief Returns the index of the sibling
-	 * of the node with the given index.
-	 */
-	inline size_t sibling(const size_t node_i) const {
-		const size_t parent_i = nodes[node_i].parent_index;
-		if (node_i == (parent_i + 1))
-			return nodes[parent_i].child_index;
-		else
-			return parent_i + 1;
+		return nodes[node_i].child_index + 1;
 	}
 
 	inline bool is_leaf(const size_t node_i) const {
@@ -105,25 +84,25 @@ public:
 
 private:
 	const Assembly* assembly; // Set during build()
-	//std::vector<BBox> bbox;
-	std::vector<BVHPrimitive> bag;  // Temporary holding spot for objects not yet added to the hierarchy
 
 	bool finalize();
 
 	/**
 	 * @brief Tests whether a ray intersects a node or not.
 	 */
-	inline bool intersect_node(const uint64_t node_i, const Ray& ray, float *near_t, float *far_t) const {
+	inline bool intersect_node(const uint64_t node_i, const RayStream& rays, const size_t ray_i, float *near_t, float *far_t) const {
 #ifdef GLOBAL_STATS_TOP_LEVEL_BVH_NODE_TESTS
 		Global::Stats::top_level_bvh_node_tests++;
 #endif
 		const Node& node = nodes[node_i];
-		const BBox b = lerp_seq(ray.time, bboxes.cbegin() + node.bbox_index, bboxes.cbegin() + node.bbox_index + node.ts);
-		return b.intersect_ray(ray, near_t, far_t, ray.max_t);
+		const size_t s = rays.slot(ray_i);
+		const BBox b = lerp_seq(rays.time[s], bboxes.cbegin() + node.bbox_index, bboxes.cbegin() + node.bbox_index + node.ts);
+		return b.intersect_ray(rays.o[s], rays.d_inv[s], near_t, far_t, rays.max_t[s]);
 	}
 
-	size_t split_primitives(size_t first_prim, size_t last_prim);
-	size_t recursive_build(size_t parent, size_t first_prim, size_t last_prim);
+	std::vector<BBox> pack_leaf(std::vector<Node>* out_nodes, std::vector<BBox>* out_bboxes, size_t node_i, const BVHPrimitive& prim);
+	std::vector<BBox> pack_node(std::vector<Node>* out_nodes, std::vector<BBox>* out_bboxes, size_t node_i, size_t first_child_i, int child_count, const std::vector<BBox>* child_bbs, const int* split_axes);
+	static void offset_node(Node* node, size_t node_offset, size_t bbox_offset);
 };
 
 
@@ -139,29 +118,29 @@ public:
 		bvh = &accel;
 	}
 
-	virtual void init_rays(Ray* begin, Ray* end) {
-		rays = begin;
+	virtual void init_rays(RayStream* rays_, size_t begin, size_t end) {
+		rays = rays_;
 		rays_end = end;
 
 		// Initialize stack
 		stack_ptr = 0;
 		node_stack[0] = 0;
-		ray_stack[0].first = rays;
-		ray_stack[0].second = rays_end;
+		ray_stack[0].first = begin;
+		ray_stack[0].second = end;
 	}
 
-	virtual std::tuple<Ray*, Ray*, size_t> next_object();
+	virtual std::tuple<size_t, size_t, size_t> next_object();
 
 private:
 	const BVH* bvh = nullptr;
-	Ray* rays = nullptr;
-	Ray* rays_end = nullptr;
+	RayStream* rays = nullptr;
+	size_t rays_end = 0;
 
 	// Stack data
 #define BVHST_STACK_SIZE 64
 	int stack_ptr;
 	size_t node_stack[BVHST_STACK_SIZE];
-	std::pair<Ray*, Ray*> ray_stack[BVHST_STACK_SIZE];
+	std::pair<size_t, size_t> ray_stack[BVHST_STACK_SIZE];
 
 };
 
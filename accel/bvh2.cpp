@@ -25,66 +25,7 @@ void BVH2::build(const Assembly& assembly) {
 
 	// Pack BVH into more efficient BVH2
 	nodes.push_back(Node());
-	for (size_t bni = 0; bni < bvh.nodes.size(); ++bni) {
-		BVH::Node& bn = bvh.nodes[bni];
-		size_t ni = nodes.size() - 1; // Node index
-
-		// Set the values that don't depend on whether this
-		// is a leaf node or not.
-		if (bn.flags & IS_RIGHT)
-			nodes[bn.parent_index].child_index = ni;  // Set parent's child_index field to point to this
-
-		// Set the values that _do_ depend on whether this is
-		// a leaf node or not.
-		if (bn.flags & BVH::IS_LEAF) {
-			nodes[ni].child_index = 0; // Indicates that this is a leaf node
-			nodes[ni].data_index = bn.data_index;
-			nodes.push_back(Node());
-		} else {
-			BVH::Node& child1 = bvh.nodes[bvh.child1(bni)];
-			BVH::Node& child2 = bvh.nodes[bvh.child2(bni)];
-
-			// Let right child know that it's right
-			child2.flags |= IS_RIGHT;
-
-			// Set the parent index fields in the child build nodes
-			// to refer to the parent Node instead of the parent BVH::Node
-			child1.parent_index = ni;
-			child2.parent_index = ni;
-
-			// If children have same number of time samples, easy
-			if (child1.ts == child2.ts) {
-				nodes[ni].ts = child1.ts;
-				for (uint16_t i = 0; i < child1.ts; ++i) {
-					nodes.back().bounds = BBox2(bvh.bboxes[child1.bbox_index+i], bvh.bboxes[child2.bbox_index+i]);
-					nodes.push_back(Node());
-				}
-			}
-			// If children have different number of time samples,
-			// interpolate one or the other
-			else if (child1.ts > child2.ts) {
-				nodes[ni].ts = child1.ts;
-				const float s = child1.ts - 1;
-				auto cbegin = bvh.bboxes.cbegin() + child2.bbox_index;
-				auto cend = cbegin + child2.ts;
-
-				for (uint16_t i = 0; i < child1.ts; ++i) {
-					nodes.back().bounds = BBox2(bvh.bboxes[child1.bbox_index+i], lerp_seq(i/s, cbegin, cend));
-					nodes.push_back(Node());
-				}
-			} else {
-				nodes[ni].ts = child2.ts;
-				const float s = child2.ts - 1;
-				auto cbegin = bvh.bboxes.cbegin() + child1.bbox_index;
-				auto cend = cbegin + child1.ts;
-
-				for (uint16_t i = 0; i < child2.ts; ++i) {
-					nodes.back().bounds = BBox2(lerp_seq(i/s, cbegin, cend), bvh.bboxes[child2.bbox_index+i]);
-					nodes.push_back(Node());
-				}
-			}
-		}
-	}
+	pack(bvh, 0);
 
 	// Store top-level bounds
 	auto begin = bvh.bboxes.begin() + bvh.nodes[0].bbox_index;
@@ -95,15 +36,73 @@ void BVH2::build(const Assembly& assembly) {
 
 
 
-std::tuple<Ray*, Ray*, size_t> BVH2StreamTraverser::next_object() {
+/*
+ * Packs the subtree under the given node of bvh into nodes, depth first,
+ * starting at the last node.  The first child of each node follows its
+ * time samples, and the second child is at its child_index.
+ */
+void BVH2::pack(const BVH& bvh, const size_t bvh_node_i) {
+	const BVH::Node& bn = bvh.nodes[bvh_node_i];
+	const size_t ni = nodes.size() - 1; // Node index
+
+	if (bvh.is_leaf(bvh_node_i)) {
+		nodes[ni].child_index = 0; // Indicates that this is a leaf node
+		nodes[ni].data_index = bn.data_index;
+		nodes.push_back(Node());
+		return;
+	}
+
+	const BVH::Node& child1 = bvh.nodes[bvh.child1(bvh_node_i)];
+	const BVH::Node& child2 = bvh.nodes[bvh.child2(bvh_node_i)];
+
+	// If children have same number of time samples, easy
+	if (child1.ts == child2.ts) {
+		nodes[ni].ts = child1.ts;
+		for (uint16_t i = 0; i < child1.ts; ++i) {
+			nodes.back().bounds = BBox2(bvh.bboxes[child1.bbox_index+i], bvh.bboxes[child2.bbox_index+i]);
+			nodes.push_back(Node());
+		}
+	}
+	// If children have different number of time samples,
+	// interpolate one or the other
+	else if (child1.ts > child2.ts) {
+		nodes[ni].ts = child1.ts;
+		const float s = child1.ts - 1;
+		auto cbegin = bvh.bboxes.cbegin() + child2.bbox_index;
+		auto cend = cbegin + child2.ts;
+
+		for (uint16_t i = 0; i < child1.ts; ++i) {
+			nodes.back().bounds = BBox2(bvh.bboxes[child1.bbox_index+i], lerp_seq(i/s, cbegin, cend));
+			nodes.push_back(Node());
+		}
+	} else {
+		nodes[ni].ts = child2.ts;
+		const float s = child2.ts - 1;
+		auto cbegin = bvh.bboxes.cbegin() + child1.bbox_index;
+		auto cend = cbegin + child1.ts;
+
+		for (uint16_t i = 0; i < child2.ts; ++i) {
+			nodes.back().bounds = BBox2(lerp_seq(i/s, cbegin, cend), bvh.bboxes[child2.bbox_index+i]);
+			nodes.push_back(Node());
+		}
+	}
+
+	pack(bvh, bvh.child1(bvh_node_i));
+	nodes[ni].child_index = nodes.size() - 1;
+	pack(bvh, bvh.child2(bvh_node_i));
+}
+
+
+
+std::tuple<size_t, size_t, size_t> BVH2StreamTraverser::next_object() {
 	while (stack_ptr >= 0) {
 		if (bvh->is_leaf(node_stack[stack_ptr])) {
-			ray_stack[stack_ptr].second = mutable_partition(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, [&](Ray& ray) {
-				return !ray.is_done() && (first_call || ray.trav_stack.pop());
+			ray_stack[stack_ptr].second = rays->partition(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, [&](size_t i) {
+				return !rays->is_done(i) && (first_call || rays->trav_stack[rays->slot(i)].pop());
 			});
 
-			if (std::distance(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second) > 0) {
-				auto rv = std::make_tuple(&(*ray_stack[stack_ptr].first), &(*ray_stack[stack_ptr].second), bvh->nodes[node_stack[stack_ptr]].data_index);
+			if (ray_stack[stack_ptr].first != ray_stack[stack_ptr].second) {
+				auto rv = std::make_tuple(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, bvh->nodes[node_stack[stack_ptr]].data_index);
 				--stack_ptr;
 				return rv;
 			} else {
@@ -118,13 +117,14 @@ std::tuple<Ray*, Ray*, size_t> BVH2StreamTraverser::next_object() {
 			bool flip = false;
 
 			// Test rays against current node's children
-			ray_stack[stack_ptr].second = mutable_partition(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, [&](Ray& ray) {
-				if (!ray.is_done() && (first_call || ray.trav_stack.pop())) {
+			ray_stack[stack_ptr].second = rays->partition(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, [&](size_t i) {
+				const size_t s = rays->slot(i);
+				if (!rays->is_done(i) && (first_call || rays->trav_stack[s].pop())) {
 					// Get the time-interpolated bounding box
-					const BBox2 b = lerp_seq(ray.time, cbegin, cend).bounds;
+					const BBox2 b = lerp_seq(rays->time[s], cbegin, cend).bounds;
 
 					// Ray test
-					const auto hit_mask = b.intersect_ray(ray, &near_hits);
+					const auto hit_mask = b.intersect_ray(rays->o[s], rays->d_inv[s], rays->max_t[s], &near_hits);
 
 					if (hit_mask != 0) {
 						if (!flip_set) {
@@ -133,9 +133,9 @@ std::tuple<Ray*, Ray*, size_t> BVH2StreamTraverser::next_object() {
 						}
 
 						if (flip)
-							ray.trav_stack.push((hit_mask >> 1) | (hit_mask << 1), 2);
+							rays->trav_stack[s].push((hit_mask >> 1) | (hit_mask << 1), 2);
 						else
-							ray.trav_stack.push(hit_mask, 2);
+							rays->trav_stack[s].push(hit_mask, 2);
 					}
 
 					return hit_mask != 0;
@@ -148,7 +148,7 @@ std::tuple<Ray*, Ray*, size_t> BVH2StreamTraverser::next_object() {
 				first_call = false;
 
 			// If any rays hit, traverse deeper
-			if (std::distance(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second) > 0) {
+			if (ray_stack[stack_ptr].first != ray_stack[stack_ptr].second) {
 				ray_stack[stack_ptr+1] = ray_stack[stack_ptr];
 
 				if (flip) {
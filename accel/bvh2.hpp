@@ -70,9 +70,7 @@ private:
 	std::vector<Node> nodes;
 	std::vector<BBox> _bounds {BBox()};
 
-	enum {
-		IS_RIGHT = 1 << 1
-	};
+	void pack(const BVH& bvh, size_t bvh_node_i);
 
 	/**
 	 * @brief Returns the index of the first child
@@ -116,8 +114,8 @@ public:
 		bvh = &accel;
 	}
 
-	virtual void init_rays(Ray* begin, Ray* end) {
-		rays = begin;
+	virtual void init_rays(RayStream* rays_, size_t begin, size_t end) {
+		rays = rays_;
 		rays_end = end;
 		first_call = true;
 
@@ -128,23 +126,23 @@ public:
 			stack_ptr = 0;
 		}
 		node_stack[0] = 0;
-		ray_stack[0].first = rays;
-		ray_stack[0].second = rays_end;
+		ray_stack[0].first = begin;
+		ray_stack[0].second = end;
 	}
 
-	virtual std::tuple<Ray*, Ray*, size_t> next_object();
+	virtual std::tuple<size_t, size_t, size_t> next_object();
 
 private:
 	const BVH2* bvh = nullptr;
-	Ray* rays = nullptr;
-	Ray* rays_end = nullptr;
+	RayStream* rays = nullptr;
+	size_t rays_end = 0;
 	bool first_call = true;
 
 	// Stack data
 #define BVH2_STACK_SIZE 64
 	int stack_ptr;
 	size_t node_stack[BVH2_STACK_SIZE];
-	std::pair<Ray*, Ray*> ray_stack[BVH2_STACK_SIZE];
+	std::pair<size_t, size_t> ray_stack[BVH2_STACK_SIZE];
 
 };
 
@@ -4,6 +4,8 @@
 #include <tuple>
 #include <iterator>
 #include <cmath>
+#include <limits>
+#include <cassert>
 
 #include "numtype.h"
 #include "bvh4.hpp"
@@ -12,195 +14,936 @@
 #include "ray.hpp"
 #include "assembly.hpp"
 #include "utils.hpp"
+#include "config.hpp"
+#include "cpu_dispatch.hpp"
+#include "accel_cache.hpp"
 
 
-void BVH4::build(const Assembly& assembly) {
-	// Build a normal BVH as a starting point
-	BVH bvh;
-	bvh.build(assembly);
+void BVH4::build(const Assembly& _assembly) {
+	assembly = &_assembly;
 
-	if (bvh.nodes.size() == 0)
-		return;
+	fill_bag(_assembly);
 
+	// Build the trees, unless they're in the cache
+	const bool use_cache = !Config::accel_cache_dir.empty() && bag.size() >= CACHE_MIN_PRIMS;
+	const uint64_t key = use_cache ? cache_key() : 0;
+	if (!use_cache || !load_cache(key)) {
+		build_trees();
+		if (use_cache)
+			save_cache(key);
+	}
+	depth = tree_depth(nodes, time_segments);
+
+	// Traversing a tree leaves as many bits on a ray's traversal stack as
+	// it uses node stack entries, so a tree too deep for the rays' stacks
+	// can't be traversed at all.  That only happens with very lopsided SAH
+	// splits, so rebuild it with even ones instead.
+	if (trav_stack_bits(0) > RayStream::TRAV_STACK_BITS) {
+		std::cout << "WARNING: BVH4 is too deep to traverse (" << depth << " levels), rebuilding it with median splits." << std::endl;
+		nodes.clear();
+		node_bounds.clear();
+		fill_bag(_assembly);
+		median_splits = true;
+		build_trees();
+		median_splits = false;
+		if (use_cache)
+			save_cache(key);
+		depth = tree_depth(nodes, time_segments);
+	}
+	assert(trav_stack_bits(0) <= RayStream::TRAV_STACK_BITS);
 
-	// Pack BVH into BVH4
-	nodes.push_back(Node());
+	update_visibility();
 
-	for (size_t bni = 0; bni < bvh.nodes.size(); ++bni) {
-		BVH::Node& bn = bvh.nodes[bni];
-		size_t ni = nodes.size() - 1; // Node index
+	// Clear build data
+	clear_bag();
+	split = std::vector<uint8_t>();
+}
 
-		// Skip nodes that are intermediaries
-		if (bn.flags & IS_SKIP)
-			continue;
 
-		// Set the values that don't depend on whether this
-		// is a leaf node or not.
-		if (bn.flags & IS_2ND) {
-			nodes[bn.parent_index].child_indices[0] = ni;
-		} else if (bn.flags & IS_3RD) {
-			nodes[bn.parent_index].child_indices[1] = ni;
-		} else if (bn.flags & IS_4TH) {
-			nodes[bn.parent_index].child_indices[2] = ni;
-		}
-
-		// Set the values that _do_ depend on whether this is
-		// a leaf node or not.
-		if (bn.flags & BVH::IS_LEAF) {
-			nodes[ni].child_indices[0] = 0; // Indicates that this is a leaf node
-			nodes[ni].data_index = bn.data_index;
-			nodes.push_back(Node());
-		} else {
-			// Collect children
-			int child_count = 0;
-			BVH::Node* children[4] = {nullptr, nullptr, nullptr, nullptr};
-			const int ci1 = bni+1;
-			const int ci2 = bn.child_index;
-			if (bvh.nodes[ci1].flags & BVH::IS_LEAF) {
-				children[child_count++] = &(bvh.nodes[ci1]);
-			} else {
-				bvh.nodes[ci1].flags |= IS_SKIP;
-				children[child_count++] = &(bvh.nodes[ci1+1]);
-				children[child_count++] = &(bvh.nodes[bvh.nodes[ci1].child_index]);
-			}
-			if (bvh.nodes[ci2].flags & BVH::IS_LEAF) {
-				children[child_count++] = &(bvh.nodes[ci2]);
-			} else {
-				bvh.nodes[ci2].flags |= IS_SKIP;
-				children[child_count++] = &(bvh.nodes[ci2+1]);
-				children[child_count++] = &(bvh.nodes[bvh.nodes[ci2].child_index]);
+/*
+ * Builds the trees from the primitives in bag.
+ */
+void BVH4::build_trees() {
+	// Split large static instances into several primitives
+	split.clear();
+	has_split_instances = false;
+	if (Config::bvh_split_budget > 0.0f && bag.size() > 1)
+		split_instances(static_cast<size_t>(bag.size() * Config::bvh_split_budget));
+
+	// Only split motion blurred assemblies into time segments
+	time_segments = (bag_time_samples > 1) ? Config::bvh_time_segments : 1;
+	assert(time_segments >= 1 && time_segments <= MAX_TIME_SEGMENTS);
+
+	if (bag.size() > 0 && time_segments == 1) {
+		nodes.push_back(Node());
+		_bounds = recursive_build(&nodes, &node_bounds, 0, 0, bag.size()-1, Config::build_threads);
+	} else if (bag.size() > 0) {
+		// Build a tree for each time segment, from the primitives' bounds
+		// over just that segment.  The roots go at the start of nodes.
+		const std::vector<std::vector<BBox>> all_instance_bbs = std::move(instance_bbs);
+		const size_t all_time_samples = bag_time_samples;
+		nodes.resize(time_segments);
+		for (int seg = 0; seg < time_segments; ++seg) {
+			const float t0 = static_cast<float>(seg) / time_segments;
+			const float t1 = static_cast<float>(seg + 1) / time_segments;
+
+			instance_bbs.clear();
+			for (const auto& bbs: all_instance_bbs)
+				instance_bbs.emplace_back(segment_bounds(bbs, t0, t1, segment_time_samples(bbs.size())));
+
+			bag_time_samples = segment_time_samples(all_time_samples);
+			bag_bounds.resize(bag.size() * bag_time_samples);
+			for (size_t i = 0; i < bag.size(); ++i) {
+				auto& prim = bag[i];
+				prim.bounds_index = i * bag_time_samples;
+
+				// Split instances are static, and keep their bounds
+				if (!split.empty() && split[prim.instance_index]) {
+					std::fill_n(bag_bounds.begin() + prim.bounds_index, bag_time_samples, BBox(prim.bmin, prim.bmax));
+					continue;
+				}
+
+				const auto& bbs = instance_bbs[prim.instance_index];
+				const BBox bb = lerp_seq(0.5f, bbs);
+				prim.bmin = bb.min;
+				prim.bmax = bb.max;
+				prim.c = lerp(0.5f, bb.min, bb.max);
+				for (size_t t = 0; t < bag_time_samples; ++t)
+					bag_bounds[prim.bounds_index + t] = lerp_seq(static_cast<float>(t) / (bag_time_samples - 1), bbs);
 			}
 
-			// Let the children know their place in the world
-			if (children[1])
-				children[1]->flags |= IS_2ND;
-			if (children[2])
-				children[2]->flags |= IS_3RD;
-			if (children[3])
-				children[3]->flags |= IS_4TH;
-
-			// Set the parent index fields in the child build nodes
-			// to refer to the parent Node instead of the parent BVH::Node
-			for (int i = 0; i < child_count; ++i)
-				children[i]->parent_index = ni;
-
-			// Figure out if the children have the same number of time samples
-			bool equal_time_samples = true;
-			int most_time_samples = children[0]->ts;
-			for (int i = 1; i < child_count; ++i) {
-				equal_time_samples = equal_time_samples && (children[i-1]->ts == children[i]->ts);
-				if (children[i]->ts > most_time_samples)
-					most_time_samples = children[i]->ts;
+			recursive_build(&nodes, &node_bounds, seg, 0, bag.size()-1, Config::build_threads);
+		}
+
+		// Bounds of the whole assembly, over the whole shutter
+		_bounds = union_bounds(all_instance_bbs.data(), all_instance_bbs.size());
+	}
+	nodes.shrink_to_fit();
+	node_bounds.shrink_to_fit();
+	built_sah_cost = sah_cost();
+
+	// Quantize the node bounds if requested
+	bounds_bits = Config::bvh_bounds_bits;
+	quantize_bounds();
+}
+
+
+/*
+ * Returns the key for caching the trees built from the primitives in bag
+ * (see AccelCache), which covers everything the build depends on.
+ */
+uint64_t BVH4::cache_key() const {
+	AccelCache::Key key;
+	key.add(Config::bvh_bounds_bits);
+	key.add(Config::bvh_time_segments);
+	key.add(Config::bvh_split_budget);
+	key.add(bag_time_samples);
+	for (const auto& bbs: instance_bbs)
+		key.add(bbs);
+	for (const auto& prim: bag) {
+		key.add(prim.instance_index);
+		key.add(prim.bmin);
+		key.add(prim.bmax);
+	}
+	return key.value();
+}
+
+
+/*
+ * Loads the trees from the cache file with the given key, if there is one.
+ * Returns whether that succeeded.
+ */
+bool BVH4::load_cache(const uint64_t key) {
+	AccelCache::Reader reader;
+	uint8_t split_instances;
+	if (!reader.open(Config::accel_cache_dir, "bvh4", key)
+	        || !reader.read(&nodes)
+	        || !reader.read(&node_bounds)
+	        || !reader.read(&node_bounds_16)
+	        || !reader.read(&node_bounds_8)
+	        || !reader.read(&root_frames)
+	        || !reader.read(&_bounds)
+	        || !reader.read_value(&bounds_bits)
+	        || !reader.read_value(&time_segments)
+	        || !reader.read_value(&split_instances)
+	        || !reader.read_value(&built_sah_cost)) {
+		nodes.clear();
+		node_bounds.clear();
+		node_bounds_16.clear();
+		node_bounds_8.clear();
+		root_frames.clear();
+		return false;
+	}
+	has_split_instances = split_instances != 0;
+	return true;
+}
+
+
+/*
+ * Saves the trees to the cache file with the given key.
+ */
+void BVH4::save_cache(const uint64_t key) const {
+	AccelCache::Writer writer(Config::accel_cache_dir, "bvh4", key);
+	writer.write(nodes);
+	writer.write(node_bounds);
+	writer.write(node_bounds_16);
+	writer.write(node_bounds_8);
+	writer.write(root_frames);
+	writer.write(_bounds);
+	writer.write_value(bounds_bits);
+	writer.write_value(time_segments);
+	writer.write_value(static_cast<uint8_t>(has_split_instances));
+	writer.write_value(built_sah_cost);
+	if (!writer.commit())
+		std::cout << "WARNING: couldn't write BVH4 to the cache in '" << Config::accel_cache_dir << "'." << std::endl;
+}
+
+
+/*
+ * Updates the bounds of the tree for the given assembly, keeping the
+ * tree's structure.  The assembly should have the same instances as the
+ * one the tree was built for, though their bounds may have changed (e.g.
+ * the next frame of an animation).
+ *
+ * Returns false if the tree's structure doesn't fit the instances anymore,
+ * or if its SAH cost has grown by more than Config::refit_threshold times
+ * its cost when it was built.  The tree is then left in an unspecified
+ * state, and should be rebuilt.
+ */
+bool BVH4::refit(const Assembly& _assembly) {
+	assembly = &_assembly;
+	const auto& instances = assembly->instances;
+
+	// Trees with split instances can't be refit, since the split
+	// primitives' bounds aren't kept
+	if (nodes.empty() || has_split_instances)
+		return false;
+
+	instance_bbs.clear();
+	instance_bbs.reserve(instances.size());
+	size_t most_time_samples = 1;
+	for (size_t i = 0; i < instances.size(); ++i) {
+		instance_bbs.emplace_back(assembly->instance_bounds(i));
+		most_time_samples = std::max(most_time_samples, instance_bbs.back().size());
+	}
+	if (((most_time_samples > 1) ? Config::bvh_time_segments : 1) != time_segments)
+		return false;
+
+	// Refit with the node bounds at full precision
+	if (bounds_bits == 16)
+		node_bounds.resize(node_bounds_16.size());
+	else if (bounds_bits == 8)
+		node_bounds.resize(node_bounds_8.size());
+
+	bool fits = true;
+	if (time_segments == 1) {
+		_bounds = refit_recursive(0, &fits);
+	} else {
+		const std::vector<std::vector<BBox>> all_instance_bbs = std::move(instance_bbs);
+		for (int seg = 0; seg < time_segments && fits; ++seg) {
+			const float t0 = static_cast<float>(seg) / time_segments;
+			const float t1 = static_cast<float>(seg + 1) / time_segments;
+			instance_bbs.clear();
+			for (const auto& bbs: all_instance_bbs)
+				instance_bbs.emplace_back(segment_bounds(bbs, t0, t1, segment_time_samples(bbs.size())));
+			refit_recursive(seg, &fits);
+		}
+		_bounds = union_bounds(all_instance_bbs.data(), all_instance_bbs.size());
+	}
+	instance_bbs = std::vector<std::vector<BBox>>();
+
+	if (!fits || sah_cost() > (built_sah_cost * Config::refit_threshold))
+		return false;
+
+	quantize_bounds();
+	update_visibility();
+	return true;
+}
+
+
+/*
+ * Recursively updates the bounds of the subtree under nodes[node_i] from
+ * instance_bbs, and returns the bounds of the subtree the same way as
+ * recursive_build().
+ *
+ * Sets *fits to false if the number of time samples of any node's children
+ * has changed.
+ */
+std::vector<BBox> BVH4::refit_recursive(const size_t node_i, bool* fits) {
+	Node& node = nodes[node_i];
+
+	if (node.child_count == 0) {
+		if (node.data_index >= instance_bbs.size()) {
+			*fits = false;
+			return std::vector<BBox> {BBox()};
+		}
+		const auto& bbs = instance_bbs[node.data_index];
+		node.flags = (bbs.size() == 1) ? STATIC_SUBTREE : 0;
+		return bbs;
+	}
+
+	std::vector<BBox> child_bbs[4];
+	bool all_static = true;
+	size_t most_time_samples = 1;
+	for (int c = 0; c < node.child_count; ++c) {
+		child_bbs[c] = refit_recursive(child(node_i, c), fits);
+		most_time_samples = std::max(most_time_samples, child_bbs[c].size());
+		all_static = all_static && (nodes[child(node_i, c)].flags & STATIC_SUBTREE);
+	}
+	if (!*fits || most_time_samples != node.ts) {
+		*fits = false;
+		return child_bbs[0];
+	}
+
+	node.flags = (node.flags & ~STATIC_SUBTREE) | ((all_static && most_time_samples == 1) ? STATIC_SUBTREE : 0);
+	for (size_t i = 0; i < most_time_samples; ++i)
+		node_bounds[node.bounds_index + i] = child_bounds_at(child_bbs, node.child_count, i, most_time_samples);
+
+	return union_bounds(child_bbs, node.child_count);
+}
+
+
+/*
+ * Returns the SAH cost of the tree, computed from the full-precision node
+ * bounds: the sum of the surface areas of all nodes below the roots,
+ * relative to the surface area of the tree's bounds, and averaged over
+ * their time samples.  That's proportional to the expected number of nodes
+ * a ray visits.
+ */
+float BVH4::sah_cost() const {
+	float sum = 0.0f;
+	for (const auto& node: nodes) {
+		for (int c = 0; c < node.child_count; ++c) {
+			float area = 0.0f;
+			for (size_t i = 0; i < node.ts; ++i) {
+				const BBox4& b = node_bounds[node.bounds_index + i];
+				area += BBox(Vec3(b.bounds[0][c], b.bounds[2][c], b.bounds[4][c]), Vec3(b.bounds[1][c], b.bounds[3][c], b.bounds[5][c])).surface_area();
 			}
+			sum += area / node.ts;
+		}
+	}
+
+	float root_area = 0.0f;
+	for (const auto& bb: _bounds)
+		root_area += bb.surface_area() / _bounds.size();
+	return (root_area > 0.0f) ? (sum / root_area) : 0.0f;
+}
+
+
+/*
+ * Computes node_visibility from the visibility of the assembly's
+ * instances, or leaves it empty if they're all fully visible.
+ */
+void BVH4::update_visibility() {
+	node_visibility.clear();
+	if (!assembly->has_visibility_masks())
+		return;
 
-			// If children have same number of time samples, easy
-			if (equal_time_samples) {
-				nodes[ni].ts = children[0]->ts;
-				for (uint16_t i = 0; i < children[0]->ts; ++i) {
-					switch (child_count) {
-						case 2:
-							nodes.back().bounds = BBox4(bvh.bboxes[children[0]->bbox_index+i], bvh.bboxes[children[1]->bbox_index+i], BBox(), BBox());
-							break;
-						case 3:
-							nodes.back().bounds = BBox4(bvh.bboxes[children[0]->bbox_index+i], bvh.bboxes[children[1]->bbox_index+i], bvh.bboxes[children[2]->bbox_index+i], BBox());
-							break;
-						case 4:
-							nodes.back().bounds = BBox4(bvh.bboxes[children[0]->bbox_index+i], bvh.bboxes[children[1]->bbox_index+i], bvh.bboxes[children[2]->bbox_index+i], bvh.bboxes[children[3]->bbox_index+i]);
-							break;
+	// Children are always after their parents, so going backwards visits
+	// the children first
+	node_visibility.resize(nodes.size());
+	for (size_t i = nodes.size(); i-- > 0;) {
+		const Node& node = nodes[i];
+		if (node.child_count == 0) {
+			node_visibility[i] = assembly->instances[node.data_index].visibility;
+		} else {
+			node_visibility[i] = 0;
+			for (int c = 0; c < node.child_count; ++c)
+				node_visibility[i] |= node_visibility[node.child_index + c];
+		}
+	}
+}
+
+
+/*
+ * Converts node_bounds to the precision in bounds_bits, if it's less than
+ * full.
+ *
+ * Each node's child bounds are quantized relative to a frame instead of
+ * storing one with them: the roots' relative to root_frames, and the other
+ * nodes' relative to the node's decoded bounds in its parent, over all of
+ * the parent's time samples (see child_frame()).  A node's bounds in its
+ * parent are interpolated when they have different numbers of time
+ * samples, so those are first widened to enclose each of the node's own
+ * time samples, which keeps the frames enclosing what they're the frame of.
+ */
+void BVH4::quantize_bounds() {
+	root_frames.clear();
+	if (bounds_bits != 16 && bounds_bits != 8)
+		return;
+
+	// Widen the nodes' bounds in their parents, children first (they're
+	// always after their parents)
+	std::vector<BBox4> bounds = node_bounds;
+	for (size_t node_i = nodes.size(); node_i-- > 0;) {
+		const Node& node = nodes[node_i];
+		for (int c = 0; c < node.child_count; ++c) {
+			const Node& child = nodes[node.child_index + c];
+			for (size_t j = 0; j < child.ts && child.child_count > 0; ++j) {
+				BBox bb;
+				for (int cc = 0; cc < child.child_count; ++cc)
+					bb = bb | bounds[child.bounds_index + j].get_bbox(cc);
+
+				// Into the node's time samples on either side of it
+				const float t = (child.ts > 1) ? (static_cast<float>(j) / (child.ts - 1)) * (node.ts - 1) : 0.0f;
+				const size_t samples[2] = {static_cast<size_t>(std::floor(t)), std::min<size_t>(std::ceil(t), node.ts - 1)};
+				for (const size_t i: samples) {
+					BBox4& b = bounds[node.bounds_index + i];
+					const BBox wide = b.get_bbox(c) | bb;
+					for (int axis = 0; axis < 3; ++axis) {
+						b.bounds[axis*2][c] = wide.min[axis];
+						b.bounds[axis*2+1][c] = wide.max[axis];
 					}
-					nodes.push_back(Node());
 				}
 			}
-			// If children have different number of time samples,
-			// interpolate to the same number
-			else {
-				nodes[ni].ts = most_time_samples;
-				const float s = nodes[ni].ts - 1;
-
-				for (uint16_t i = 0; i < nodes[ni].ts; ++i) {
-					BBox bb[4];
-
-					for (int ci = 0; ci < child_count; ++ci) {
-						if (children[ci]->ts == most_time_samples) {
-							bb[ci] = bvh.bboxes[children[ci]->bbox_index+i];
-						} else {
-							auto cbegin = bvh.bboxes.cbegin() + children[ci]->bbox_index;
-							auto cend = cbegin + children[ci]->ts;
-							bb[ci] = lerp_seq(i/s, cbegin, cend);
-						}
-					}
+		}
+	}
 
-					switch (child_count) {
-						case 2:
-							nodes.back().bounds = BBox4(bb[0], bb[1], BBox(), BBox());
-							break;
-						case 3:
-							nodes.back().bounds = BBox4(bb[0], bb[1], bb[2], BBox());
-							break;
-						case 4:
-							nodes.back().bounds = BBox4(bb[0], bb[1], bb[2], bb[3]);
-							break;
-					}
+	// The roots' frames enclose all of their children over time
+	for (size_t seg = 0; seg < static_cast<size_t>(time_segments) && seg < nodes.size(); ++seg) {
+		BBox frame;
+		for (size_t i = 0; i < nodes[seg].ts; ++i) {
+			for (int c = 0; c < nodes[seg].child_count; ++c)
+				frame = frame | bounds[nodes[seg].bounds_index + i].get_bbox(c);
+		}
+		if (!(frame.min.x <= frame.max.x))
+			frame = BBox(Vec3(0.0f, 0.0f, 0.0f), Vec3(0.0f, 0.0f, 0.0f));
+		root_frames.push_back(frame);
+	}
 
-					nodes.push_back(Node());
-				}
+	// Quantize, parents first, keeping track of the frames
+	std::vector<BBox> frames(nodes.size());
+	std::copy(root_frames.begin(), root_frames.end(), frames.begin());
+	std::vector<BBox4> decoded;
+	if (bounds_bits == 16)
+		node_bounds_16.resize(bounds.size());
+	else
+		node_bounds_8.resize(bounds.size());
+	for (size_t node_i = 0; node_i < nodes.size(); ++node_i) {
+		const Node& node = nodes[node_i];
+		if (node.child_count == 0)
+			continue;
+
+		decoded.resize(node.ts);
+		for (size_t i = 0; i < node.ts; ++i) {
+			const size_t bi = node.bounds_index + i;
+			if (bounds_bits == 16) {
+				node_bounds_16[bi] = QuantizedBBox4<uint16_t>(bounds[bi], frames[node_i]);
+				decoded[i] = node_bounds_16[bi].decode(frames[node_i]);
+			} else {
+				node_bounds_8[bi] = QuantizedBBox4<uint8_t>(bounds[bi], frames[node_i]);
+				decoded[i] = node_bounds_8[bi].decode(frames[node_i]);
 			}
 		}
+
+		for (int c = 0; c < node.child_count; ++c)
+			frames[node.child_index + c] = child_frame(decoded.data(), node.ts, c);
 	}
-	nodes.pop_back();
-	nodes.shrink_to_fit();
 
+	node_bounds = std::vector<BBox4>();
+}
 
-	// Store top-level bounds
-	auto begin = bvh.bboxes.begin() + bvh.nodes[0].bbox_index;
-	auto end = begin + bvh.nodes[0].ts;
-	_bounds.clear();
-	_bounds.insert(_bounds.begin(), begin, end);
+
+/*
+ * Splits the bounds of large static instances into several primitives in
+ * bag, for up to max_new_prims new primitives.
+ *
+ * A long or large instance (a road, a terrain tile) has bounds that
+ * overlap much of the scene, and every node it's grouped into gets bounds
+ * at least that big.  Splitting its bounds into pieces lets the build
+ * group each piece with its neighbors instead.  The pieces only bound the
+ * part of the instance inside them, but the whole instance is still
+ * tested when a ray reaches any of them, so no hits are missed.
+ *
+ * The largest primitive is split repeatedly, in half along its longest
+ * axis, until the remaining ones are all near the average size.  The split
+ * planes are snapped to a power-of-two grid over the assembly's bounds, so
+ * that pieces of neighboring instances line up.
+ *
+ * Motion blurred instances aren't split, since clipping bounds at each
+ * time sample isn't conservative in between them.
+ */
+void BVH4::split_instances(const size_t max_new_prims) {
+	// Bounds and average surface area of all primitives
+	BBox scene_bb;
+	float average_area = 0.0f;
+	for (const auto& prim: bag) {
+		const BBox bb(prim.bmin, prim.bmax);
+		scene_bb.merge_with(bb);
+		average_area += bb.surface_area() / bag.size();
+	}
+	const Vec3 scene_extent = scene_bb.max - scene_bb.min;
+
+	// Queue of the static primitives by surface area
+	std::vector<std::pair<float, size_t>> queue;
+	for (size_t i = 0; i < bag.size(); ++i) {
+		if (instance_bbs[bag[i].instance_index].size() == 1)
+			queue.emplace_back(bag_bounds[bag[i].bounds_index].surface_area(), i);
+	}
+	std::make_heap(queue.begin(), queue.end());
+
+	split.resize(instance_bbs.size(), 0);
+	size_t new_prims = 0;
+	while (new_prims < max_new_prims && !queue.empty() && queue.front().first > (average_area * SPLIT_AREA_RATIO)) {
+		std::pop_heap(queue.begin(), queue.end());
+		const size_t i = queue.back().second;
+		queue.pop_back();
+
+		// Find the coarsest grid plane inside the primitive along its
+		// longest axis
+		const BBox bb = bag_bounds[bag[i].bounds_index];
+		const Vec3 extent = bb.max - bb.min;
+		const int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : ((extent.y >= extent.z) ? 1 : 2);
+		float plane = bb.max[axis];
+		for (int level = 1; level < 24 && !(plane < bb.max[axis]); ++level) {
+			const float cell = scene_extent[axis] / (1 << level);
+			plane = scene_bb.min[axis] + ((std::floor((bb.min[axis] - scene_bb.min[axis]) / cell) + 1.0f) * cell);
+		}
+		if (!(plane > bb.min[axis] && plane < bb.max[axis]))
+			continue;
+
+		// Split it into two primitives
+		BBox low = bb;
+		BBox high = bb;
+		low.max[axis] = plane;
+		high.min[axis] = plane;
+
+		BVHPrimitive high_prim = bag[i];
+		high_prim.bounds_index = bag_bounds.size();
+		high_prim.bmin = high.min;
+		high_prim.bmax = high.max;
+		high_prim.c = lerp(0.5f, high.min, high.max);
+		bag_bounds.insert(bag_bounds.end(), bag_time_samples, high);
+		bag.push_back(high_prim);
+
+		bag[i].bmin = low.min;
+		bag[i].bmax = low.max;
+		bag[i].c = lerp(0.5f, low.min, low.max);
+		std::fill_n(bag_bounds.begin() + bag[i].bounds_index, bag_time_samples, low);
+
+		split[bag[i].instance_index] = 1;
+		has_split_instances = true;
+		++new_prims;
+
+		queue.emplace_back(low.surface_area(), i);
+		std::push_heap(queue.begin(), queue.end());
+		queue.emplace_back(high.surface_area(), bag.size() - 1);
+		std::push_heap(queue.begin(), queue.end());
+	}
+}
+
+
+/*
+ * Returns bounds with the given number of time samples, evenly spaced over
+ * the time segment [t0, t1], that enclose the given bounds (evenly spaced
+ * over the whole shutter) throughout the segment.
+ *
+ * Where the original bounds have time samples inside one of the new
+ * intervals, their motion isn't linear over it.  Both ends of the interval
+ * are then grown to enclose all of its original samples, so that the
+ * interpolated bounds still enclose the original ones.
+ */
+std::vector<BBox> BVH4::segment_bounds(const std::vector<BBox>& bbs, const float t0, const float t1, const size_t time_samples) {
+	if (bbs.size() == 1)
+		return bbs;
+
+	std::vector<BBox> seg_bbs(time_samples);
+	for (size_t t = 0; t < time_samples; ++t)
+		seg_bbs[t] = lerp_seq(lerp(static_cast<float>(t) / (time_samples - 1), t0, t1), bbs);
+
+	const float s = bbs.size() - 1;
+	for (size_t i = 1; i < bbs.size() - 1; ++i) {
+		const float time = i / s;
+		if (!(time > t0 && time < t1))
+			continue;
+
+		const auto interval = std::min(static_cast<size_t>(((time - t0) / (t1 - t0)) * (time_samples - 1)), time_samples - 2);
+		const BBox bb = seg_bbs[interval] | seg_bbs[interval + 1] | bbs[i];
+		seg_bbs[interval] = bb;
+		seg_bbs[interval + 1] = bb;
+	}
+
+	return seg_bbs;
 }
 
 
+/*
+ * Fills in nodes[node_i] as a leaf for prim (see BVHBuilder).
+ */
+std::vector<BBox> BVH4::pack_leaf(std::vector<Node>* out_nodes, std::vector<BBox4>* out_bounds, size_t node_i, const BVHPrimitive& prim) {
+	Node& node = (*out_nodes)[node_i];
+	node.data_index = prim.instance_index;
+	node.child_count = 0;
+	node.flags = (instance_bbs[prim.instance_index].size() == 1) ? STATIC_SUBTREE : 0;
+	if (!split.empty() && split[prim.instance_index]) {
+		node.flags |= SPLIT_INSTANCE;
+		return std::vector<BBox> {BBox(prim.bmin, prim.bmax)};
+	}
+	return instance_bbs[prim.instance_index];
+}
+
+
+/*
+ * Fills in nodes[node_i] as the parent of the child_count nodes from
+ * first_child_i on, appending their bounds to out_bounds (see BVHBuilder).
+ * The split axes are recorded for child_order(), with 3 for splits without
+ * an axis.
+ *
+ * Returns the bounds of the subtree.  If all of its primitives have the
+ * same number of time samples, that's their per-time-sample union.
+ * Otherwise it's a single bounding box that encloses everything.
+ */
+std::vector<BBox> BVH4::pack_node(std::vector<Node>* out_nodes, std::vector<BBox4>* out_bounds, size_t node_i, size_t first_child_i, int child_count, const std::vector<BBox>* child_bbs, const int* split_axes) {
+	auto& nodes = *out_nodes;
+	auto& bounds = *out_bounds;
+
+	// The top split, then the halves', and whether the first half is a
+	// single child
+	unsigned int split_flags = split_axes[0] & 3;
+	for (int h = 0; h < 2; ++h)
+		split_flags |= (split_axes[1 + h] & 3) << (2 + (h * 2));
+	if (split_axes[1] < 0)
+		split_flags |= 1 << 6;
+
+	// Figure out the largest number of time samples amongst the
+	// children, and if they're all static
+	bool all_static = true;
+	size_t most_time_samples = 1;
+	for (int c = 0; c < child_count; ++c) {
+		most_time_samples = std::max(most_time_samples, child_bbs[c].size());
+		all_static = all_static && (nodes[first_child_i + c].flags & STATIC_SUBTREE);
+	}
+
+	// Fill in the node.  If the children have different numbers of time
+	// samples, their bounds are interpolated to the largest number.
+	Node& node = nodes[node_i];
+	node.child_index = first_child_i;
+	node.child_count = child_count;
+	node.flags = split_flags | ((all_static && most_time_samples == 1) ? STATIC_SUBTREE : 0);
+	node.bounds_index = bounds.size();
+	node.ts = most_time_samples;
+	assert(nodes.size() <= std::numeric_limits<uint32_t>::max());
+	for (size_t i = 0; i < most_time_samples; ++i)
+		bounds.push_back(child_bounds_at(child_bbs, child_count, i, most_time_samples));
+
+	// Calculate the bounds of the whole subtree
+	return union_bounds(child_bbs, child_count);
+}
+
+
+/*
+ * Offsets the indices of a node built into its own buffers (see
+ * BVHBuilder).
+ */
+void BVH4::offset_node(Node* node, size_t node_offset, size_t bounds_offset) {
+	if (node->child_count > 0) {
+		node->child_index += node_offset;
+		node->bounds_index += bounds_offset;
+	}
+}
+
+
+/*
+ * Returns the bounds of a node's children at time sample i of
+ * time_samples, interpolating the bounds of children that have a
+ * different number of time samples.
+ */
+BBox4 BVH4::child_bounds_at(const std::vector<BBox>* child_bbs, const int child_count, const size_t i, const size_t time_samples) {
+	const float s = time_samples - 1;
+	BBox bb[4];
+	for (int c = 0; c < child_count; ++c) {
+		if (child_bbs[c].size() == time_samples)
+			bb[c] = child_bbs[c][i];
+		else
+			bb[c] = lerp_seq(i/s, child_bbs[c]);
+	}
+	return BBox4(bb[0], bb[1], bb[2], bb[3]);
+}
+
+
+/**
+ * Sets up traversal of the rays at positions [begin, end).  With more than
+ * one time segment the rays are partitioned by segment, and each segment's
+ * tree gets its own stack entry.  Rays that can't see anything in their
+ * segment's tree are left out.
+ */
+template <typename MOTION>
+void BVH4StreamTraverser<MOTION>::init_rays(RayStream* rays_, size_t begin, size_t end) {
+	rays = rays_;
+	rays_end = end;
+	single_ray = 0;
+	single_rays_end = 0;
+
+	// Initialize stack
+	if (bvh == nullptr || bvh->nodes.size() == 0) {
+		stack_ptr = -1;
+		unvisited_roots = 0;
+		return;
+	}
+
+	if (bvh->has_split_instances) {
+		if (mailboxes->size() < rays->size())
+			mailboxes->resize(rays->size());
+		for (size_t i = begin; i < end; ++i)
+			(*mailboxes)[rays->id(i)].fill(MAILBOX_EMPTY);
+	}
+
+	unvisited_roots = bvh->time_segments;
+	stack_ptr = unvisited_roots - 1;
+	for (int seg = 0; seg < bvh->time_segments; ++seg) {
+		const size_t seg_end = (seg == bvh->time_segments - 1) ? end : rays->partition(begin, end, [&](size_t i) {
+			return bvh->time_segment(rays->time[rays->slot(i)]) == seg;
+		});
+		node_stack[seg] = seg;
+		if (!bvh->root_frames.empty())
+			frame_stack[seg] = bvh->root_frames[seg];
+		ray_stack[seg].first = begin;
+		ray_stack[seg].second = bvh->node_visibility.empty() ? seg_end : rays->partition(begin, seg_end, [&](size_t i) {
+			return bvh->is_visible(seg, rays->visibility_class(i));
+		});
+		begin = seg_end;
+	}
+}
+
+
+/**
+ * Tests the rays at positions [begin, end), which should all have reached
+ * the node, against each of its children, four rays at a time, and stores
+ * each ray's child hit mask in ray_hit_masks.
+ *
+ * The hit masks are the same as the ones BBox4::intersect_ray() gives
+ * when testing the rays one at a time.
+ */
+template <typename MOTION>
+CPU_DISPATCH void BVH4StreamTraverser<MOTION>::test_rays_parallel(const BBox4& bounds, const int num_children, const size_t begin, const size_t end) {
+	const size_t count = end - begin;
+	ray_hit_masks.resize(count);
+
+	for (size_t i = 0; i < count; i += 4) {
+		// Gather the rays into SoA form, padding the last group by
+		// repeating its final ray
+		size_t s[4];
+		for (int k = 0; k < 4; ++k)
+			s[k] = rays->slot(begin + std::min(i + k, count - 1));
+
+		SIMD::float4 o[3], d_inv[3];
+		for (int c = 0; c < 3; ++c) {
+			o[c] = SIMD::float4(rays->o[s[0]][c], rays->o[s[1]][c], rays->o[s[2]][c], rays->o[s[3]][c]);
+			d_inv[c] = SIMD::float4(rays->d_inv[s[0]][c], rays->d_inv[s[1]][c], rays->d_inv[s[2]][c], rays->d_inv[s[3]][c]);
+		}
+		const SIMD::float4 max_t(rays->max_t[s[0]], rays->max_t[s[1]], rays->max_t[s[2]], rays->max_t[s[3]]);
+
+		// Test against each child, and scatter the results into the
+		// rays' hit masks
+		uint8_t masks[4] = {0, 0, 0, 0};
+		for (int c = 0; c < num_children; ++c) {
+			const unsigned int hits = bounds.intersect_rays(c, o, d_inv, max_t);
+			for (int k = 0; k < 4; ++k)
+				masks[k] |= ((hits >> k) & 1) << c;
+		}
+
+		for (size_t k = 0; k < 4 && (i + k) < count; ++k)
+			ray_hit_masks[i + k] = masks[k];
+	}
+}
+
+
+/**
+ * Starts the single-ray traversal of the ray at position i of the current
+ * batch.  Rays that didn't reach the batch's root node get an empty stack.
+ */
+template <typename MOTION>
+void BVH4StreamTraverser<MOTION>::start_single_ray(const size_t i) {
+	single_ray = i;
+	single_stack_ptr = -1;
+
+	if (i < single_rays_end && !rays->is_done(i) && (single_ray_at_root || rays->trav_stack[rays->slot(i)].pop())) {
+		single_stack_ptr = 0;
+		single_node_stack[0] = single_ray_root;
+		single_t_stack[0] = -std::numeric_limits<float>::infinity();
+		single_frame_stack[0] = single_ray_root_frame;
+	}
+}
+
+
+/**
+ * Continues the depth-first traversal of the current single ray until it
+ * reaches a leaf, and returns that leaf's data index in data_index.
+ *
+ * Returns false once the ray has no more leaves to visit.
+ */
+template <typename MOTION>
+CPU_DISPATCH bool BVH4StreamTraverser<MOTION>::next_single_ray_leaf(size_t* data_index) {
+	const size_t s = rays->slot(single_ray);
+
+	while (single_stack_ptr >= 0 && !rays->is_done(single_ray)) {
+		const size_t node_i = single_node_stack[single_stack_ptr];
+		const float near_t = single_t_stack[single_stack_ptr];
+		const BBox& frame = single_frame_stack[single_stack_ptr];
+		--single_stack_ptr;
+
+		// Skip nodes beyond the closest hit found since they were pushed
+		if (!(near_t < rays->max_t[s]))
+			continue;
+
+		if (bvh->is_leaf(node_i)) {
+			const auto& leaf = bvh->nodes[node_i];
+			if ((leaf.flags & BVH4::SPLIT_INSTANCE) && !first_visit(rays->id(single_ray), leaf.data_index))
+				continue;
+			*data_index = leaf.data_index;
+			return true;
+		}
+
+		const int num_children = bvh->child_count(node_i);
+		const auto& node = bvh->nodes[node_i];
+		const BBox4* bounds = bvh->child_bounds(node_i, frame, &decoded_bounds);
+		const unsigned int child_mask = ((1 << num_children) - 1) & bvh->visible_children(node_i, rays->visibility_class(single_ray));
+
+		// Ray test
+		SIMD::float4 near_hits;
+		const BBox4 b = MOTION::lerp_seq(bvh->segment_time(rays->time[s]), bounds, node.ts);
+		const unsigned int hit_mask = b.intersect_ray(rays->o[s], rays->d_inv[s], rays->max_t[s], &near_hits) & child_mask;
+
+		// Sort the hit children near to far
+		int order[4];
+		int hit_count = 0;
+		for (int c = 0; c < num_children; ++c) {
+			if (hit_mask & (1 << c)) {
+				int j = hit_count++;
+				for (; j > 0 && near_hits[c] < near_hits[order[j-1]]; --j)
+					order[j] = order[j-1];
+				order[j] = c;
+			}
+		}
+
+		// Push them far to near, so the nearest is visited first
+		assert((single_stack_ptr + hit_count) < BVH4_STACK_SIZE);
+		for (int j = hit_count - 1; j >= 0; --j) {
+			++single_stack_ptr;
+			single_node_stack[single_stack_ptr] = bvh->child(node_i, order[j]);
+			single_t_stack[single_stack_ptr] = near_hits[order[j]];
+			if (bvh->bounds_bits != 32)
+				single_frame_stack[single_stack_ptr] = BVH4::child_frame(bounds, node.ts, order[j]);
+		}
+	}
+
+	return false;
+}
+
+
+template <typename MOTION>
+CPU_DISPATCH std::tuple<size_t, size_t, size_t> BVH4StreamTraverser<MOTION>::traverse() {
+	while (single_ray < single_rays_end || stack_ptr >= 0) {
+		if (single_ray < single_rays_end) {
+			// Continue the single-ray traversal of a small batch
+			size_t data_index;
+			if (next_single_ray_leaf(&data_index))
+				return std::make_tuple(single_ray, single_ray + 1, data_index);
+			start_single_ray(single_ray + 1);
+			continue;
+		}
+
+		// Every ray at a root node reached it, without a bit for it on
+		// its traversal stack
+		const bool at_root = stack_ptr < unvisited_roots;
+		if (at_root)
+			unvisited_roots = stack_ptr;
 
-std::tuple<Ray*, Ray*, size_t> BVH4StreamTraverser::next_object() {
-	while (stack_ptr >= 0) {
 		if (bvh->is_leaf(node_stack[stack_ptr])) {
-			ray_stack[stack_ptr].second = mutable_partition(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, [&](Ray& ray) {
-				return !ray.is_done() && (first_call || ray.trav_stack.pop());
+			const auto& leaf = bvh->nodes[node_stack[stack_ptr]];
+			const bool split_instance = leaf.flags & BVH4::SPLIT_INSTANCE;
+			ray_stack[stack_ptr].second = rays->partition(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, [&](size_t i) {
+				return !rays->is_done(i) && (at_root || rays->trav_stack[rays->slot(i)].pop()) && (!split_instance || first_visit(rays->id(i), leaf.data_index));
 			});
 
-			if (std::distance(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second) > 0) {
-				auto rv = std::make_tuple(&(*ray_stack[stack_ptr].first), &(*ray_stack[stack_ptr].second), bvh->nodes[node_stack[stack_ptr]].data_index);
+			if (ray_stack[stack_ptr].first != ray_stack[stack_ptr].second) {
+				auto rv = std::make_tuple(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, bvh->nodes[node_stack[stack_ptr]].data_index);
 				--stack_ptr;
 				return rv;
 			} else {
 				--stack_ptr;
 			}
+		} else if ((ray_stack[stack_ptr].second - ray_stack[stack_ptr].first) <= Config::single_ray_max) {
+			// Few enough rays to traverse the rest of this subtree one ray
+			// at a time
+			single_ray_root = node_stack[stack_ptr];
+			single_ray_root_frame = frame_stack[stack_ptr];
+			single_rays_end = ray_stack[stack_ptr].second;
+			single_ray_at_root = at_root;
+			--stack_ptr;
+
+			start_single_ray(ray_stack[stack_ptr+1].first);
 		} else {
-			const int num_children = bvh->child_count(node_stack[stack_ptr]);
-			const auto node_begin = bvh->nodes.cbegin() + node_stack[stack_ptr];
+			const auto node_i = node_stack[stack_ptr];
+			const int num_children = bvh->child_count(node_i);
+			const auto& node = bvh->nodes[node_i];
+			const BBox4* bounds = bvh->child_bounds(node_i, frame_stack[stack_ptr], &decoded_bounds);
+			const unsigned int child_mask = (1 << num_children) - 1;
+
+			// The children that rays of each visibility class can see
+			unsigned int visible_mask[Ray::VISIBILITY_CLASSES];
+			for (uint32_t v = 0; v < Ray::VISIBILITY_CLASSES; ++v)
+				visible_mask[v] = child_mask & bvh->visible_children(node_i, v);
 
 			SIMD::float4 near_hits; // For storing near-hit data in the ray-test loop below
-			bool rot_set = false;
-			int rot = 0;
 
-			// Test rays against current node's children
-			ray_stack[stack_ptr].second = mutable_partition(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, [&](Ray& ray) {
-				if (!ray.is_done() && (first_call || ray.trav_stack.pop())) {
-					// Get the time-interpolated bounding box
-					const BBox4 b = lerp_seq(ray.time, node_begin, bvh->nodes[node_stack[stack_ptr]].ts).bounds;
+			// Front-to-back order of the children, for the direction
+			// octant of the first ray that hits any of them.  Along with
+			// the rays' hit masks reordered to match, by hit mask.
+			bool order_set = false;
+			unsigned int order = 0;
+			uint8_t ordered_hits[16];
+
+			// With enough rays at a node without motion blur, it's faster
+			// to test the rays four at a time against each child than each
+			// ray against all of the children at once.  Only the rays that
+			// reached the node count, so those are partitioned out first,
+			// popping their bits.  The tests are then done for all of them
+			// up front, since partition() moves them.
+			const size_t ray_begin = ray_stack[stack_ptr].first;
+			size_t ray_end = ray_stack[stack_ptr].second;
+			bool rays_reached = false; // Whether all rays in [ray_begin, ray_end) are known to have reached the node
+			bool ray_parallel = false;
+			if ((!MOTION::MOTION || node.ts == 1) && Config::ray_parallel_min > 0 && (ray_end - ray_begin) >= Config::ray_parallel_min) {
+				ray_end = rays->partition(ray_begin, ray_end, [&](size_t i) {
+					return !rays->is_done(i) && (at_root || rays->trav_stack[rays->slot(i)].pop());
+				});
+				rays_reached = true;
+				ray_parallel = (ray_end - ray_begin) >= Config::ray_parallel_min;
+				if (ray_parallel)
+					test_rays_parallel(bounds[0], num_children, ray_begin, ray_end);
+			}
 
-					// Ray test
-					const auto hit_mask = b.intersect_ray(ray, &near_hits);
+			// Test rays against current node's children
+			ray_stack[stack_ptr].second = rays->partition(ray_begin, ray_end, [&](size_t i) {
+				const size_t s = rays->slot(i);
+				if (rays_reached || (!rays->is_done(i) && (at_root || rays->trav_stack[s].pop()))) {
+					// Ray test.  Unused child slots are masked out, since
+					// quantized bounds don't keep them empty.
+					// Children the ray can't see are masked out as well.
+					const unsigned int ray_child_mask = visible_mask[(rays->id_and_flags[s] & Ray::VISIBILITY_BITS) >> Ray::VISIBILITY_SHIFT];
+					unsigned int hit_mask;
+					if (ray_parallel) {
+						hit_mask = ray_hit_masks[i - ray_begin] & ray_child_mask;
+					} else {
+						// Get the time-interpolated bounding box
+						const BBox4 b = MOTION::lerp_seq(bvh->segment_time(rays->time[s]), bounds, node.ts);
+						hit_mask = b.intersect_ray(rays->o[s], rays->d_inv[s], rays->max_t[s], &near_hits) & ray_child_mask;
+					}
 
 					// Push results to the bit stack
 					if (hit_mask != 0) {
-						if (!rot_set) {
-							rot_set = true;
-							for (int i = 1; i < num_children; ++i) {
-								if (near_hits[i] < near_hits[rot])
-									rot = i;
+						if (!order_set) {
+							order_set = true;
+							const Vec3& d_inv = rays->d_inv[s];
+							order = bvh->child_order(node_i, ((d_inv.x > 0.0f) ? 0 : 4) | ((d_inv.y > 0.0f) ? 0 : 2) | ((d_inv.z > 0.0f) ? 0 : 1));
+							for (unsigned int m = 0; m <= child_mask; ++m) {
+								ordered_hits[m] = 0;
+								for (int c = 0; c < num_children; ++c)
+									ordered_hits[m] |= ((m >> ((order >> (c * 2)) & 3)) & 1) << c;
 							}
 						}
-						ray.trav_stack.push((hit_mask >> rot) | (hit_mask << (num_children-rot)), num_children);
+						rays->trav_stack[s].push(ordered_hits[hit_mask], num_children);
 					}
 
 					// Return whether the ray hit any of the child nodes
@@ -210,16 +953,15 @@ std::tuple<Ray*, Ray*, size_t> BVH4StreamTraverser::next_object() {
 				}
 			});
 
-			if (first_call)
-				first_call = false;
-
 			// If any rays hit, traverse deeper
-			if (std::distance(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second) > 0) {
-				const auto node_i = node_stack[stack_ptr];
-
+			if (ray_stack[stack_ptr].first != ray_stack[stack_ptr].second) {
+				assert((stack_ptr + num_children) <= (BVH4_STACK_SIZE + BVH4::MAX_TIME_SEGMENTS));
 				for (int i = 0; i < num_children; ++i) {
+					const int c = (order >> ((num_children-1-i) * 2)) & 3;
 					ray_stack[stack_ptr+i] = ray_stack[stack_ptr];
-					node_stack[stack_ptr+i] = bvh->child(node_i, num_children-1-((i+num_children-rot)%num_children));
+					node_stack[stack_ptr+i] = bvh->child(node_i, c);
+					if (bvh->bounds_bits != 32)
+						frame_stack[stack_ptr+i] = BVH4::child_frame(bounds, node.ts, c);
 				}
 
 				stack_ptr += num_children - 1;
@@ -234,3 +976,7 @@ std::tuple<Ray*, Ray*, size_t> BVH4StreamTraverser::next_object() {
 	// Finished traversal
 	return std::make_tuple(rays_end, rays_end, 0);
 }
+
+
+template class BVH4StreamTraverser<StaticPolicy>;
+template class BVH4StreamTraverser<MotionPolicy>;
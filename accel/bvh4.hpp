@@ -2,94 +2,212 @@
 #define BVH4_HPP
 
 #include <stdlib.h>
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <deque>
 #include <memory>
 #include <tuple>
+#include <array>
 
 #include "numtype.h"
 #include "global.hpp"
 
 #include "accel.hpp"
-#include "bvh.hpp"
+#include "bvh_builder.hpp"
 #include "object.hpp"
 #include "ray.hpp"
 #include "bbox.hpp"
 #include "utils.hpp"
 #include "vector.hpp"
+#include "motion_policy.hpp"
 
 
+template <typename MOTION>
+class BVH4StreamTraverser;
+
+// Per-ray records of the last few split instances each ray has visited,
+// indexed by ray id (see BVH4StreamTraverser::set_mailboxes())
+static constexpr int BVH4_MAILBOX_SIZE = 4;
+typedef std::vector<std::array<uint32_t, BVH4_MAILBOX_SIZE>> BVH4Mailboxes;
 
 
 /*
- * A bounding volume hierarchy.
+ * A 4-wide bounding volume hierarchy.
+ *
+ * The tree is built directly, without building a binary BVH first: each
+ * node splits its primitives in two with a binned SAH, and then splits each
+ * of the halves again, giving up to four children (see BVHBuilder).
+ *
+ * Nodes are kept small so that traversal touches as little memory as
+ * possible.  They use 32-bit indices, and a node's children are stored
+ * next to each other, so only the index of the first one is needed.  The
+ * bounds of a node's children are stored separately, one BBox4 per time
+ * sample.  Optionally those bounds are quantized to 16 or 8 bits (see
+ * Config::bvh_bounds_bits), relative to the node's own bounds in its
+ * parent, which the traverser decodes on the way down.  That makes them
+ * take 50% or 25% as much memory respectively.
+ *
+ * Each node also records whether its whole subtree is free of motion blur,
+ * so that static geometry can be traversed without paying for motion blur
+ * support (see is_static()).
+ *
+ * For motion blurred assemblies the shutter interval can optionally be
+ * split into several time segments (see Config::bvh_time_segments), with a
+ * separate tree built for each.  Each tree only has to bound its
+ * primitives over its own segment, which for fast-moving primitives is
+ * much tighter than over the whole shutter, and rays only traverse the
+ * tree for the segment their time is in.
+ *
+ * Large static instances can also be split into several references with
+ * smaller bounds (see Config::bvh_split_budget and split_instances()), so
+ * that they don't inflate the bounds of every node they're grouped into.
+ * Such an instance may then be reached through several leaves, which the
+ * traverser skips for rays that have already visited it.
+ *
+ * If any instances are invisible to some classes of rays (see
+ * Ray::VisibilityClass), each node also gets a mask of the classes that
+ * can see anything in its subtree, and the traverser doesn't take rays
+ * into subtrees they can't see.
+ *
+ * Between frames of an animation whose instances haven't changed, the tree
+ * can be refit to the instances' new bounds instead of rebuilt (see
+ * refit()).
  */
-class BVH4: public Accel {
+class BVH4: public Accel, private BVHBuilder<BVH4, 4> {
 public:
+	BVH4() = default;
+	BVH4(const BVH4&) = default;
+	BVH4(BVH4&&) = default;
+	BVH4& operator=(const BVH4&) = default;
+	BVH4& operator=(BVH4&&) = default;
+
 	virtual void build(const Assembly& assembly);
+	bool refit(const Assembly& assembly);
 	virtual const std::vector<BBox>& bounds() const {
 		return _bounds;
 	};
 	virtual ~BVH4() {};
 
 	// Traversers need access to private data
+	template <typename MOTION>
 	friend class BVH4StreamTraverser;
+	friend class BVHBuilder<BVH4, 4>;
+
+	// The most time segments a tree can be split into (see
+	// Config::bvh_time_segments)
+	static constexpr int MAX_TIME_SEGMENTS = 8;
+
+	// Node flag for subtrees where every node has only one time sample
+	static constexpr uint8_t STATIC_SUBTREE = 1 << 7;
+
+	// Leaf node flag for instances that were split into several
+	// references, and so may be in more than one leaf
+	static constexpr uint8_t SPLIT_INSTANCE = 1 << 0;
+
+	struct Node {
+		union {
+			uint32_t child_index = 0; // Index of the first child, the others follow it
+			uint32_t data_index; // For leaf nodes
+		};
+		uint32_t bounds_index = 0; // Index in node_bounds of the first time sample of the children's bounds
+		uint16_t ts = 0; // Number of time samples
+		uint8_t child_count = 0; // Zero indicates a leaf node
+		uint8_t flags = 0; // How the children were split (see child_order()), and STATIC_SUBTREE
+	};
 
-	struct alignas(16) Node {
-	    union {
-	        // If the node is a leaf, we don't need the bounds.
-	        // If the node is not a leaf, it doesn't have Primitive data.
-	        BBox4 bounds {BBox(), BBox(), BBox(), BBox()};
-	        size_t data_index;
-	    };
-	    size_t child_indices[3] = {0,0,0}; // Indices of children 2, 3, and 4. (Child 1's index is implicit.)
-	    // When first element is 0, indicates that this is a leaf node,
-	    // because a non-leaf node needs at least two children.  When the
-	    // second and/or third elements are zero, indicates there is no
-	    // third or fourth child, respectively.
-	    uint32_t ts = 0;  // Number of time samples.
-
-	Node() {}
-
-//		Node(const Node& n): child_indices {n.child_indices}, ts {n.ts} {
-//			bounds = n.bounds;
-//		}
-
-	// Operators to allow node bounds to be interpolated conveniently
-	Node operator+(const Node& b) const {
-		Node n;
-		n.bounds = bounds + b.bounds;
-		return n;
-	}
-
-	Node operator*(float f) const {
-		Node n;
-		n.bounds = bounds * f;
-		return n;
+	/**
+	 * @brief Returns the most bits traversing the trees can leave on a
+	 * ray's traversal stack, when traversing the assemblies instanced in
+	 * them can leave up to nested_bits more (see BVHBuilder).
+	 */
+	int trav_stack_bits(const int nested_bits) const {
+		return BVHBuilder::trav_stack_bits(depth, nested_bits);
+	}
+
+	/**
+	 * @brief Returns whether the whole tree is free of motion blur, and
+	 * can be traversed with BVH4StreamTraverser<StaticPolicy>.
+	 */
+	bool is_static() const {
+		for (size_t i = 0; i < nodes.size() && i < static_cast<size_t>(time_segments); ++i) {
+			if (!(nodes[i].flags & STATIC_SUBTREE))
+				return false;
+		}
+		return true;
 	}
-	};
 
 private:
 	std::vector<Node> nodes;
+	int bounds_bits = 32; // Precision of the node bounds, only one of the arrays below is used
+	std::vector<BBox4> node_bounds;
+	std::vector<QuantizedBBox4<uint16_t>> node_bounds_16;
+	std::vector<QuantizedBBox4<uint8_t>> node_bounds_8;
+	std::vector<BBox> root_frames; // Frames of the roots' quantized child bounds, one per time segment (see quantize_bounds())
 	std::vector<BBox> _bounds {BBox()};
+	int time_segments = 1; // Number of time segments, the root of each one's tree is nodes[segment]
+	int depth = 0; // Depth of the deepest tree, counting the leaves
+	bool has_split_instances = false; // Whether any leaves have SPLIT_INSTANCE set
+	float built_sah_cost = 0.0f; // sah_cost() when the tree was built, for deciding when to rebuild instead of refit
+	std::vector<uint8_t> node_visibility; // Visibility mask of each node's subtree (see Ray::VisibilityClass), empty if everything is fully visible
+
+	// Build data
+	const Assembly* assembly; // Set during build()
+	std::vector<uint8_t> split; // Whether each instance was split into several primitives in bag, whose bmin/bmax are then their bounds
+
+	// How many times larger than the average a static instance's surface
+	// area has to be for split_instances() to split it
+	static constexpr float SPLIT_AREA_RATIO = 4.0f;
+
+	// The minimum number of primitives to bother caching the built trees
+	// on disk, when there's a cache directory (see AccelCache)
+	static constexpr size_t CACHE_MIN_PRIMS = 1 << 10;
+
+	void build_trees();
+	uint64_t cache_key() const;
+	bool load_cache(uint64_t key);
+	void save_cache(uint64_t key) const;
+	void split_instances(size_t max_new_prims);
+
+	std::vector<BBox> pack_leaf(std::vector<Node>* out_nodes, std::vector<BBox4>* out_bounds, size_t node_i, const BVHPrimitive& prim);
+	std::vector<BBox> pack_node(std::vector<Node>* out_nodes, std::vector<BBox4>* out_bounds, size_t node_i, size_t first_child_i, int child_count, const std::vector<BBox>* child_bbs, const int* split_axes);
+	static void offset_node(Node* node, size_t node_offset, size_t bounds_offset);
+	static std::vector<BBox> segment_bounds(const std::vector<BBox>& bbs, float t0, float t1, size_t time_samples);
+	static BBox4 child_bounds_at(const std::vector<BBox>* child_bbs, int child_count, size_t i, size_t time_samples);
+	std::vector<BBox> refit_recursive(size_t node_i, bool* fits);
+	float sah_cost() const;
+	void quantize_bounds();
+	void update_visibility();
 
-	enum {
-		IS_SKIP = 1 << 8,
-		IS_2ND  = 1 << 9,
-		IS_3RD  = 1 << 10,
-		IS_4TH  = 1 << 11
-	};
+	/**
+	 * @brief Returns the number of time samples that bounds with the
+	 * given number of time samples are resampled to within a time segment.
+	 */
+	inline size_t segment_time_samples(const size_t time_samples) const {
+		return (time_samples == 1) ? 1 : std::max<size_t>(2, ((time_samples - 1 + time_segments - 1) / time_segments) + 1);
+	}
+
+	/**
+	 * @brief Returns the time segment that the given time (0.0-1.0) is in.
+	 */
+	inline int time_segment(const float time) const {
+		return std::max(0, std::min(static_cast<int>(time * time_segments), time_segments - 1));
+	}
+
+	/**
+	 * @brief Returns the given time (0.0-1.0) relative to its time
+	 * segment, for interpolating node bounds.
+	 */
+	inline float segment_time(const float time) const {
+		return (time * time_segments) - time_segment(time);
+	}
 
 	/**
 	 * @brief Returns the index of the nth (0-3) child
 	 * of the node with the given index.
 	 */
 	inline size_t child(const size_t node_i, const int n) const {
-		if (n == 0)
-			return node_i + nodes[node_i].ts;
-		else
-			return nodes[node_i].child_indices[n-1];
+		return nodes[node_i].child_index + n;
 	}
 
 	/**
@@ -105,17 +223,115 @@ private:
 	 * leaf node or not.
 	 */
 	inline bool is_leaf(const size_t node_i) const {
-		return (nodes[node_i].child_indices[0] == 0);
+		return nodes[node_i].child_count == 0;
 	}
 
 	inline int child_count(const size_t node_i) const {
-		if (nodes[node_i].child_indices[1] == 0) {
-			return 2;
-		} else if (nodes[node_i].child_indices[2] == 0) {
-			return 3;
-		} else {
-			return 4;
+		return nodes[node_i].child_count;
+	}
+
+	/**
+	 * @brief Returns whether rays of the given visibility class can see
+	 * anything in the subtree of the node with the given index.
+	 */
+	inline bool is_visible(const size_t node_i, const uint32_t visibility_class) const {
+		return node_visibility.empty() || ((node_visibility[node_i] >> visibility_class) & 1);
+	}
+
+	/**
+	 * @brief Returns the mask of the children of the node with the given
+	 * index that rays of the given visibility class can see anything in,
+	 * with bit n set for the nth child.
+	 */
+	inline unsigned int visible_children(const size_t node_i, const uint32_t visibility_class) const {
+		if (node_visibility.empty())
+			return 0xf;
+		const uint8_t* vis = &node_visibility[nodes[node_i].child_index];
+		unsigned int mask = 0;
+		for (int c = 0; c < nodes[node_i].child_count; ++c)
+			mask |= ((vis[c] >> visibility_class) & 1) << c;
+		return mask;
+	}
+
+	/**
+	 * @brief Returns the front-to-back order of the children of the node
+	 * with the given index, for rays in the given direction octant
+	 * (numbered as in RayReorder, with bits 4, 2, and 1 set for negative
+	 * x, y, and z).
+	 *
+	 * The children are split in two halves along one axis, and each half
+	 * with two children is split again.  The node's flags store those
+	 * axes two bits each (the top split in bits 0-1, then the halves),
+	 * with 3 for halves that were split without an axis.  Bit 6 is set if
+	 * the first half is a single child.  A half on the low side of its
+	 * axis comes first unless the octant is negative along it.
+	 *
+	 * The order is packed two bits per child index, with the first child
+	 * to visit in the lowest bits.
+	 */
+	inline unsigned int child_order(const size_t node_i, const unsigned int octant) const {
+		const Node& node = nodes[node_i];
+		const auto flip = [octant](unsigned int axis) {
+			return axis < 3 && (octant & (4 >> axis)) != 0;
+		};
+
+		// The two halves, each packed the same as the result
+		const unsigned int first_count = (node.flags & (1 << 6)) ? 1 : 2;
+		unsigned int halves[2] = {0, 0};
+		unsigned int half_counts[2] = {first_count, node.child_count - first_count};
+		for (int h = 0; h < 2; ++h) {
+			const unsigned int c = (h == 0) ? 0 : first_count;
+			if (half_counts[h] == 1)
+				halves[h] = c;
+			else if (flip((node.flags >> (2 + (h * 2))) & 3))
+				halves[h] = (c + 1) | (c << 2);
+			else
+				halves[h] = c | ((c + 1) << 2);
 		}
+
+		if (flip(node.flags & 3))
+			return halves[1] | (halves[0] << (half_counts[1] * 2));
+		else
+			return halves[0] | (halves[1] << (half_counts[0] * 2));
+	}
+
+	/**
+	 * @brief Returns the bounds of the children of the node with the
+	 * given index, one BBox4 per time sample.
+	 *
+	 * If the bounds are quantized they are decoded into decoded, which
+	 * the returned pointer then points into.  frame is then the frame
+	 * they're quantized relative to: the node's root frame for roots,
+	 * and otherwise the parent's child_frame() for the node.
+	 */
+	inline const BBox4* child_bounds(const size_t node_i, const BBox& frame, std::vector<BBox4>* decoded) const {
+		const Node& node = nodes[node_i];
+		switch (bounds_bits) {
+			case 16:
+				decoded->resize(node.ts);
+				for (size_t i = 0; i < node.ts; ++i)
+					(*decoded)[i] = node_bounds_16[node.bounds_index + i].decode(frame);
+				return decoded->data();
+			case 8:
+				decoded->resize(node.ts);
+				for (size_t i = 0; i < node.ts; ++i)
+					(*decoded)[i] = node_bounds_8[node.bounds_index + i].decode(frame);
+				return decoded->data();
+			default:
+				return node_bounds.data() + node.bounds_index;
+		}
+	}
+
+	/**
+	 * @brief Returns the frame that the quantized bounds of the nth child
+	 * of a node are relative to, given the node's decoded child bounds
+	 * and number of time samples: the union of its bounds over them.
+	 */
+	static inline BBox child_frame(const BBox4* bounds, const size_t time_samples, const int n) {
+		BBox frame = bounds[0].get_bbox(n);
+		for (size_t i = 1; i < time_samples; ++i)
+			frame = frame | bounds[i].get_bbox(n);
+		return frame;
 	}
 };
 
@@ -124,7 +340,19 @@ private:
 
 /**
  * @brief A breadth-first traverser for BVH4.
+ *
+ * Once a batch of rays at a node gets small enough (see
+ * Config::single_ray_max) the subtree is instead traversed depth-first one
+ * ray at a time, handing out each object for a single ray.  That skips the
+ * per-node partitioning, which doesn't pay off for only a few rays, and lets
+ * each ray visit the children in its own near-to-far order and skip nodes
+ * beyond its closest hit so far.
+ *
+ * MOTION is StaticPolicy or MotionPolicy (see motion_policy.hpp).  The
+ * static traverser skips interpolating node bounds over time, and may only
+ * be used with trees where BVH4::is_static() is true.
  */
+template <typename MOTION>
 class BVH4StreamTraverser: public AccelStreamTraverser<BVH4> {
 public:
 	virtual ~BVH4StreamTraverser() {}
@@ -133,35 +361,91 @@ public:
 		bvh = &accel;
 	}
 
-	virtual void init_rays(Ray* begin, Ray* end) {
-		rays = begin;
-		rays_end = end;
-		first_call = true;
-
-		// Initialize stack
-		if (bvh == nullptr || bvh->nodes.size() == 0) {
-			stack_ptr = -1;
-		} else {
-			stack_ptr = 0;
-		}
-		node_stack[0] = 0;
-		ray_stack[0].first = rays;
-		ray_stack[0].second = rays_end;
+	/**
+	 * Sets the buffer to keep the rays' mailboxes in, instead of one of
+	 * the traverser's own.  Must be called before init_rays().
+	 *
+	 * The buffer is only grown when it's smaller than the ray stream, and
+	 * only the mailboxes of the rays being traversed are cleared, so
+	 * reusing one buffer across traversals of the same stream avoids
+	 * reallocating it each time.  Traversals that are in progress at the
+	 * same time (e.g. of nested assemblies) need separate buffers.
+	 */
+	void set_mailboxes(BVH4Mailboxes* mailboxes_) {
+		mailboxes = mailboxes_;
 	}
 
-	virtual std::tuple<Ray*, Ray*, size_t> next_object();
+	virtual void init_rays(RayStream* rays_, size_t begin, size_t end);
+
+	virtual std::tuple<size_t, size_t, size_t> next_object() {
+		return traverse();
+	}
 
 private:
-	const BVH4* bvh = nullptr;
-	Ray* rays = nullptr;
-	Ray* rays_end = nullptr;
-	bool first_call = true;
+	// Does the work of next_object().  Separate since virtual functions
+	// can't be compiled for several instruction sets (see cpu_dispatch.hpp).
+	std::tuple<size_t, size_t, size_t> traverse();
 
-	// Stack data
+	const BVH4* bvh = nullptr;
+	RayStream* rays = nullptr;
+	size_t rays_end = 0;
+
+	// Stack data.  The bottom unvisited_roots entries are the roots of
+	// the time segments' trees (see BVH4::time_segments), which the
+	// rays have no traversal stack bits for.  Above those there's room
+	// for one tree of the largest depth the rays' traversal stacks allow
+	// (see Assembly::finalize()), which needs as many entries as bits.
+	// With quantized bounds, frame_stack has the frame of each node's
+	// child bounds (see BVH4::child_bounds()).
 #define BVH4_STACK_SIZE 64
 	int stack_ptr;
-	size_t node_stack[BVH4_STACK_SIZE];
-	std::pair<Ray*, Ray*> ray_stack[BVH4_STACK_SIZE];
+	int unvisited_roots;
+	size_t node_stack[BVH4_STACK_SIZE + BVH4::MAX_TIME_SEGMENTS];
+	std::pair<size_t, size_t> ray_stack[BVH4_STACK_SIZE + BVH4::MAX_TIME_SEGMENTS];
+	BBox frame_stack[BVH4_STACK_SIZE + BVH4::MAX_TIME_SEGMENTS];
+
+	std::vector<BBox4> decoded_bounds; // Scratch space for quantized node bounds
+	std::vector<uint8_t> ray_hit_masks; // Scratch space for ray-parallel node tests, indexed by ray position relative to the node's first ray
+
+	void test_rays_parallel(const BBox4& bounds, int num_children, size_t begin, size_t end);
+
+	// Single-ray traversal data, for the batch of rays [single_ray,
+	// single_rays_end) below single_ray_root
+	size_t single_ray = 0; // Position of the ray currently being traversed
+	size_t single_rays_end = 0;
+	size_t single_ray_root = 0;
+	BBox single_ray_root_frame;
+	bool single_ray_at_root = false; // Whether the batch started at a root node
+	int single_stack_ptr = -1;
+	size_t single_node_stack[BVH4_STACK_SIZE];
+	float single_t_stack[BVH4_STACK_SIZE]; // Near hit distance of each node on single_node_stack
+	BBox single_frame_stack[BVH4_STACK_SIZE]; // Same as frame_stack
+
+	void start_single_ray(size_t i);
+	bool next_single_ray_leaf(size_t* data_index);
+
+	// The last few split instances (see BVH4::SPLIT_INSTANCE) that each
+	// ray has visited, most recent first, indexed by ray id.  A ray that
+	// reaches another leaf of one of those instances skips it.  Older
+	// visits are forgotten, which only costs a redundant test.
+	static constexpr uint32_t MAILBOX_EMPTY = ~uint32_t(0);
+	BVH4Mailboxes own_mailboxes;
+	BVH4Mailboxes* mailboxes = &own_mailboxes;
+
+	/**
+	 * Records a visit of a ray to a split instance, and returns whether
+	 * it's the ray's first.
+	 */
+	bool first_visit(const size_t ray_id, const uint32_t data_index) {
+		auto& mailbox = (*mailboxes)[ray_id];
+		for (const auto visited: mailbox) {
+			if (visited == data_index)
+				return false;
+		}
+		std::copy_backward(mailbox.begin(), mailbox.end() - 1, mailbox.end());
+		mailbox[0] = data_index;
+		return true;
+	}
 
 };
 
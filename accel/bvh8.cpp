@@ -0,0 +1,199 @@
+#include <iostream>
+#include <algorithm>
+#include <memory>
+#include <tuple>
+#include <iterator>
+#include <cmath>
+#include <limits>
+#include <cassert>
+
+#include "numtype.h"
+#include "bvh8.hpp"
+
+#include "simd.hpp"
+#include "ray.hpp"
+#include "assembly.hpp"
+#include "utils.hpp"
+#include "config.hpp"
+#include "cpu_dispatch.hpp"
+
+
+void BVH8::build(const Assembly& _assembly) {
+	assembly = &_assembly;
+
+	fill_bag(_assembly);
+
+	if (bag.size() > 0) {
+		nodes.push_back(Node());
+		_bounds = recursive_build(&nodes, &node_bounds, 0, 0, bag.size()-1, Config::build_threads);
+		nodes.shrink_to_fit();
+		node_bounds.shrink_to_fit();
+	}
+
+	_depth = tree_depth(nodes, 1);
+
+	// Clear build data
+	clear_bag();
+}
+
+
+/*
+ * Fills in nodes[node_i] as a leaf for prim (see BVHBuilder).
+ */
+std::vector<BBox> BVH8::pack_leaf(std::vector<Node>* out_nodes, std::vector<BBox8>* out_bounds, size_t node_i, const BVHPrimitive& prim) {
+	Node& node = (*out_nodes)[node_i];
+	node.data_index = prim.instance_index;
+	node.child_count = 0;
+	return instance_bbs[prim.instance_index];
+}
+
+
+/*
+ * Fills in nodes[node_i] as the parent of the child_count nodes from
+ * first_child_i on, appending their bounds to out_bounds (see BVHBuilder).
+ *
+ * Returns the bounds of the subtree.  If all of its primitives have the
+ * same number of time samples, that's their per-time-sample union.
+ * Otherwise it's a single bounding box that encloses everything.
+ */
+std::vector<BBox> BVH8::pack_node(std::vector<Node>* out_nodes, std::vector<BBox8>* out_bounds, size_t node_i, size_t first_child_i, int child_count, const std::vector<BBox>* child_bbs, const int* split_axes) {
+	auto& nodes = *out_nodes;
+	auto& bounds = *out_bounds;
+
+	size_t most_time_samples = 1;
+	for (int c = 0; c < child_count; ++c)
+		most_time_samples = std::max(most_time_samples, child_bbs[c].size());
+
+	// Fill in the node.  If the children have different numbers of time
+	// samples, their bounds are interpolated to the largest number.
+	Node& node = nodes[node_i];
+	node.child_index = first_child_i;
+	node.child_count = child_count;
+	node.bounds_index = bounds.size();
+	node.ts = most_time_samples;
+	assert(nodes.size() <= std::numeric_limits<uint32_t>::max());
+	const float s = most_time_samples - 1;
+	for (size_t i = 0; i < most_time_samples; ++i) {
+		BBox bb[8];
+		for (int c = 0; c < child_count; ++c) {
+			if (child_bbs[c].size() == most_time_samples)
+				bb[c] = child_bbs[c][i];
+			else
+				bb[c] = lerp_seq(i/s, child_bbs[c]);
+		}
+		bounds.push_back(BBox8(bb));
+	}
+
+	// Calculate the bounds of the whole subtree
+	return union_bounds(child_bbs, child_count);
+}
+
+
+/*
+ * Offsets the indices of a node built into its own buffers (see
+ * BVHBuilder).
+ */
+void BVH8::offset_node(Node* node, size_t node_offset, size_t bounds_offset) {
+	if (node->child_count > 0) {
+		node->child_index += node_offset;
+		node->bounds_index += bounds_offset;
+	}
+}
+
+
+
+// Flattened so that the ray test lambda is compiled into each
+// CPU_DISPATCH version of traverse() (target_clones doesn't clone
+// lambdas), which lets the AVX2 version inline intersect_ray_avx2().
+CPU_DISPATCH __attribute__((flatten)) std::tuple<size_t, size_t, size_t> BVH8StreamTraverser::traverse() {
+#ifdef CPU_DISPATCH_ENABLED
+	const bool avx2 = CPUDispatch::has_avx2();
+#endif
+
+	while (stack_ptr >= 0) {
+		if (bvh->is_leaf(node_stack[stack_ptr])) {
+			ray_stack[stack_ptr].second = rays->partition(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, [&](size_t i) {
+				return !rays->is_done(i) && (first_call || rays->trav_stack[rays->slot(i)].pop());
+			});
+
+			if (ray_stack[stack_ptr].first != ray_stack[stack_ptr].second) {
+				auto rv = std::make_tuple(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, bvh->nodes[node_stack[stack_ptr]].data_index);
+				--stack_ptr;
+				return rv;
+			} else {
+				--stack_ptr;
+			}
+		} else {
+			const int num_children = bvh->child_count(node_stack[stack_ptr]);
+			const auto& node = bvh->nodes[node_stack[stack_ptr]];
+			const auto bounds = bvh->node_bounds.cbegin() + node.bounds_index;
+			const unsigned int child_mask = (1 << num_children) - 1;
+
+			float near_hits[8]; // For storing near-hit data in the ray-test loop below
+			bool rot_set = false;
+			int rot = 0;
+
+			// Test rays against current node's children
+			ray_stack[stack_ptr].second = rays->partition(ray_stack[stack_ptr].first, ray_stack[stack_ptr].second, [&](size_t i) {
+				const size_t s = rays->slot(i);
+				if (!rays->is_done(i) && (first_call || rays->trav_stack[s].pop())) {
+					// Get the time-interpolated bounding box
+					const BBox8 b = lerp_seq(rays->time[s], bounds, node.ts);
+
+					// Ray test, with 256-bit instructions if the CPU has
+					// them, even if the build doesn't target AVX
+					unsigned int hit_mask;
+#ifdef CPU_DISPATCH_ENABLED
+					if (avx2) {
+						hit_mask = b.intersect_ray_avx2(rays->o[s], rays->d_inv[s], rays->max_t[s], near_hits) & child_mask;
+					} else
+#endif
+					{
+						SIMD::float8 hit_ts;
+						hit_mask = b.intersect_ray(rays->o[s], rays->d_inv[s], rays->max_t[s], &hit_ts) & child_mask;
+						hit_ts.store(near_hits);
+					}
+
+					// Push results to the bit stack
+					if (hit_mask != 0) {
+						if (!rot_set) {
+							rot_set = true;
+							for (int c = 1; c < num_children; ++c) {
+								if (near_hits[c] < near_hits[rot])
+									rot = c;
+							}
+						}
+						rays->trav_stack[s].push((hit_mask >> rot) | (hit_mask << (num_children-rot)), num_children);
+					}
+
+					// Return whether the ray hit any of the child nodes
+					return hit_mask != 0;
+				} else {
+					return false;
+				}
+			});
+
+			if (first_call)
+				first_call = false;
+
+			// If any rays hit, traverse deeper
+			if (ray_stack[stack_ptr].first != ray_stack[stack_ptr].second) {
+				const auto node_i = node_stack[stack_ptr];
+
+				for (int i = 0; i < num_children; ++i) {
+					ray_stack[stack_ptr+i] = ray_stack[stack_ptr];
+					node_stack[stack_ptr+i] = bvh->child(node_i, num_children-1-((i+num_children-rot)%num_children));
+				}
+
+				stack_ptr += num_children - 1;
+			}
+			// If no rays hit, go to next stack item
+			else {
+				--stack_ptr;
+			}
+		}
+	}
+
+	// Finished traversal
+	return std::make_tuple(rays_end, rays_end, 0);
+}
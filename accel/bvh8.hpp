@@ -0,0 +1,173 @@
+#ifndef BVH8_HPP
+#define BVH8_HPP
+
+#include <stdlib.h>
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <tuple>
+
+#include "numtype.h"
+#include "global.hpp"
+
+#include "accel.hpp"
+#include "bvh_builder.hpp"
+#include "object.hpp"
+#include "ray.hpp"
+#include "bbox.hpp"
+#include "utils.hpp"
+#include "vector.hpp"
+
+
+
+
+/*
+ * An 8-wide bounding volume hierarchy.
+ *
+ * Built and laid out the same way as BVH4, except that each node splits its
+ * primitives three levels deep, giving up to eight children (see
+ * BVHBuilder).  That makes for a shallower tree, and fewer passes over the
+ * rays during traversal.
+ *
+ * Traversal pushes up to eight bits per level onto each ray's 64-bit
+ * traversal stack, which limits how deep the tree can be.  The stack is
+ * shared with the traversals of nested assemblies, so the limit depends on
+ * them as well (see trav_stack_bits()).  If the tree doesn't fit, a BVH4
+ * should be used instead.
+ */
+class BVH8: public Accel, private BVHBuilder<BVH8, 8> {
+public:
+	virtual void build(const Assembly& assembly);
+	virtual const std::vector<BBox>& bounds() const {
+		return _bounds;
+	};
+	virtual ~BVH8() {};
+
+	// Traversers need access to private data
+	friend class BVH8StreamTraverser;
+	friend class BVHBuilder<BVH8, 8>;
+
+	// The deepest a tree can be (counting the leaves) and still be
+	// traversed, without nested assemblies.  Each level leaves up to seven
+	// bits on the traversal stack while its children are visited.
+	static constexpr int MAX_DEPTH = ((64 - 8) / 7) + 2;
+
+	struct Node {
+		union {
+			uint32_t child_index = 0; // Index of the first child, the others follow it
+			uint32_t data_index; // For leaf nodes
+		};
+		uint32_t bounds_index = 0; // Index in node_bounds of the first time sample of the children's bounds
+		uint16_t ts = 0; // Number of time samples
+		uint16_t child_count = 0; // Zero indicates a leaf node
+	};
+
+	/**
+	 * @brief Returns the depth of the tree, counting the leaves.
+	 */
+	int depth() const {
+		return _depth;
+	}
+
+	/**
+	 * @brief Returns the most bits traversing the tree can leave on a
+	 * ray's traversal stack, when traversing the assemblies instanced in
+	 * it can leave up to nested_bits more (see BVHBuilder).  This has to
+	 * be at most RayStream::TRAV_STACK_BITS for the tree to be usable.
+	 */
+	int trav_stack_bits(const int nested_bits) const {
+		return BVHBuilder::trav_stack_bits(_depth, nested_bits);
+	}
+
+private:
+	std::vector<Node> nodes;
+	std::vector<BBox8> node_bounds;
+	std::vector<BBox> _bounds {BBox()};
+	int _depth = 0;
+
+	// Build data
+	const Assembly* assembly; // Set during build()
+
+	std::vector<BBox> pack_leaf(std::vector<Node>* out_nodes, std::vector<BBox8>* out_bounds, size_t node_i, const BVHPrimitive& prim);
+	std::vector<BBox> pack_node(std::vector<Node>* out_nodes, std::vector<BBox8>* out_bounds, size_t node_i, size_t first_child_i, int child_count, const std::vector<BBox>* child_bbs, const int* split_axes);
+	static void offset_node(Node* node, size_t node_offset, size_t bounds_offset);
+
+	/**
+	 * @brief Returns the index of the nth (0-7) child
+	 * of the node with the given index.
+	 */
+	inline size_t child(const size_t node_i, const int n) const {
+		return nodes[node_i].child_index + n;
+	}
+
+	/**
+	 * @brief Returns whether the node with the given index is a
+	 * leaf node or not.
+	 */
+	inline bool is_leaf(const size_t node_i) const {
+		return nodes[node_i].child_count == 0;
+	}
+
+	inline int child_count(const size_t node_i) const {
+		return nodes[node_i].child_count;
+	}
+};
+
+
+
+
+/**
+ * @brief A breadth-first traverser for BVH8.
+ */
+class BVH8StreamTraverser: public AccelStreamTraverser<BVH8> {
+public:
+	virtual ~BVH8StreamTraverser() {}
+
+	virtual void init_accel(const BVH8& accel) {
+		bvh = &accel;
+	}
+
+	virtual void init_rays(RayStream* rays_, size_t begin, size_t end) {
+		rays = rays_;
+		rays_end = end;
+		first_call = true;
+
+		// Initialize stack
+		if (bvh == nullptr || bvh->nodes.size() == 0) {
+			stack_ptr = -1;
+		} else {
+			stack_ptr = 0;
+		}
+		node_stack[0] = 0;
+		ray_stack[0].first = begin;
+		ray_stack[0].second = end;
+	}
+
+	virtual std::tuple<size_t, size_t, size_t> next_object() {
+		return traverse();
+	}
+
+private:
+	// Does the work of next_object().  Separate since virtual functions
+	// can't be compiled for several instruction sets (see cpu_dispatch.hpp).
+	std::tuple<size_t, size_t, size_t> traverse();
+
+	const BVH8* bvh = nullptr;
+	RayStream* rays = nullptr;
+	size_t rays_end = 0;
+	bool first_call = true;
+
+	// Stack data.  Trees deeper than BVH8::MAX_DEPTH would overflow the
+	// rays' traversal stacks even without nested assemblies, whose
+	// traversals push onto the same stacks and lower the limit further.
+	// Assembly::finalize() falls back to a BVH4 for trees that don't fit
+	// (see BVH8::trav_stack_bits()), so this is always deep enough.
+#define BVH8_STACK_SIZE (BVH8::MAX_DEPTH * 7)
+	int stack_ptr;
+	size_t node_stack[BVH8_STACK_SIZE];
+	std::pair<size_t, size_t> ray_stack[BVH8_STACK_SIZE];
+
+};
+
+
+#endif // BVH8_HPP
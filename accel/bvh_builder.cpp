@@ -0,0 +1,142 @@
+#include "numtype.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "bvh_builder.hpp"
+
+#include "utils.hpp"
+#include "assembly.hpp"
+#include "binned_sah.hpp"
+
+
+/*
+ * Fills bag with a primitive for each instance of the assembly, with
+ * their bounds resampled to the largest number of time samples amongst
+ * them, for the motion-aware split cost.
+ */
+void BVHBag::fill_bag(const Assembly& assembly) {
+	// Abbreviating subsequent code
+	const auto& instances = assembly.instances;
+
+	// Get instance bounds, and find the largest number of time samples
+	// amongst them
+	instance_bbs.clear();
+	instance_bbs.reserve(instances.size());
+	bag_time_samples = 1;
+	for (size_t i = 0; i < instances.size(); ++i) {
+		instance_bbs.emplace_back(assembly.instance_bounds(i));
+		bag_time_samples = std::max(bag_time_samples, instance_bbs.back().size());
+	}
+
+	// Create primitive bag
+	bag.clear();
+	bag_bounds.clear();
+	bag.reserve(instances.size());
+	bag_bounds.reserve(instances.size() * bag_time_samples);
+	for (size_t i = 0; i < instances.size(); ++i) {
+		// Get instance bounds at time 0.5
+		BBox bb = assembly.instance_bounds_at(0.5f, i);
+
+		// Create primitive
+		BVHPrimitive prim;
+		prim.instance_index = i;
+		prim.bounds_index = bag_bounds.size();
+		prim.bmin = bb.min;
+		prim.bmax = bb.max;
+		prim.c = lerp(0.5f, bb.min, bb.max);
+
+		// Resample its bounds to the build time samples
+		for (size_t t = 0; t < bag_time_samples; ++t) {
+			const float time = bag_time_samples > 1 ? (static_cast<float>(t) / (bag_time_samples - 1)) : 0.5f;
+			bag_bounds.push_back(lerp_seq(time, instance_bbs[i]));
+		}
+
+		// Add it to the bag
+		bag.push_back(prim);
+	}
+}
+
+
+/*
+ * Frees the build data.
+ */
+void BVHBag::clear_bag() {
+	bag = std::vector<BVHPrimitive>();
+	bag_bounds = std::vector<BBox>();
+	instance_bbs = std::vector<std::vector<BBox>>();
+}
+
+
+/*
+ * Determines the split of the primitives in bag starting
+ * at first and ending at last, using a binned SAH (see BinnedSAH::split()).
+ * May reorder that section of the list.
+ * Binning is done with up to the given number of threads.
+ * If split_axis isn't null, the axis of the split is stored in it.
+ * Returns the split index (last index of the first group).
+ *
+ * If median_splits is set, the primitives are instead split in half at
+ * the median of their centroids along the axis they're most spread out
+ * on.  The SAH splits can be arbitrarily lopsided, but halving the
+ * primitives at every split keeps the tree as shallow as possible.
+ */
+size_t BVHBag::split_primitives(size_t first_prim, size_t last_prim, size_t threads, int* split_axis) {
+	if (median_splits) {
+		BBox cbounds;
+		for (size_t i = first_prim; i <= last_prim; ++i)
+			cbounds = cbounds | bag[i].c;
+		const Vec3 extent = cbounds.max - cbounds.min;
+		int axis = (extent.y > extent.x) ? 1 : 0;
+		axis = (extent.z > extent[axis]) ? 2 : axis;
+
+		const size_t split_index = first_prim + ((last_prim - first_prim) / 2);
+		std::nth_element(bag.begin() + first_prim, bag.begin() + split_index, bag.begin() + last_prim + 1, [axis](const BVHPrimitive & a, const BVHPrimitive & b) {
+			return a.c[axis] < b.c[axis];
+		});
+
+		if (split_axis != nullptr)
+			*split_axis = (extent[axis] > 0.0f) ? axis : -1;
+		return split_index;
+	}
+
+	const auto mid_itr = BinnedSAH::split(bag.begin() + first_prim, bag.begin() + last_prim + 1, bag_time_samples,
+	[](const BVHPrimitive & prim) {
+		return prim.c;
+	},
+	[this](const BVHPrimitive & prim, size_t t) {
+		return bag_bounds[prim.bounds_index + t];
+	}, threads, split_axis);
+
+	return std::distance(bag.begin(), mid_itr) - 1;
+}
+
+
+/*
+ * Returns the bounds that enclose all of the given sequences of bounds.  If
+ * they all have the same number of time samples, that's their
+ * per-time-sample union.  Otherwise it's a single bounding box that
+ * encloses everything.
+ */
+std::vector<BBox> BVHBag::union_bounds(const std::vector<BBox>* bbs, const size_t count) {
+	bool equal_time_samples = true;
+	for (size_t c = 1; c < count; ++c)
+		equal_time_samples = equal_time_samples && (bbs[c-1].size() == bbs[c].size());
+
+	std::vector<BBox> union_bbs;
+	if (equal_time_samples) {
+		union_bbs = bbs[0];
+		for (size_t c = 1; c < count; ++c) {
+			for (size_t i = 0; i < union_bbs.size(); ++i)
+				union_bbs[i].merge_with(bbs[c][i]);
+		}
+	} else {
+		union_bbs.push_back(bbs[0][0]);
+		for (size_t c = 0; c < count; ++c) {
+			for (const auto& bb: bbs[c])
+				union_bbs[0].merge_with(bb);
+		}
+	}
+
+	return union_bbs;
+}
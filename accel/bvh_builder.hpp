@@ -0,0 +1,259 @@
+#ifndef BVH_BUILDER_HPP
+#define BVH_BUILDER_HPP
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#include "numtype.h"
+
+#include "bbox.hpp"
+#include "vector.hpp"
+
+class Assembly;
+
+
+
+/*
+ * A primitive that has yet to be inserted into a hierarchy.
+ * Contains the time 0.5 bounds of the object and it's centroid,
+ * and the index of its bounds at each build time sample in
+ * bag_bounds.
+ */
+struct BVHPrimitive {
+	size_t instance_index;
+	size_t bounds_index;
+	Vec3 bmin, bmax, c;
+};
+
+
+/*
+ * The primitives a BVH is built from, and the binned SAH splitting of
+ * them.  See BVHBuilder.
+ */
+class BVHBag {
+protected:
+	std::vector<BVHPrimitive> bag;  // Holding spot for objects not yet added to the hierarchy
+	std::vector<BBox> bag_bounds; // Bounds of the objects in bag, resampled to bag_time_samples time samples each
+	size_t bag_time_samples = 1;
+	std::vector<std::vector<BBox>> instance_bbs; // Bounds of each instance, at their own time samples
+	bool median_splits = false; // Split primitives in half instead of by SAH, see split_primitives()
+
+	void fill_bag(const Assembly& assembly);
+	void clear_bag();
+	size_t split_primitives(size_t first_prim, size_t last_prim, size_t threads, int* split_axis = nullptr);
+	static std::vector<BBox> union_bounds(const std::vector<BBox>* bbs, size_t count);
+};
+
+
+/*
+ * Builds a BVH with up to WIDTH (2, 4 or 8) children per node from the
+ * instances of an assembly, for the ACCEL deriving from it, which only
+ * packs the nodes into its own format.
+ *
+ * The tree is laid out with the children of each node next to each other,
+ * after it.  Each node splits its primitives log2(WIDTH) levels deep with
+ * a binned SAH (see BinnedSAH::split()), and the subtrees of its children
+ * are built recursively.
+ *
+ * With more than one thread, the subtrees of the children of large nodes
+ * are built on separate threads into their own buffers, and then spliced
+ * in, in order.  The SAH splits don't depend on the number of threads, so
+ * the result is identical to a single-threaded build.
+ *
+ * ACCEL provides, for its node type NODE and bounds type BOUNDS:
+ *
+ * std::vector<BBox> pack_leaf(std::vector<NODE>* nodes, std::vector<BOUNDS>* bounds, size_t node_i, const BVHPrimitive& prim);
+ *     Fills in (*nodes)[node_i] as a leaf for prim.
+ *
+ * std::vector<BBox> pack_node(std::vector<NODE>* nodes, std::vector<BOUNDS>* bounds, size_t node_i, size_t first_child_i, int child_count, const std::vector<BBox>* child_bbs, const int* split_axes);
+ *     Fills in (*nodes)[node_i] as the parent of the child_count nodes
+ *     from first_child_i on, whose subtree bounds are child_bbs.
+ *     split_axes holds the axes of the WIDTH - 1 splits, in the order of
+ *     a binary heap: the top split, then the splits of its halves, and so
+ *     on.  The axis is 3 for splits without an axis, and -1 for ranges of
+ *     a single primitive that weren't split.
+ *
+ * static void offset_node(NODE* node, size_t node_offset, size_t bounds_offset);
+ *     Offsets the indices of a node built into its own buffers, when
+ *     they're spliced in.
+ *
+ * Both pack functions may append to bounds, and return the bounds of the
+ * node's subtree (see union_bounds()).
+ */
+template <typename ACCEL, int WIDTH>
+class BVHBuilder: protected BVHBag {
+protected:
+	// The minimum number of primitives in a subtree to bother building
+	// its children on separate threads
+	static constexpr size_t PARALLEL_BUILD_MIN = 1 << 10;
+
+	int split_children(size_t first_prim, size_t last_prim, size_t threads, size_t* child_first, size_t* child_last, int* split_axes);
+
+	template <typename NODE, typename BOUNDS>
+	std::vector<BBox> recursive_build(std::vector<NODE>* out_nodes, std::vector<BOUNDS>* out_bounds, size_t node_i, size_t first_prim, size_t last_prim, size_t threads);
+
+	template <typename NODE>
+	static int tree_depth(const std::vector<NODE>& nodes, size_t root_count);
+
+	/*
+	 * Returns the most bits traversing a tree of the given depth (counting
+	 * the leaves) can leave on a ray's traversal stack, when traversing the
+	 * assemblies instanced at its leaves can leave up to nested_bits more
+	 * on top (see RayStream::trav_stack).  Each node pushes a bit per
+	 * child, and each level on the way to a leaf leaves up to WIDTH - 1 of
+	 * them for the children not visited yet.
+	 */
+	static int trav_stack_bits(const int depth, const int nested_bits) {
+		if (depth <= 1)
+			return (depth == 1) ? nested_bits : 0;
+		return std::max(((depth - 2) * (WIDTH - 1)) + WIDTH, ((depth - 1) * (WIDTH - 1)) + nested_bits);
+	}
+};
+
+
+
+/*
+ * Splits the primitives in bag from first_prim to last_prim into up to
+ * WIDTH ranges, given by child_first and child_last, and stores the axes
+ * of the splits in split_axes (see BVHBuilder).
+ * Returns the number of ranges.
+ */
+template <typename ACCEL, int WIDTH>
+int BVHBuilder<ACCEL, WIDTH>::split_children(size_t first_prim, size_t last_prim, size_t threads, size_t* child_first, size_t* child_last, int* split_axes) {
+	int child_count = 1;
+	child_first[0] = first_prim;
+	child_last[0] = last_prim;
+	size_t heap_i[WIDTH] = {0}; // Index in split_axes of each range's split
+	std::fill_n(split_axes, WIDTH - 1, -1);
+
+	for (int width = 1; width < WIDTH; width *= 2) {
+		const int parent_count = child_count;
+		size_t parent_first[WIDTH];
+		size_t parent_last[WIDTH];
+		size_t parent_heap_i[WIDTH];
+		std::copy(child_first, child_first + parent_count, parent_first);
+		std::copy(child_last, child_last + parent_count, parent_last);
+		std::copy(heap_i, heap_i + parent_count, parent_heap_i);
+		child_count = 0;
+		for (int p = 0; p < parent_count; ++p) {
+			const size_t h = parent_heap_i[p];
+			if (parent_first[p] == parent_last[p]) {
+				child_first[child_count] = parent_first[p];
+				child_last[child_count] = parent_last[p];
+				heap_i[child_count] = (h * 2) + 1;
+				++child_count;
+			} else {
+				int axis;
+				const size_t split_index = split_primitives(parent_first[p], parent_last[p], threads, &axis);
+				split_axes[h] = (axis < 0) ? 3 : axis;
+				child_first[child_count] = parent_first[p];
+				child_last[child_count] = split_index;
+				heap_i[child_count] = (h * 2) + 1;
+				++child_count;
+				child_first[child_count] = split_index + 1;
+				child_last[child_count] = parent_last[p];
+				heap_i[child_count] = (h * 2) + 2;
+				++child_count;
+			}
+		}
+	}
+
+	return child_count;
+}
+
+
+/*
+ * Recursively builds the subtree for the primitives in bag from
+ * first_prim to last_prim, with nodes[node_i] (already allocated) as its
+ * root.  The subtree's other nodes and bounds are appended to out_nodes and
+ * out_bounds.
+ *
+ * Returns the bounds of the subtree.
+ */
+template <typename ACCEL, int WIDTH>
+template <typename NODE, typename BOUNDS>
+std::vector<BBox> BVHBuilder<ACCEL, WIDTH>::recursive_build(std::vector<NODE>* out_nodes, std::vector<BOUNDS>* out_bounds, size_t node_i, size_t first_prim, size_t last_prim, size_t threads) {
+	auto& nodes = *out_nodes;
+	auto& bounds = *out_bounds;
+	ACCEL* accel = static_cast<ACCEL*>(this);
+
+	if (first_prim == last_prim)
+		return accel->pack_leaf(out_nodes, out_bounds, node_i, bag[first_prim]);
+
+	size_t child_first[WIDTH];
+	size_t child_last[WIDTH];
+	int split_axes[WIDTH - 1];
+	const int child_count = split_children(first_prim, last_prim, threads, child_first, child_last, split_axes);
+
+	// Allocate the children next to each other
+	const size_t first_child_i = nodes.size();
+	nodes.resize(first_child_i + child_count);
+
+	// Build the children's subtrees
+	std::vector<BBox> child_bbs[WIDTH];
+	if (threads > 1 && (last_prim - first_prim) >= PARALLEL_BUILD_MIN) {
+		// Build all but the first child into their own buffers, on other
+		// threads unless they're a single leaf
+		const size_t child_threads = std::max<size_t>(1, threads / child_count);
+		std::vector<NODE> sub_nodes[WIDTH];
+		std::vector<BOUNDS> sub_bounds[WIDTH];
+		std::vector<std::thread> workers;
+		for (int c = 1; c < child_count; ++c) {
+			sub_nodes[c].push_back(NODE());
+			if (child_first[c] == child_last[c]) {
+				child_bbs[c] = recursive_build(&sub_nodes[c], &sub_bounds[c], 0, child_first[c], child_last[c], 1);
+			} else {
+				workers.emplace_back([&, c]() {
+					child_bbs[c] = recursive_build(&sub_nodes[c], &sub_bounds[c], 0, child_first[c], child_last[c], child_threads);
+				});
+			}
+		}
+		child_bbs[0] = recursive_build(&nodes, &bounds, first_child_i, child_first[0], child_last[0], child_threads);
+		for (auto& worker: workers)
+			worker.join();
+
+		// Splice them in, in order.  The root of each goes into its
+		// child slot, and the rest is appended.
+		for (int c = 1; c < child_count; ++c) {
+			const size_t node_offset = nodes.size() - 1;
+			const size_t bounds_offset = bounds.size();
+			for (auto& node: sub_nodes[c])
+				ACCEL::offset_node(&node, node_offset, bounds_offset);
+			nodes[first_child_i + c] = sub_nodes[c][0];
+			nodes.insert(nodes.end(), sub_nodes[c].begin() + 1, sub_nodes[c].end());
+			bounds.insert(bounds.end(), sub_bounds[c].begin(), sub_bounds[c].end());
+		}
+	} else {
+		for (int c = 0; c < child_count; ++c)
+			child_bbs[c] = recursive_build(&nodes, &bounds, first_child_i + c, child_first[c], child_last[c], threads);
+	}
+
+	return accel->pack_node(out_nodes, out_bounds, node_i, first_child_i, child_count, child_bbs, split_axes);
+}
+
+
+/*
+ * Returns the depth of the trees in nodes (counting the leaves), whose
+ * roots are the first root_count nodes.  NODE needs child_index and
+ * child_count fields.
+ */
+template <typename ACCEL, int WIDTH>
+template <typename NODE>
+int BVHBuilder<ACCEL, WIDTH>::tree_depth(const std::vector<NODE>& nodes, const size_t root_count) {
+	// Children always come after their parents, so a backwards pass
+	// sees them first
+	std::vector<int> depths(nodes.size(), 1);
+	for (size_t i = nodes.size(); i-- > 0;) {
+		for (int c = 0; c < nodes[i].child_count; ++c)
+			depths[i] = std::max(depths[i], depths[nodes[i].child_index + c] + 1);
+	}
+
+	int depth = 0;
+	for (size_t i = 0; i < root_count && i < nodes.size(); ++i)
+		depth = std::max(depth, depths[i]);
+	return depth;
+}
+
+
+#endif // BVH_BUILDER_HPP
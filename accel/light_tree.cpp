@@ -100,6 +100,80 @@ void LightTree::build(const Assembly& assembly_) {
 	assembly = &assembly_;
 
 	// Populate the build nodes
+	total_lights = collect_lights(&build_nodes);
+
+	if (build_nodes.size() > 0) {
+		recursive_build(build_nodes.begin(), build_nodes.end());
+		bounds_ = nodes[0].bounds;
+		total_energy = nodes[0].energy;
+	} else {
+		bounds_.clear();
+		bounds_.emplace_back(BBox());
+	}
+}
+
+
+/*
+ * Updates the bounds and energies of the tree for the given assembly,
+ * keeping the tree's structure.  The assembly should have the same
+ * instances as the one the tree was built for.
+ *
+ * Returns false if the instances that emit light have changed, in which
+ * case the tree is left in an unspecified state and should be rebuilt.
+ * Unlike BVH4::refit() there's no quality check, since the tree isn't
+ * built with a cost metric to begin with.
+ */
+bool LightTree::refit(const Assembly& assembly_) {
+	assembly = &assembly_;
+
+	std::vector<BuildNode> lights;
+	const size_t light_count = collect_lights(&lights);
+	std::vector<const BuildNode*> instance_lights(assembly->instances.size(), nullptr);
+	for (const auto& light: lights)
+		instance_lights[light.instance_index] = &light;
+
+	// Make sure the same instances are still the lights
+	size_t leaf_count = 0;
+	for (const auto& node: nodes) {
+		if (node.is_leaf) {
+			if (node.instance_index >= instance_lights.size() || instance_lights[node.instance_index] == nullptr)
+				return false;
+			++leaf_count;
+		}
+	}
+	if (leaf_count != lights.size())
+		return false;
+	if (nodes.empty())
+		return true;
+
+	// Children always come after their parents, so going backwards
+	// updates them first
+	for (size_t i = nodes.size(); i-- > 0;) {
+		Node& node = nodes[i];
+		if (node.is_leaf) {
+			node.bounds = light_bounds(node.instance_index);
+			node.energy = instance_lights[node.instance_index]->energy;
+		} else {
+			node.bounds = merge(nodes[node.index1].bounds, nodes[node.index2].bounds);
+			node.energy = nodes[node.index1].energy + nodes[node.index2].energy;
+		}
+	}
+
+	bounds_ = nodes[0].bounds;
+	total_energy = nodes[0].energy;
+	total_lights = light_count;
+	return true;
+}
+
+
+/*
+ * Appends a build node for each instance in the assembly that emits light
+ * to out_lights, and returns the total number of lights in them.
+ */
+size_t LightTree::collect_lights(std::vector<BuildNode>* out_lights) const {
+	auto& build_nodes = *out_lights;
+	size_t total_lights = 0;
+
 	for (size_t i = 0; i < assembly->instances.size(); ++i) {
 		const auto& instance = assembly->instances[i]; // Shorthand
 
@@ -145,13 +219,27 @@ void LightTree::build(const Assembly& assembly_) {
 		}
 	}
 
-	if (build_nodes.size() > 0) {
-		recursive_build(build_nodes.begin(), build_nodes.end());
-		bounds_ = nodes[0].bounds;
-		total_energy = nodes[0].energy;
+	return total_lights;
+}
+
+
+/*
+ * Returns the bounds of the light instance with the given index.
+ */
+std::vector<BBox> LightTree::light_bounds(size_t instance_index) const {
+	const Instance& instance = assembly->instances[instance_index];
+
+	if (instance.type == Instance::ASSEMBLY) {
+		const Assembly* assmb = assembly->assemblies[instance.data_index].get();
+		if (instance.transform_count > 0) {
+			auto xstart = assembly->xforms.cbegin() + instance.transform_index;
+			auto xend = xstart + instance.transform_count;
+			return transform_from(assmb->light_accel.bounds(), xstart, xend);
+		} else {
+			return assmb->light_accel.bounds();
+		}
 	} else {
-		bounds_.clear();
-		bounds_.emplace_back(BBox());
+		return assembly->instance_bounds(instance_index);
 	}
 }
 
@@ -195,24 +283,9 @@ size_t LightTree::recursive_build(std::vector<LightTree::BuildNode>::iterator st
 
 	if ((start + 1) == end) {
 		// Leaf node
-		const Instance& instance = assembly->instances[start->instance_index];
-
 		nodes[me].is_leaf = true;
 		nodes[me].instance_index = start->instance_index;
-
-		// Get bounds
-		if (instance.type == Instance::OBJECT) {
-			nodes[me].bounds = assembly->instance_bounds(start->instance_index);
-		} else if (instance.type == Instance::ASSEMBLY) {
-			const Assembly* assmb = assembly->assemblies[instance.data_index].get();
-			if (instance.transform_count > 0) {
-				auto xstart = assembly->xforms.cbegin() + instance.transform_index;
-				auto xend = xstart + instance.transform_count;
-				nodes[me].bounds = transform_from(assmb->light_accel.bounds(), xstart, xend);
-			} else {
-				nodes[me].bounds = assmb->light_accel.bounds();
-			}
-		}
+		nodes[me].bounds = light_bounds(start->instance_index);
 
 		// Copy energy
 		nodes[me].energy = start->energy;
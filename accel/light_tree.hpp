@@ -30,6 +30,8 @@ class LightTree final: public LightAccel {
 	float total_energy {0.0f};
 	size_t total_lights {0};
 
+	size_t collect_lights(std::vector<BuildNode>* out_lights) const;
+	std::vector<BBox> light_bounds(size_t instance_index) const;
 	std::vector<BuildNode>::iterator split_lights(std::vector<BuildNode>::iterator start, std::vector<BuildNode>::iterator end);
 	size_t recursive_build(std::vector<BuildNode>::iterator start, std::vector<BuildNode>::iterator end);
 
@@ -37,9 +39,15 @@ class LightTree final: public LightAccel {
 
 
 public:
+	LightTree() = default;
+	LightTree(const LightTree&) = default;
+	LightTree(LightTree&&) = default;
+	LightTree& operator=(const LightTree&) = default;
+	LightTree& operator=(LightTree&&) = default;
 	~LightTree() {}
 
 	virtual void build(const Assembly& assembly) override;
+	bool refit(const Assembly& assembly);
 
 	virtual void sample(LightQuery* query) const override;
 
@@ -11,6 +11,7 @@
 #include <array>
 
 #include "simd.hpp"
+#include "cpu_dispatch.hpp"
 #include "global.hpp"
 #include "vector.hpp"
 #include "ray.hpp"
@@ -156,19 +157,27 @@ struct BBox {
 		}
 #endif
 
+		return intersect_ray(ray.o, ray.d_inv, hitt0, hitt1, t);
+	}
+
+	/**
+	 * @brief Tests a ray against the BBox, with the ray given as
+	 * its origin and inverse direction.
+	 */
+	inline bool intersect_ray(const Vec3& o, const Vec3& d_inv, float *hitt0, float *hitt1, const float t) const {
 		// Find slab intersections
-		const float tx1 = (min.x - ray.o.x) * ray.d_inv.x;
-		const float tx2 = (max.x - ray.o.x) * ray.d_inv.x;
+		const float tx1 = (min.x - o.x) * d_inv.x;
+		const float tx2 = (max.x - o.x) * d_inv.x;
 		*hitt0 = std::min(tx1, tx2);
 		*hitt1 = std::max(tx1, tx2);
 
-		const float ty1 = (min.y - ray.o.y) * ray.d_inv.y;
-		const float ty2 = (max.y - ray.o.y) * ray.d_inv.y;
+		const float ty1 = (min.y - o.y) * d_inv.y;
+		const float ty2 = (max.y - o.y) * d_inv.y;
 		*hitt0 = std::max(*hitt0, std::min(ty1, ty2));
 		*hitt1 = std::min(*hitt1, std::max(ty1, ty2));
 
-		const float tz1 = (min.z - ray.o.z) * ray.d_inv.z;
-		const float tz2 = (max.z - ray.o.z) * ray.d_inv.z;
+		const float tz1 = (min.z - o.z) * d_inv.z;
+		const float tz2 = (max.z - o.z) * d_inv.z;
 		*hitt0 = std::max(0.0f, std::max(*hitt0, std::min(tz1, tz2)));
 		*hitt1 = std::min(*hitt1, std::max(tz1, tz2)) * BBOX_MAXT_ADJUST;
 
@@ -431,14 +440,17 @@ struct BBox2 {
 
 
 	inline unsigned int intersect_ray(const Ray& ray, SIMD::float4 *hit_ts) const {
+		return intersect_ray(ray.o, ray.get_d_inverse(), ray.max_t, hit_ts);
+	}
+
+	inline unsigned int intersect_ray(const Vec3& o, const Vec3& d_inv_f, const float t, SIMD::float4 *hit_ts) const {
 		using namespace SIMD;
-		const Vec3 d_inv_f = ray.get_d_inverse();
 
 		// Load ray origin, inverse direction, and max_t into simd layouts for intersection testing
-		const float4 ray_o[3] = {ray.o[0], ray.o[1], ray.o[2]};
+		const float4 ray_o[3] = {o[0], o[1], o[2]};
 		const float4 d_inv[3] = {d_inv_f[0], d_inv_f[1], d_inv_f[2]};
 		const float4 max_t {
-			ray.max_t
+			t
 		};
 
 		return intersect_ray(ray_o, d_inv, max_t, hit_ts);
@@ -537,6 +549,13 @@ struct BBox4 {
 		return result;
 	}
 
+	/**
+	 * @brief Returns the nth (0-3) of the four boxes.
+	 */
+	BBox get_bbox(const int n) const {
+		return BBox(Vec3(bounds[0][n], bounds[2][n], bounds[4][n]), Vec3(bounds[1][n], bounds[3][n], bounds[5][n]));
+	}
+
 	/**
 	 * @brief Merge another BBox4 into this one.
 	 *
@@ -595,15 +614,57 @@ struct BBox4 {
 	}
 
 
+	/**
+	 * @brief Tests four rays against one of the BBox4's bounding boxes.
+	 *
+	 * Gives the same result for each ray as intersect_ray() does for that
+	 * box, but is faster when there are many rays to test against each box.
+	 *
+	 * @param[in] k Which of the four boxes to test against.
+	 * @param[in] o The origins of the rays, laid out as [[x,x,x,x],[y,y,y,y],[z,z,z,z]].
+	 * @param[in] d_inv The directions of the rays over 1.0, laid out the same as o.
+	 * @param[in] t_max The maximum t values of the rays.
+	 *
+	 * @returns A bitmask indicating which (if any) of the four rays hit the box.
+	 */
+	inline unsigned int intersect_rays(const int k, const SIMD::float4* o, const SIMD::float4* d_inv, const SIMD::float4& t_max) const {
+		using namespace SIMD;
+		static const float4 zeros(0.0f);
+		static const float4 ninf(-std::numeric_limits<float>::infinity());
+
+		// Calculate the plane intersections, picking the near and far
+		// plane of each axis per ray
+		float4 los[3];
+		float4 his[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			const float4 neg = lt(d_inv[axis], zeros);
+			const float4 lo(bounds[axis*2][k]);
+			const float4 hi(bounds[axis*2+1][k]);
+			los[axis] = (select(neg, hi, lo) - o[axis]) * d_inv[axis];
+			his[axis] = (select(neg, lo, hi) - o[axis]) * d_inv[axis];
+		}
+
+		// Get the minimum and maximum hits
+		const float4 mins = max(max(los[0], los[1]), max(los[2], zeros));
+		const float4 maxs = max(min(min(his[0], his[1]), his[2]), ninf) * float4(BBOX_MAXT_ADJUST);
+
+		// Check for hits
+		return to_bitmask(lt(mins, t_max) && lte(mins, maxs));
+	}
+
+
 	inline unsigned int intersect_ray(const Ray& ray, SIMD::float4 *hit_ts) const {
+		return intersect_ray(ray.o, ray.get_d_inverse(), ray.max_t, hit_ts);
+	}
+
+	inline unsigned int intersect_ray(const Vec3& o, const Vec3& d_inv_f, const float t, SIMD::float4 *hit_ts) const {
 		using namespace SIMD;
-		const Vec3 d_inv_f = ray.get_d_inverse();
 
 		// Load ray origin, inverse direction, and max_t into simd layouts for intersection testing
-		const float4 ray_o[3] = {ray.o[0], ray.o[1], ray.o[2]};
+		const float4 ray_o[3] = {o[0], o[1], o[2]};
 		const float4 d_inv[3] = {d_inv_f[0], d_inv_f[1], d_inv_f[2]};
 		const float4 max_t {
-			ray.max_t
+			t
 		};
 
 		return intersect_ray(ray_o, d_inv, max_t, hit_ts);
@@ -612,6 +673,235 @@ struct BBox4 {
 };
 
 
+/**
+ * @brief Eight axis-aligned bounding boxes, for testing a ray against all
+ * of them at once.
+ *
+ * The bounds are laid out the same as in BBox4, but stored as plain floats
+ * (see SIMD::float8 for why).
+ */
+struct BBox8 {
+	float bounds[6][8];
+
+	BBox8() {
+		for (int i = 0; i < 6; i += 2) {
+			for (int k = 0; k < 8; ++k) {
+				bounds[i][k] = std::numeric_limits<float>::infinity();
+				bounds[i+1][k] = -std::numeric_limits<float>::infinity();
+			}
+		}
+	}
+
+	// Construct from eight BBox's
+	explicit BBox8(const BBox* bbs) {
+		for (int k = 0; k < 8; ++k) {
+			for (int axis = 0; axis < 3; ++axis) {
+				bounds[axis*2][k] = bbs[k].min[axis];
+				bounds[axis*2+1][k] = bbs[k].max[axis];
+			}
+		}
+	}
+
+	// Operators to allow the bounds to be interpolated conveniently
+	BBox8 operator+(const BBox8& b) const {
+		BBox8 result;
+		for (int i = 0; i < 6; ++i)
+			(SIMD::float8::load(bounds[i]) + SIMD::float8::load(b.bounds[i])).store(result.bounds[i]);
+		return result;
+	}
+
+	BBox8 operator*(const float f) const {
+		BBox8 result;
+		for (int i = 0; i < 6; ++i)
+			(SIMD::float8::load(bounds[i]) * SIMD::float8(f)).store(result.bounds[i]);
+		return result;
+	}
+
+	/**
+	 * @brief Tests a ray against the BBox8's bounding boxes.
+	 *
+	 * The same as BBox4::intersect_ray(), but eight wide.
+	 *
+	 * @returns A bitmask indicating which (if any) of the eight boxes were hit.
+	 */
+	inline unsigned int intersect_ray(const Vec3& o_f, const Vec3& d_inv_f, const float t, SIMD::float8 *hit_ts) const {
+		using namespace SIMD;
+		const float8 zeros(0.0f);
+		const float8 ninf(-std::numeric_limits<float>::infinity());
+		const float8 o[3] = {o_f[0], o_f[1], o_f[2]};
+		const float8 d_inv[3] = {d_inv_f[0], d_inv_f[1], d_inv_f[2]};
+
+		// Calculate the plane intersections
+		const int ds0 = d_inv_f[0] < 0.0f;
+		const float8 xlos = (float8::load(bounds[0+ds0]) - o[0]) * d_inv[0];
+		const float8 xhis = (float8::load(bounds[1-ds0]) - o[0]) * d_inv[0];
+
+		const int ds1 = d_inv_f[1] < 0.0f;
+		const float8 ylos = (float8::load(bounds[2+ds1]) - o[1]) * d_inv[1];
+		const float8 yhis = (float8::load(bounds[3-ds1]) - o[1]) * d_inv[1];
+
+		const int ds2 = d_inv_f[2] < 0.0f;
+		const float8 zlos = (float8::load(bounds[4+ds2]) - o[2]) * d_inv[2];
+		const float8 zhis = (float8::load(bounds[5-ds2]) - o[2]) * d_inv[2];
+
+		// Get the minimum and maximum hits
+		const float8 mins = max(max(xlos, ylos), max(zlos, zeros));
+		const float8 maxs = max(min(min(xhis, yhis), zhis), ninf) * float8(BBOX_MAXT_ADJUST);
+
+		// Check for hits
+		const float8 hits = lt(mins, float8(t)) && lte(mins, maxs);
+
+		// Fill in near hits
+		*hit_ts = mins;
+
+		return to_bitmask(hits);
+	}
+
+#ifdef CPU_DISPATCH_ENABLED
+	/**
+	 * @brief The same as intersect_ray(), but always with 256-bit AVX
+	 * instructions, even when the build doesn't target AVX and float8 is a
+	 * pair of SSE registers.
+	 *
+	 * May only be called on CPUs with AVX2 (see CPUDispatch::has_avx2()).
+	 * It's inlined into the AVX2 versions of CPU_DISPATCH functions.  The
+	 * operations are the same as intersect_ray()'s, so the results are
+	 * identical.
+	 *
+	 * @param hit_ts Receives the eight near hits.
+	 */
+	__attribute__((target("avx2")))
+	inline unsigned int intersect_ray_avx2(const Vec3& o_f, const Vec3& d_inv_f, const float t, float* hit_ts) const {
+		const __m256 zeros = _mm256_setzero_ps();
+		const __m256 ninf = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+		const __m256 o[3] = {_mm256_set1_ps(o_f[0]), _mm256_set1_ps(o_f[1]), _mm256_set1_ps(o_f[2])};
+		const __m256 d_inv[3] = {_mm256_set1_ps(d_inv_f[0]), _mm256_set1_ps(d_inv_f[1]), _mm256_set1_ps(d_inv_f[2])};
+
+		// Calculate the plane intersections
+		const int ds0 = d_inv_f[0] < 0.0f;
+		const __m256 xlos = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[0+ds0]), o[0]), d_inv[0]);
+		const __m256 xhis = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[1-ds0]), o[0]), d_inv[0]);
+
+		const int ds1 = d_inv_f[1] < 0.0f;
+		const __m256 ylos = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[2+ds1]), o[1]), d_inv[1]);
+		const __m256 yhis = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[3-ds1]), o[1]), d_inv[1]);
+
+		const int ds2 = d_inv_f[2] < 0.0f;
+		const __m256 zlos = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[4+ds2]), o[2]), d_inv[2]);
+		const __m256 zhis = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[5-ds2]), o[2]), d_inv[2]);
+
+		// Get the minimum and maximum hits
+		const __m256 mins = _mm256_max_ps(_mm256_max_ps(xlos, ylos), _mm256_max_ps(zlos, zeros));
+		const __m256 maxs = _mm256_mul_ps(_mm256_max_ps(_mm256_min_ps(_mm256_min_ps(xhis, yhis), zhis), ninf), _mm256_set1_ps(BBOX_MAXT_ADJUST));
+
+		// Check for hits
+		const __m256 hits = _mm256_and_ps(_mm256_cmp_ps(mins, _mm256_set1_ps(t), _CMP_LT_OS), _mm256_cmp_ps(mins, maxs, _CMP_LE_OS));
+
+		// Fill in near hits
+		_mm256_storeu_ps(hit_ts, mins);
+
+		return _mm256_movemask_ps(hits);
+	}
+#endif
+};
+
+
+/**
+ * @brief A BBox4 with its bounds quantized to fewer bits, to save memory.
+ *
+ * T is the integer type to quantize to (uint8_t or uint16_t).  The planes
+ * of the four boxes are stored relative to a frame box that encloses all
+ * of them, which isn't stored along with them: it has to be passed again
+ * for decoding.  (BVH4 uses a node's decoded bounds in its parent as the
+ * frame for its children's bounds, see BVH4::child_frame().)  Minimum
+ * planes are stored as steps up from the frame's minimum and maximum planes
+ * as steps down from its maximum, rounded outwards, so the decoded boxes
+ * always enclose the original ones.
+ *
+ * Empty boxes (such as the unused slots of a BVH4 node) don't necessarily
+ * decode as empty, so they need to be ignored by other means.
+ */
+template <typename T>
+struct QuantizedBBox4 {
+	static constexpr int QMAX = std::numeric_limits<T>::max();
+
+	T q[6][4]; // Quantized planes, laid out the same as BBox4::bounds
+
+	QuantizedBBox4() {}
+
+	/**
+	 * @brief Quantizes the boxes relative to the given frame, which
+	 * should enclose all of the non-empty ones.
+	 */
+	QuantizedBBox4(const BBox4& b, const BBox& frame) {
+		for (int axis = 0; axis < 3; ++axis) {
+			const int i_min = axis * 2;
+			const int i_max = i_min + 1;
+			const float step = frame_step(frame, axis);
+
+			for (int k = 0; k < 4; ++k) {
+				if (b.bounds[i_min][k] <= b.bounds[i_max][k]) {
+					q[i_min][k] = quantize(std::floor((b.bounds[i_min][k] - frame.min[axis]) / step));
+					q[i_max][k] = quantize(std::floor((frame.max[axis] - b.bounds[i_max][k]) / step));
+				} else {
+					q[i_min][k] = QMAX;
+					q[i_max][k] = QMAX;
+				}
+			}
+		}
+
+		// Fix up any planes that rounding in the decoding pushed inwards
+		bool conservative = false;
+		while (!conservative) {
+			conservative = true;
+			const BBox4 d = decode(frame);
+			for (int i = 0; i < 6; i += 2) {
+				for (int k = 0; k < 4; ++k) {
+					if (b.bounds[i][k] > b.bounds[i+1][k])
+						continue;
+					if (d.bounds[i][k] > b.bounds[i][k] && q[i][k] > 0) {
+						--q[i][k];
+						conservative = false;
+					}
+					if (d.bounds[i+1][k] < b.bounds[i+1][k] && q[i+1][k] > 0) {
+						--q[i+1][k];
+						conservative = false;
+					}
+				}
+			}
+		}
+	}
+
+	/**
+	 * @brief Returns the decoded boxes, given the frame they were
+	 * quantized relative to.
+	 */
+	inline BBox4 decode(const BBox& frame) const {
+		BBox4 b;
+		for (int axis = 0; axis < 3; ++axis) {
+			const float step = frame_step(frame, axis);
+			b.bounds[axis*2] = SIMD::float4(frame.min[axis]) + (SIMD::to_float4(q[axis*2]) * step);
+			b.bounds[axis*2+1] = SIMD::float4(frame.max[axis]) - (SIMD::to_float4(q[axis*2+1]) * step);
+		}
+		return b;
+	}
+
+private:
+	static inline float frame_step(const BBox& frame, const int axis) {
+		return (frame.max[axis] - frame.min[axis]) * (1.0f / QMAX);
+	}
+
+	static T quantize(float f) {
+		if (!(f > 0.0f))
+			return 0;
+		else if (f >= QMAX)
+			return QMAX;
+		else
+			return static_cast<T>(f);
+	}
+};
+
+
 /**
  * Merges two vectors of BBoxes, interpreting the vectors as
  * being the BBoxes over time.  The result is a vector that
@@ -668,5 +958,56 @@ static inline std::vector<BBox> transform_from(const std::vector<BBox>& bbs_in,
 }
 
 
+/**
+ * Widens bounding boxes over time so that, interpolated at any time, they
+ * contain the bounds at that time's nearest time bucket (see
+ * time_bucket()), which is where rays see instances whose transforms are
+ * bucketed.
+ *
+ * Within each interval between time samples the bounds are interpolated
+ * linearly, so for each bucket that rays in the interval can see, the
+ * interpolated bounds are checked against the bucket's bounds at both ends
+ * of the part of the interval that sees it.  Both ends of the interval are
+ * then grown by the most that any of those stick out.  That also covers
+ * motion that reverses between time samples.
+ */
+static inline std::vector<BBox> bucket_bounds(const std::vector<BBox>& bbs, const size_t buckets) {
+	std::vector<BBox> wide_bbs = bbs;
+	if (buckets == 0 || bbs.size() < 2)
+		return wide_bbs;
+
+	const float s = bbs.size() - 1;
+	for (size_t i = 0; i < (bbs.size() - 1); ++i) {
+		const float t0 = i / s;
+		const float t1 = (i + 1) / s;
+
+		Vec3 grow_min(0.0f, 0.0f, 0.0f);
+		Vec3 grow_max(0.0f, 0.0f, 0.0f);
+		for (size_t k = time_bucket(t0, buckets); k <= time_bucket(t1, buckets); ++k) {
+			const BBox bucket_bb = lerp_seq(static_cast<float>(k) / buckets, bbs);
+
+			// The part of the interval that sees bucket k
+			const float ts[2] = {std::max(t0, (k - 0.5f) / buckets), std::min(t1, (k + 0.5f) / buckets)};
+			for (const float t: ts) {
+				const BBox bb = lerp((t - t0) / (t1 - t0), bbs[i], bbs[i + 1]);
+				for (int axis = 0; axis < 3; ++axis) {
+					grow_min[axis] = std::max(grow_min[axis], bb.min[axis] - bucket_bb.min[axis]);
+					grow_max[axis] = std::max(grow_max[axis], bucket_bb.max[axis] - bb.max[axis]);
+				}
+			}
+		}
+
+		for (size_t j = i; j <= (i + 1); ++j) {
+			for (int axis = 0; axis < 3; ++axis) {
+				wide_bbs[j].min[axis] = std::min(wide_bbs[j].min[axis], bbs[j].min[axis] - grow_min[axis]);
+				wide_bbs[j].max[axis] = std::max(wide_bbs[j].max[axis], bbs[j].max[axis] + grow_max[axis]);
+			}
+		}
+	}
+
+	return wide_bbs;
+}
+
+
 #endif // BBOX_HPP
 
@@ -330,3 +330,118 @@ TEST_CASE("bbox4") {
 // TODO: - diagonal rays
 //       - rays with different tmax values
 
+
+
+// The union of the non-empty boxes
+static BBox quantized_test_frame(const BBox4& b) {
+	BBox frame;
+	for (int k = 0; k < 4; ++k) {
+		if (b.bounds[0][k] <= b.bounds[1][k])
+			frame = frame | b.get_bbox(k);
+	}
+	return frame;
+}
+
+template <typename T>
+static bool quantized_encloses(const BBox4& b, const BBox& frame) {
+	const QuantizedBBox4<T> qb(b, frame);
+	const BBox4 d = qb.decode(frame);
+
+	for (int i = 0; i < 6; i += 2) {
+		for (int k = 0; k < 4; ++k) {
+			if (d.bounds[i][k] > b.bounds[i][k] || d.bounds[i+1][k] < b.bounds[i+1][k])
+				return false;
+		}
+	}
+	return true;
+}
+
+TEST_CASE("quantized_bbox4") {
+	SECTION("encloses") {
+		bool all_enclose = true;
+		for (int n = 0; n < 1000; ++n) {
+			BBox bbs[4];
+			for (int k = 0; k < 4; ++k) {
+				const Vec3 p((n * 37 + k * 11) % 101 - 50.3f, (n * 13 + k * 7) % 89 * 0.01f, (n * 71 + k * 3) % 97 * 1000.0f);
+				const Vec3 size(((n + k) % 7) * 0.1f, ((n * k) % 5) * 3.0f, (k % 3) * 0.001f);
+				bbs[k] = BBox(p, p + size);
+			}
+			const BBox4 b(bbs[0], bbs[1], bbs[2], bbs[3]);
+			const BBox frame = quantized_test_frame(b);
+			all_enclose = all_enclose && quantized_encloses<uint8_t>(b, frame) && quantized_encloses<uint16_t>(b, frame);
+		}
+		REQUIRE(all_enclose);
+	}
+
+	SECTION("larger_frame") {
+		// E.g. a frame decoded from a parent's quantized bounds
+		const BBox4 b(BBox(Vec3(1.0, 2.0, 3.0), Vec3(4.0, 5.0, 6.0)), BBox(Vec3(-1.0, 0.0, 3.0), Vec3(0.0, 1.0, 3.0)), BBox(Vec3(0.1, 0.2, 0.3), Vec3(0.4, 0.5, 0.6)), BBox(Vec3(-0.7, 4.9, 5.9), Vec3(3.9, 4.9, 5.9)));
+		const BBox frame(Vec3(-1.0001, -0.3, 0.2), Vec3(4.7, 5.0001, 6.2));
+
+		REQUIRE(quantized_encloses<uint8_t>(b, frame));
+		REQUIRE(quantized_encloses<uint16_t>(b, frame));
+	}
+
+	SECTION("empty_slots") {
+		const BBox4 b(BBox(Vec3(1.0, 2.0, 3.0), Vec3(4.0, 5.0, 6.0)), BBox(Vec3(-1.0, 0.0, 3.0), Vec3(0.0, 1.0, 3.0)), BBox(), BBox());
+		const BBox frame = quantized_test_frame(b);
+
+		REQUIRE(quantized_encloses<uint8_t>(b, frame));
+		REQUIRE(quantized_encloses<uint16_t>(b, frame));
+	}
+
+	SECTION("precision") {
+		const BBox4 b(BBox(Vec3(0.0, 0.0, 0.0), Vec3(256.0, 256.0, 256.0)), BBox(Vec3(10.3, 20.7, 30.1), Vec3(100.2, 120.9, 130.5)), BBox(), BBox());
+		const BBox frame = quantized_test_frame(b);
+		const BBox4 d = QuantizedBBox4<uint8_t>(b, frame).decode(frame);
+
+		// Within one quantization step of the original
+		const float step = 256.0f / 255.0f;
+		for (int i = 0; i < 6; ++i)
+			REQUIRE(std::abs(d.bounds[i][1] - b.bounds[i][1]) <= step);
+	}
+}
+
+
+TEST_CASE("bbox4_intersect_rays") {
+	SECTION("matches_intersect_ray") {
+		// Each ray's result for each box should be the same as when
+		// testing the rays one at a time, including for rays of
+		// differing direction signs
+		const BBox4 bb(BBox(Vec3(-1.0, -2.5, -0.5), Vec3(8.0, 7.25, 2.0)),
+		               BBox(Vec3(20.0, 20.0, 20.0), Vec3(21.0, 21.0, 21.0)),
+		               BBox(Vec3(-3.0, -1.0, -4.0), Vec3(1.0, 1.5, 0.5)),
+		               BBox());
+
+		const Vec3 dirs[4] = {Vec3(0.0, 1.0, 0.0), Vec3(0.25, -1.0, 0.125), Vec3(-0.5, 0.5, 1.0), Vec3(1.0, 1.0, -1.0)};
+		const Vec3 origins[4] = {Vec3(0.125, -8.0, 0.25), Vec3(0.5, 12.0, 0.25), Vec3(3.0, 1.0, -6.0), Vec3(-2.0, -2.0, -2.0)};
+		const float max_ts[4] = {std::numeric_limits<float>::infinity(), 100.0f, 2.0f, std::numeric_limits<float>::infinity()};
+
+		Ray rs[4];
+		for (int i = 0; i < 4; ++i) {
+			rs[i] = Ray(origins[i], dirs[i]);
+			rs[i].finalize();
+			rs[i].max_t = max_ts[i];
+		}
+
+		SIMD::float4 o[3], d_inv[3];
+		for (int c = 0; c < 3; ++c) {
+			o[c] = SIMD::float4(rs[0].o[c], rs[1].o[c], rs[2].o[c], rs[3].o[c]);
+			d_inv[c] = SIMD::float4(rs[0].get_d_inverse()[c], rs[1].get_d_inverse()[c], rs[2].get_d_inverse()[c], rs[3].get_d_inverse()[c]);
+		}
+		const SIMD::float4 max_t(max_ts[0], max_ts[1], max_ts[2], max_ts[3]);
+
+		for (int k = 0; k < 4; ++k) {
+			const unsigned int hits = bb.intersect_rays(k, o, d_inv, max_t);
+			for (int i = 0; i < 4; ++i) {
+				SIMD::float4 hit_ts;
+				const unsigned int hits_one = bb.intersect_ray(rs[i].o, rs[i].get_d_inverse(), rs[i].max_t, &hit_ts);
+				REQUIRE(((hits >> i) & 1) == ((hits_one >> k) & 1));
+			}
+		}
+
+		REQUIRE((bb.intersect_rays(1, o, d_inv, max_t)) == 0);
+		REQUIRE((bb.intersect_rays(3, o, d_inv, max_t)) == 0);
+		REQUIRE((bb.intersect_rays(0, o, d_inv, max_t) & 1) == 1);
+	}
+}
@@ -0,0 +1,133 @@
+#include "test.hpp"
+
+#include <cmath>
+#include <limits>
+#include "vector.hpp"
+#include "ray.hpp"
+#include "bbox.hpp"
+#include "utils.hpp"
+#include "cpu_dispatch.hpp"
+
+
+/*
+ ************************************************************************
+ * Testing suite for BBox8.
+ ************************************************************************
+ */
+
+static void bbox8_test_boxes(BBox* bbs) {
+	for (int k = 0; k < 8; ++k)
+		bbs[k] = BBox(Vec3(-1.0 - k, -2.5 + k, -0.5 - (k * 0.25)), Vec3(8.0 + k, 7.25 + (k * 0.5), 2.0 - (k * 0.125)));
+}
+
+
+TEST_CASE("bbox8") {
+	SECTION("constructor_1") {
+		BBox8 bb;
+
+		bool empty = true;
+		for (int i = 0; i < 6; i += 2) {
+			for (int k = 0; k < 8; ++k) {
+				empty = empty && bb.bounds[i][k] == std::numeric_limits<float>::infinity();
+				empty = empty && bb.bounds[i+1][k] == -std::numeric_limits<float>::infinity();
+			}
+		}
+		REQUIRE(empty);
+	}
+
+	SECTION("constructor_2") {
+		BBox bbs[8];
+		bbox8_test_boxes(bbs);
+		BBox8 bb(bbs);
+
+		bool same = true;
+		for (int k = 0; k < 8; ++k) {
+			for (int axis = 0; axis < 3; ++axis) {
+				same = same && bb.bounds[axis*2][k] == bbs[k].min[axis];
+				same = same && bb.bounds[axis*2+1][k] == bbs[k].max[axis];
+			}
+		}
+		REQUIRE(same);
+	}
+
+	SECTION("lerp") {
+		BBox bbs1[8];
+		BBox bbs2[8];
+		bbox8_test_boxes(bbs1);
+		for (int k = 0; k < 8; ++k)
+			bbs2[k] = BBox(bbs1[k].min * 3.0f, bbs1[k].max * 3.0f);
+		const BBox8 bb = lerp(0.5f, BBox8(bbs1), BBox8(bbs2));
+
+		bool same = true;
+		for (int k = 0; k < 8; ++k) {
+			for (int axis = 0; axis < 3; ++axis) {
+				same = same && bb.bounds[axis*2][k] == bbs1[k].min[axis] * 2.0f;
+				same = same && bb.bounds[axis*2+1][k] == bbs1[k].max[axis] * 2.0f;
+			}
+		}
+		REQUIRE(same);
+	}
+
+	SECTION("intersect_ray_matches_bbox4") {
+		// The results of each of the eight boxes should be the same as
+		// with BBox4
+		BBox bbs[8];
+		bbox8_test_boxes(bbs);
+		bbs[5] = BBox(Vec3(20.0, 20.0, 20.0), Vec3(21.0, 21.0, 21.0)); // Missed
+		bbs[7] = BBox(); // Empty
+		const BBox8 bb8(bbs);
+		const BBox4 bb4a(bbs[0], bbs[1], bbs[2], bbs[3]);
+		const BBox4 bb4b(bbs[4], bbs[5], bbs[6], bbs[7]);
+
+		const Vec3 dirs[3] = {Vec3(0.0, 1.0, 0.0), Vec3(0.25, -1.0, 0.125), Vec3(-0.5, 0.5, 1.0)};
+		const Vec3 origins[3] = {Vec3(0.125, -8.0, 0.25), Vec3(0.5, 12.0, 0.25), Vec3(3.0, 1.0, -6.0)};
+		for (int i = 0; i < 3; ++i) {
+			Ray r(origins[i], dirs[i]);
+			r.finalize();
+
+			SIMD::float8 hit_ts8;
+			SIMD::float4 hit_ts4a, hit_ts4b;
+			const unsigned int hits8 = bb8.intersect_ray(r.o, r.get_d_inverse(), r.max_t, &hit_ts8);
+			const unsigned int hits4 = bb4a.intersect_ray(r.o, r.get_d_inverse(), r.max_t, &hit_ts4a) | (bb4b.intersect_ray(r.o, r.get_d_inverse(), r.max_t, &hit_ts4b) << 4);
+
+			REQUIRE(hits8 == hits4);
+			REQUIRE((hits8 & (1 << 5)) == 0);
+			REQUIRE((hits8 & (1 << 7)) == 0);
+			for (int k = 0; k < 4; ++k) {
+				if (hits8 & (1 << k))
+					REQUIRE(hit_ts8[k] == hit_ts4a[k]);
+				if (hits8 & (1 << (k + 4)))
+					REQUIRE(hit_ts8[k + 4] == hit_ts4b[k]);
+			}
+		}
+	}
+#ifdef CPU_DISPATCH_ENABLED
+	SECTION("intersect_ray_avx2_matches_intersect_ray") {
+		if (CPUDispatch::has_avx2()) {
+			BBox bbs[8];
+			bbox8_test_boxes(bbs);
+			bbs[5] = BBox(Vec3(20.0, 20.0, 20.0), Vec3(21.0, 21.0, 21.0)); // Missed
+			bbs[7] = BBox(); // Empty
+			const BBox8 bb(bbs);
+
+			const Vec3 dirs[3] = {Vec3(0.0, 1.0, 0.0), Vec3(0.25, -1.0, 0.125), Vec3(-0.5, 0.5, 1.0)};
+			const Vec3 origins[3] = {Vec3(0.125, -8.0, 0.25), Vec3(0.5, 12.0, 0.25), Vec3(3.0, 1.0, -6.0)};
+			for (int i = 0; i < 3; ++i) {
+				Ray r(origins[i], dirs[i]);
+				r.finalize();
+
+				SIMD::float8 hit_ts;
+				float hit_ts_avx2[8];
+				const unsigned int hits = bb.intersect_ray(r.o, r.get_d_inverse(), r.max_t, &hit_ts);
+				const unsigned int hits_avx2 = bb.intersect_ray_avx2(r.o, r.get_d_inverse(), r.max_t, hit_ts_avx2);
+
+				REQUIRE(hits == hits_avx2);
+				for (int k = 0; k < 8; ++k) {
+					if (hits & (1 << k))
+						REQUIRE(hit_ts[k] == hit_ts_avx2[k]);
+				}
+			}
+		}
+	}
+#endif
+}
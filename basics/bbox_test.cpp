@@ -205,3 +205,58 @@ TEST_CASE("bbox") {
 
 // TODO: - diagonal rays
 //       - rays with different tmin/tmax value
+
+
+
+// Whether bounds interpolated at every time contain the bounds at that
+// time's nearest time bucket
+static bool bucket_bounds_contain(const std::vector<BBox>& bbs, const size_t buckets) {
+	const std::vector<BBox> wide_bbs = bucket_bounds(bbs, buckets);
+	for (int i = 0; i <= 1000; ++i) {
+		const float time = i / 1000.0f;
+		const BBox wide = lerp_seq(time, wide_bbs);
+		const BBox bucket = lerp_seq(static_cast<float>(time_bucket(time, buckets)) / buckets, bbs);
+		for (int axis = 0; axis < 3; ++axis) {
+			if (wide.min[axis] > (bucket.min[axis] + 0.0001f) || wide.max[axis] < (bucket.max[axis] - 0.0001f))
+				return false;
+		}
+	}
+	return true;
+}
+
+TEST_CASE("bucket_bounds") {
+	SECTION("linear_motion") {
+		const std::vector<BBox> bbs = {BBox(Vec3(0.0, 0.0, 0.0), Vec3(1.0, 1.0, 1.0)), BBox(Vec3(10.0, -2.0, 0.5), Vec3(11.0, -1.0, 1.5))};
+		for (size_t buckets: {1, 2, 4, 7, 16})
+			REQUIRE(bucket_bounds_contain(bbs, buckets));
+	}
+
+	SECTION("reversing_motion") {
+		// Moves out along x and back again
+		const std::vector<BBox> bbs = {BBox(Vec3(-1.0, 0.0, 0.0), Vec3(0.0, 1.0, 1.0)), BBox(Vec3(0.0, 0.0, 0.0), Vec3(1.0, 1.0, 1.0)), BBox(Vec3(-1.0, 0.0, 0.0), Vec3(0.0, 1.0, 1.0))};
+		for (size_t buckets: {1, 2, 3, 4, 5, 8, 16})
+			REQUIRE(bucket_bounds_contain(bbs, buckets));
+
+		// A ray just before t = 0.875 sees the bucket at t = 0.75, where
+		// the box reaches x = 0.5
+		const std::vector<BBox> wide_bbs = bucket_bounds(bbs, 4);
+		REQUIRE(lerp_seq(0.874f, wide_bbs).max.x >= 0.5f);
+	}
+
+	SECTION("zigzag_motion") {
+		std::vector<BBox> bbs;
+		for (int i = 0; i < 5; ++i) {
+			const Vec3 p((i % 2) * 3.0f, (i * i) % 3 - 1.0f, -i * 0.5f);
+			bbs.emplace_back(p, p + Vec3(1.0f, 0.5f + (i % 3), 2.0f));
+		}
+		for (size_t buckets: {1, 2, 3, 4, 5, 6, 9, 32})
+			REQUIRE(bucket_bounds_contain(bbs, buckets));
+	}
+
+	SECTION("no_buckets") {
+		const std::vector<BBox> bbs = {BBox(Vec3(0.0, 0.0, 0.0), Vec3(1.0, 1.0, 1.0)), BBox(Vec3(1.0, 0.0, 0.0), Vec3(2.0, 1.0, 1.0))};
+		const std::vector<BBox> wide_bbs = bucket_bounds(bbs, 0);
+		REQUIRE(wide_bbs[0].max.x == 1.0f);
+		REQUIRE(wide_bbs[1].min.x == 1.0f);
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef HIT_RECORD_HPP
+#define HIT_RECORD_HPP
+
+#include "numtype.h"
+
+#include <limits>
+
+#include "instance_id.hpp"
+
+class Object;
+class SurfaceShader;
+
+
+/**
+ * @brief A compact record of a ray hit, as produced by the Tracer.
+ *
+ * This holds just enough information to reconstruct the full
+ * Intersection later on, which is only done for the final hit of
+ * each ray (see Tracer::resolve()).  The space the hit took place in is
+ * recovered by walking the instance hierarchy along the id.
+ */
+struct HitRecord {
+	// The object that was hit.  For complex surfaces this is the patch
+	// within the surface.
+	const Object* object {nullptr};
+
+	// The shader to shade the hit with, if any
+	const SurfaceShader* shader {nullptr};
+
+	// The GUID of the object instance that was hit
+	InstanceID id;
+
+	float t {std::numeric_limits<float>::infinity()}; // T-parameter along the ray at the hit
+	float u {0.0f}, v {0.0f}; // Surface coordinates of the hit, for patches
+	float offset {0.0f}; // Size of the offset for subsequent spawned rays, for patches
+
+	// Whether there's a hit or not
+	bool hit {false};
+};
+
+#endif // HIT_RECORD_HPP
@@ -18,13 +18,13 @@ struct InstanceID {
 	void push_back(uint64_t sub_id, int bit_length) {
 		assert((pos + bit_length) <= MAX_ID_BITS);
 		id <<= bit_length;
-		id |= sub_id & ((1<<bit_length)-1);
+		id |= sub_id & ((uint64_t(1) << bit_length) - 1);
 		pos += bit_length;
 	}
 
 	uint64_t pop_back(int bit_length) {
 		assert((pos - bit_length) >= 0);
-		const uint64_t value = id & ((1<<bit_length)-1);
+		const uint64_t value = id & ((uint64_t(1) << bit_length) - 1);
 		id >>= bit_length;
 		pos -= bit_length;
 		return value;
@@ -33,7 +33,7 @@ struct InstanceID {
 	uint64_t pop_front(int bit_length) {
 		assert((pos - bit_length) >= 0);
 		const int offset = pos - bit_length;
-		const uint64_t value = (id & (((1<<bit_length)-1) << (offset))) >> offset;
+		const uint64_t value = (id >> offset) & ((uint64_t(1) << bit_length) - 1);
 		pos -= bit_length;
 		return value;
 	}
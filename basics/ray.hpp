@@ -13,10 +13,59 @@
 #include "vector.hpp"
 #include "matrix.hpp"
 #include "transform.hpp"
-#include "bit_stack.hpp"
 #include "config.hpp"
 
 
+/**
+ * @brief An approximation of the width of a ray along its length,
+ * derived from its differentials.
+ */
+struct RayWidth {
+	float owx, owy; // Origin width
+	float dwx, dwy; // Width delta
+	float fwx, fwy; // Width floor
+
+	/*
+	 * Returns the "ray width" at the given distance along the ray.
+	 * The values returned corresponds to roughly the width that a micropolygon
+	 * needs to be for this ray at that distance.  And that is its primary
+	 * purpose as well: determining dicing rates.
+	 */
+	float width(const float t) const {
+		const float x = std::abs((owx - fwx) + (dwx * t)) + fwx;
+		const float y = std::abs((owy - fwy) + (dwy * t)) + fwy;
+		return std::min(x, y);
+	}
+
+	/*
+	 * Returns an estimate of the minimum ray width over a distance
+	 * range along the ray.
+	 */
+	float min_width(const float tnear, const float tfar) const {
+		//return std::min(width(tnear), width(tfar));
+
+		const float tflipx = (owx - fwx) / dwx;
+		const float tflipy = (owy - fwy) / dwy;
+
+		float minx, miny;
+
+		if (tnear < tflipx && tfar > tflipx) {
+			minx = fwx;
+		} else {
+			minx = std::min(std::abs((owx - fwx) + (dwx * tnear)) + fwx, std::abs((owx - fwx) + (dwx * tfar)) + fwx);
+		}
+
+		if (tnear < tflipy && tfar > tflipy) {
+			miny = fwy;
+		} else {
+			miny = std::min(std::abs((owy - fwy) + (dwy * tnear)) + fwy, std::abs((owy - fwy) + (dwy * tfar)) + fwy);
+		}
+
+		return std::min(minx, miny);
+	}
+};
+
+
 /**
  * @brief A ray in 3d space.
  */
@@ -29,11 +78,33 @@ struct Ray {
 	Vec3 d; // Direction
 	float time; // Time coordinate
 	Vec3 d_inv; // 1.0 / d
-	float owx, owy; // Origin width
-	float dwx, dwy; // Width delta
-	float fwx, fwy; // Width floor
+	RayWidth w; // Ray width approximation
 	uint32_t id_and_flags;  // Ray id and flags, packed into a single int.
-	BitStack<uint64_t> trav_stack;  // Bit stack used during BVH traversal
+
+	// Flags packed into the upper bits of id_and_flags
+	enum: uint32_t {
+		VISIBILITY_SHIFT = 28, // Two bits for the visibility class
+		VISIBILITY_BITS = 3u << VISIBILITY_SHIFT,
+		OCCLUSION_FLAG = 1u << 30,
+		DONE_FLAG = 1u << 31,
+		ID_MASK = (~uint32_t {0}) >> 4
+	};
+
+	/**
+	 * @brief Visibility classes of rays, for making instances invisible
+	 * to some kinds of rays.
+	 *
+	 * A visibility mask has bit (1 << class) set for each class of ray
+	 * that can see what it belongs to.
+	 */
+	enum VisibilityClass: uint32_t {
+		CAMERA_VISIBILITY   = 0,
+		DIFFUSE_VISIBILITY  = 1,
+		SPECULAR_VISIBILITY = 2,
+		SHADOW_VISIBILITY   = 3,
+		VISIBILITY_CLASSES  = 4
+	};
+	static constexpr uint8_t VISIBLE_TO_ALL = (1 << VISIBILITY_CLASSES) - 1;
 
 
 	/**
@@ -55,38 +126,48 @@ struct Ray {
 
 	// Access to occlusion flag
 	bool is_occlusion() const {
-		return id_and_flags & (1 << 30);
+		return id_and_flags & OCCLUSION_FLAG;
 	}
 
 	void set_occlusion_true() {
-		id_and_flags |= (1 << 30);
+		id_and_flags |= OCCLUSION_FLAG;
 	}
 
 	void set_occlusion_false() {
-		id_and_flags &= ~(1 << 30);
+		id_and_flags &= ~OCCLUSION_FLAG;
 	}
 
 	// Access to done flag
 	bool is_done() const {
-		return id_and_flags & (1 << 31);
+		return id_and_flags & DONE_FLAG;
+	}
+
+	// Access to visibility class
+	uint32_t visibility_class() const {
+		return (id_and_flags & VISIBILITY_BITS) >> VISIBILITY_SHIFT;
+	}
+
+	void set_visibility_class(uint32_t vis_class) {
+		id_and_flags &= ~VISIBILITY_BITS;
+		id_and_flags |= (vis_class << VISIBILITY_SHIFT) & VISIBILITY_BITS;
 	}
 
 	void set_done_true() {
-		id_and_flags |= (1 << 31);
+		id_and_flags |= DONE_FLAG;
 	}
 
 	void set_done_false() {
-		id_and_flags &= ~(1 << 31);
+		id_and_flags &= ~DONE_FLAG;
 	}
 
 	// Access to ray id
 	uint32_t id() const {
-		return id_and_flags & ((~uint32_t {0}) >> 2);
+		return id_and_flags & ID_MASK;
 	}
 
 	void set_id(uint32_t n) {
-		id_and_flags &= ~((~uint32_t {0}) >> 2);
-		id_and_flags |= n & ((~uint32_t {0}) >> 2);
+		id_and_flags &= ~ID_MASK;
+		id_and_flags |= n & ID_MASK;
 	}
 
 	// Access to inverse direction
@@ -115,14 +196,9 @@ struct Ray {
 
 	/*
 	 * Returns the "ray width" at the given distance along the ray.
-	 * The values returned corresponds to roughly the width that a micropolygon
-	 * needs to be for this ray at that distance.  And that is its primary
-	 * purpose as well: determining dicing rates.
 	 */
 	float width(const float t) const {
-		const float x = std::abs((owx - fwx) + (dwx * t)) + fwx;
-		const float y = std::abs((owy - fwy) + (dwy * t)) + fwy;
-		return std::min(x, y);
+		return w.width(t);
 	}
 
 	/*
@@ -130,26 +206,7 @@ struct Ray {
 	 * range along the ray.
 	 */
 	float min_width(const float tnear, const float tfar) const {
-		//return std::min(width(tnear), width(tfar));
-
-		const float tflipx = (owx - fwx) / dwx;
-		const float tflipy = (owy - fwy) / dwy;
-
-		float minx, miny;
-
-		if (tnear < tflipx && tfar > tflipx) {
-			minx = fwx;
-		} else {
-			minx = std::min(std::abs((owx - fwx) + (dwx * tnear)) + fwx, std::abs((owx - fwx) + (dwx * tfar)) + fwx);
-		}
-
-		if (tnear < tflipy && tfar > tflipy) {
-			miny = fwy;
-		} else {
-			miny = std::min(std::abs((owy - fwy) + (dwy * tnear)) + fwy, std::abs((owy - fwy) + (dwy * tfar)) + fwy);
-		}
-
-		return std::min(minx, miny);
+		return w.min_width(tnear, tfar);
 	}
 
 };
@@ -184,6 +241,25 @@ struct WorldRay {
 	float time;
 	Type type;
 
+	/**
+	 * Returns the visibility class of rays of the given type (see
+	 * Ray::VisibilityClass).
+	 */
+	static Ray::VisibilityClass visibility_class(Type type) {
+		switch (type) {
+			case R_DIFFUSE:
+			case T_DIFFUSE:
+				return Ray::DIFFUSE_VISIBILITY;
+			case R_SPECULAR:
+			case T_SPECULAR:
+				return Ray::SPECULAR_VISIBILITY;
+			case OCCLUSION:
+				return Ray::SHADOW_VISIBILITY;
+			default:
+				return Ray::CAMERA_VISIBILITY;
+		}
+	}
+
 	/**
 	 * Returns a transformed version of the WorldRay.
 	 */
@@ -202,51 +278,63 @@ struct WorldRay {
 	}
 
 	/**
-	 * Modifies a Ray in-place to be consistent with the WorldRay.
+	 * Computes the ray width approximation of a ray with origin o and
+	 * direction d from the given differentials.  The differentials must
+	 * be in the same space as o and d.
 	 */
-	void update_ray(Ray* ray) const {
-		Ray& r = *ray;
-
-		// Origin, direction, and time
-		r.o = o;
-		r.d = d;
+	static RayWidth compute_width(const Vec3& o, const Vec3& d, const Vec3& odx, const Vec3& ody, const Vec3& ddx, const Vec3& ddy) {
+		RayWidth w;
 
 		// Convert differentials into ray width approximation
 
 		// X ray differential turned into a ray
-		const Vec3 orx = r.o + odx;
-		const Vec3 drx = r.d + ddx;
+		const Vec3 orx = o + odx;
+		const Vec3 drx = d + ddx;
 
 		// Y ray differential turned into a ray
-		const Vec3 ory = r.o + ody;
-		const Vec3 dry = r.d + ddy;
+		const Vec3 ory = o + ody;
+		const Vec3 dry = d + ddy;
 
 		// Find t where dx and dy are smallest, respectively.
 		float tdx, lx;
 		float tdy, ly;
-		std::tie(tdx, lx) = closest_ray_t2(r.o, r.d, orx, drx);
-		std::tie(tdy, ly) = closest_ray_t2(r.o, r.d, ory, dry);
+		std::tie(tdx, lx) = closest_ray_t2(o, d, orx, drx);
+		std::tie(tdy, ly) = closest_ray_t2(o, d, ory, dry);
 
 		// Set x widths
-		r.owx = odx.length();
+		w.owx = odx.length();
 		if (tdx <= 0.0f) {
-			r.dwx = ddx.length();
-			r.fwx = 0.0f;
+			w.dwx = ddx.length();
+			w.fwx = 0.0f;
 		} else {
-			r.dwx = (lx - r.owx) / tdx;
-			r.fwx = lx;
+			w.dwx = (lx - w.owx) / tdx;
+			w.fwx = lx;
 		}
 
 		// Set y widths
-		r.owy = ody.length();
+		w.owy = ody.length();
 		if (tdy <= 0.0f) {
-			r.dwy = ddy.length();
-			r.fwy = 0.0f;
+			w.dwy = ddy.length();
+			w.fwy = 0.0f;
 		} else {
-			r.dwy = (ly - r.owy) / tdy;
-			r.fwy = ly;
+			w.dwy = (ly - w.owy) / tdy;
+			w.fwy = ly;
 		}
 
+		return w;
+	}
+
+	/**
+	 * Modifies a Ray in-place to be consistent with the WorldRay.
+	 */
+	void update_ray(Ray* ray) const {
+		Ray& r = *ray;
+
+		// Origin, direction, and width
+		r.o = o;
+		r.d = d;
+		r.w = compute_width(r.o, r.d, odx, ody, ddx, ddy);
+
 		// Finalize ray
 		r.finalize();
 	}
@@ -254,51 +342,10 @@ struct WorldRay {
 	void update_ray(Ray* ray, const Transform& t) const {
 		Ray& r = *ray;
 
-		// Origin, direction, and time
+		// Origin, direction, and width
 		r.o = t.pos_to(o);
 		r.d = t.dir_to(d);
-
-		// Transformed ray differentials
-		const Vec3 todx = t.dir_to(odx);
-		const Vec3 tody = t.dir_to(ody);
-		const Vec3 tddx = t.dir_to(ddx);
-		const Vec3 tddy = t.dir_to(ddy);
-
-		// Convert differentials into ray width approximation
-
-		// X ray differential turned into a ray
-		const Vec3 orx = r.o + todx;
-		const Vec3 drx = r.d + tddx;
-
-		// Y ray differential turned into a ray
-		const Vec3 ory = r.o + tody;
-		const Vec3 dry = r.d + tddy;
-
-		// Find t where dx and dy are smallest, respectively.
-		float tdx, lx;
-		float tdy, ly;
-		std::tie(tdx, lx) = closest_ray_t2(r.o, r.d, orx, drx);
-		std::tie(tdy, ly) = closest_ray_t2(r.o, r.d, ory, dry);
-
-		// Set x widths
-		r.owx = todx.length();
-		if (tdx <= 0.0f) {
-			r.dwx = tddx.length();
-			r.fwx = 0.0f;
-		} else {
-			r.dwx = (lx - r.owx) / tdx;
-			r.fwx = lx;
-		}
-
-		// Set y widths
-		r.owy = tody.length();
-		if (tdy <= 0.0f) {
-			r.dwy = tddy.length();
-			r.fwy = 0.0f;
-		} else {
-			r.dwy = (ly - r.owy) / tdy;
-			r.fwy = ly;
-		}
+		r.w = compute_width(r.o, r.d, t.dir_to(odx), t.dir_to(ody), t.dir_to(ddx), t.dir_to(ddy));
 
 		// Finalize ray
 		r.finalize();
@@ -313,6 +360,7 @@ struct WorldRay {
 		r.time = time;
 
 		// Ray type
+		r.set_visibility_class(visibility_class(type));
 		if (type == OCCLUSION) {
 			r.max_t = 1.0f;
 			r.set_occlusion_true();
@@ -328,6 +376,7 @@ struct WorldRay {
 		r.time = time;
 
 		// Ray type
+		r.set_visibility_class(visibility_class(type));
 		if (type == OCCLUSION) {
 			r.max_t = 1.0f;
 			r.set_occlusion_true();
@@ -0,0 +1,388 @@
+#ifndef RAY_STREAM_HPP
+#define RAY_STREAM_HPP
+
+#include <vector>
+#include <utility>
+#include <limits>
+#include <assert.h>
+
+#include "numtype.h"
+
+#include "vector.hpp"
+#include "transform.hpp"
+#include "simd.hpp"
+#include "bit_stack.hpp"
+#include "ray.hpp"
+
+
+/**
+ * @brief A structure-of-arrays stream of rays, for tracing many rays at once.
+ *
+ * The data is split into two groups:
+ *
+ * The hot data (origin, inverse direction, max_t, time, id/flags, and the
+ * traversal bit stack) is what gets touched for every ray at every bounding
+ * box test.  It is indexed by a ray's current position in the stream, and
+ * partition() moves it around to group rays during traversal.
+ *
+ * The cold data (direction and ray width) is only needed when testing against
+ * actual geometry.  It is indexed by ray id and never moves, so partitioning
+ * doesn't pay for it.
+ *
+ * Ray widths are only needed for dicing, so they aren't computed when rays
+ * are initialized or moved between spaces.  Instead they are marked as out
+ * of date, and computed on demand with update_width().
+ *
+ * Optionally, the stream can instead partition a separate array of 32-bit
+ * ray indices, leaving all of the ray data in place (see set_indexed()).
+ * That moves 4 bytes per ray per partition instead of the full hot data, at
+ * the cost of an extra indirection on access.  Either way, code using the
+ * stream works in terms of positions, and maps positions to the storage
+ * slot of the hot data with slot().
+ */
+class RayStream {
+public:
+	// Hot data, indexed by slot (see slot())
+	std::vector<Vec3> o; // Origin
+	std::vector<Vec3> d_inv; // 1.0 / d
+	std::vector<float> max_t; // Maximum extent along the ray
+	std::vector<float> time; // Time coordinate
+	std::vector<uint32_t> id_and_flags; // Ray id and flags, packed the same as in Ray
+	std::vector<BitStack<uint64_t>> trav_stack; // Bit stack used during BVH traversal, shared by the traversals of nested assemblies
+
+	// Cold data, indexed by ray id
+	std::vector<Vec3> d; // Direction
+	std::vector<RayWidth> w; // Ray width approximation, only valid if has_w is set
+	std::vector<uint8_t> has_w; // Whether w is up to date with the ray's current space
+
+private:
+	bool indexed = false;
+	std::vector<uint32_t> index; // Position -> slot, when indexed
+
+public:
+	// The number of bits in each ray's traversal stack
+	static constexpr int TRAV_STACK_BITS = sizeof(uint64_t) * 8;
+
+	size_t size() const {
+		return o.size();
+	}
+
+	void resize(size_t n) {
+		o.resize(n);
+		d_inv.resize(n);
+		max_t.resize(n);
+		time.resize(n);
+		id_and_flags.resize(n);
+		trav_stack.resize(n);
+		d.resize(n);
+		w.resize(n);
+		has_w.resize(n);
+		if (indexed)
+			index.resize(n);
+	}
+
+	/**
+	 * Sets whether partition() moves the hot ray data itself (false,
+	 * the default) or only an array of ray indices (true).
+	 *
+	 * Should only be called before the rays are initialized.
+	 */
+	void set_indexed(bool use_indices) {
+		indexed = use_indices;
+		index.resize(indexed ? size() : 0);
+	}
+
+	bool is_indexed() const {
+		return indexed;
+	}
+
+	/**
+	 * Returns the storage slot of the hot data for the ray at position i.
+	 */
+	size_t slot(size_t i) const {
+		return indexed ? index[i] : i;
+	}
+
+	// Access to occlusion flag
+	bool is_occlusion(size_t i) const {
+		return id_and_flags[slot(i)] & Ray::OCCLUSION_FLAG;
+	}
+
+	// Access to done flag
+	bool is_done(size_t i) const {
+		return id_and_flags[slot(i)] & Ray::DONE_FLAG;
+	}
+
+	void set_done_true(size_t i) {
+		id_and_flags[slot(i)] |= Ray::DONE_FLAG;
+	}
+
+	// Access to ray id
+	uint32_t id(size_t i) const {
+		return id_and_flags[slot(i)] & Ray::ID_MASK;
+	}
+
+	// Access to visibility class (see Ray::VisibilityClass)
+	uint32_t visibility_class(size_t i) const {
+		return (id_and_flags[slot(i)] & Ray::VISIBILITY_BITS) >> Ray::VISIBILITY_SHIFT;
+	}
+
+
+	/**
+	 * Initializes the ray at position i from a WorldRay, giving it
+	 * id i.
+	 */
+	void init_ray(size_t i, const WorldRay& wray) {
+		init_ray(i, wray, wray.type == WorldRay::OCCLUSION);
+	}
+
+	/**
+	 * Initializes the ray at position i from a WorldRay, giving it
+	 * id i.  The ray is an occlusion ray, and sees what shadow rays
+	 * see, regardless of the WorldRay's type.
+	 */
+	void init_occlusion_ray(size_t i, const WorldRay& wray) {
+		init_ray(i, wray, true);
+	}
+
+	// Whether the width of the ray at position i is up to date
+	bool has_width(size_t i) const {
+		return has_w[id(i)];
+	}
+
+	/**
+	 * Modifies the ray at position i in-place to be consistent with
+	 * the given WorldRay.
+	 *
+	 * The ray's width is marked out of date.
+	 */
+	void update_ray(size_t i, const WorldRay& wray) {
+		const size_t s = slot(i);
+		const uint32_t ray_id = id_and_flags[s] & Ray::ID_MASK;
+
+		o[s] = wray.o;
+		d[ray_id] = wray.d;
+		has_w[ray_id] = false;
+
+		assert(d[ray_id].length() > 0.0f);
+		d_inv[s] = Vec3(1.0f, 1.0f, 1.0f) / d[ray_id];
+	}
+
+	/**
+	 * Modifies the ray at position i in-place to be consistent with
+	 * the given WorldRay transformed by t.
+	 *
+	 * The ray's width is marked out of date.
+	 */
+	void update_ray(size_t i, const WorldRay& wray, const Transform& t) {
+		const size_t s = slot(i);
+		const uint32_t ray_id = id_and_flags[s] & Ray::ID_MASK;
+
+		o[s] = t.pos_to(wray.o);
+		d[ray_id] = t.dir_to(wray.d);
+		has_w[ray_id] = false;
+
+		assert(d[ray_id].length() > 0.0f);
+		d_inv[s] = Vec3(1.0f, 1.0f, 1.0f) / d[ray_id];
+	}
+
+	/**
+	 * Computes the width of the ray at position i from the given
+	 * WorldRay's differentials.  The ray must already be up to date with
+	 * the WorldRay, via update_ray().
+	 */
+	void update_width(size_t i, const WorldRay& wray) {
+		const size_t s = slot(i);
+		const uint32_t ray_id = id_and_flags[s] & Ray::ID_MASK;
+
+		w[ray_id] = WorldRay::compute_width(o[s], d[ray_id], wray.odx, wray.ody, wray.ddx, wray.ddy);
+		has_w[ray_id] = true;
+	}
+
+	/**
+	 * Computes the width of the ray at position i from the given
+	 * WorldRay's differentials transformed by t.  The ray must already be
+	 * up to date with the WorldRay and t, via update_ray().
+	 */
+	void update_width(size_t i, const WorldRay& wray, const Transform& t) {
+		const size_t s = slot(i);
+		const uint32_t ray_id = id_and_flags[s] & Ray::ID_MASK;
+
+		w[ray_id] = WorldRay::compute_width(o[s], d[ray_id], t.dir_to(wray.odx), t.dir_to(wray.ody), t.dir_to(wray.ddx), t.dir_to(wray.ddy));
+		has_w[ray_id] = true;
+	}
+
+	/**
+	 * Does the same as update_ray() for all rays at positions [begin, end),
+	 * with a transform shared by all of them.
+	 *
+	 * The rays are transformed four at a time with SSE, which gives
+	 * identical results to calling update_ray() on each of them.
+	 *
+	 * w_rays is indexed by ray id.
+	 */
+	void update_rays(size_t begin, size_t end, const WorldRay* w_rays, const Transform& t) {
+		size_t i = begin;
+		for (; (i + 4) <= end; i += 4) {
+			size_t s[4];
+			uint32_t ray_id[4];
+			const WorldRay* wr[4];
+			for (int k = 0; k < 4; ++k) {
+				s[k] = slot(i + k);
+				ray_id[k] = id_and_flags[s[k]] & Ray::ID_MASK;
+				wr[k] = &w_rays[ray_id[k]];
+			}
+
+			// Transpose the world rays' origins and directions into SoA
+			// form and transform them
+			SIMD::float4 wo[3], wd[3];
+			for (int c = 0; c < 3; ++c) {
+				wo[c] = SIMD::float4(wr[0]->o[c], wr[1]->o[c], wr[2]->o[c], wr[3]->o[c]);
+				wd[c] = SIMD::float4(wr[0]->d[c], wr[1]->d[c], wr[2]->d[c], wr[3]->d[c]);
+			}
+			SIMD::float4 to[3], td[3];
+			t.pos_to_4(wo, to);
+			t.dir_to_4(wd, td);
+
+			const SIMD::float4 one(1.0f);
+			const SIMD::float4 inv[3] = {one / td[0], one / td[1], one / td[2]};
+
+			// Store the results
+			for (int k = 0; k < 4; ++k) {
+				o[s[k]] = Vec3(to[0][k], to[1][k], to[2][k]);
+				d[ray_id[k]] = Vec3(td[0][k], td[1][k], td[2][k]);
+				has_w[ray_id[k]] = false;
+
+				assert(d[ray_id[k]].length() > 0.0f);
+				d_inv[s[k]] = Vec3(inv[0][k], inv[1][k], inv[2][k]);
+			}
+		}
+
+		// Remaining rays
+		for (; i < end; ++i)
+			update_ray(i, w_rays[id(i)], t);
+	}
+
+
+	/**
+	 * Gathers the ray at position i into a stand-alone Ray, for
+	 * code that tests one ray at a time.
+	 *
+	 * The width of the gathered ray is only meaningful if has_width().
+	 */
+	Ray gather(size_t i) const {
+		const size_t s = slot(i);
+		const uint32_t ray_id = id_and_flags[s] & Ray::ID_MASK;
+
+		Ray r(o[s], d[ray_id], time[s]);
+		r.max_t = max_t[s];
+		r.d_inv = d_inv[s];
+		r.w = w[ray_id];
+		r.id_and_flags = id_and_flags[s];
+
+		return r;
+	}
+
+	/**
+	 * Swaps the rays at positions i and j.
+	 */
+	void swap(size_t i, size_t j) {
+		if (indexed) {
+			std::swap(index[i], index[j]);
+			return;
+		}
+
+		std::swap(o[i], o[j]);
+		std::swap(d_inv[i], d_inv[j]);
+		std::swap(max_t[i], max_t[j]);
+		std::swap(time[i], time[j]);
+		std::swap(id_and_flags[i], id_and_flags[j]);
+		std::swap(trav_stack[i], trav_stack[j]);
+	}
+
+	/**
+	 * Reorders the rays in the stream so that the ray at position i
+	 * afterwards is the ray that was at position order[i] before.
+	 *
+	 * order must be a permutation of [0, size()).
+	 */
+	void permute(const std::vector<uint32_t>& order) {
+		assert(order.size() == size());
+
+		if (indexed) {
+			permute_array(&index, order);
+			return;
+		}
+
+		permute_array(&o, order);
+		permute_array(&d_inv, order);
+		permute_array(&max_t, order);
+		permute_array(&time, order);
+		permute_array(&id_and_flags, order);
+		permute_array(&trav_stack, order);
+	}
+
+	/**
+	 * Partitions the rays in [begin, end) so that the rays for which
+	 * pred(i) returns true come first.  pred is called exactly once for
+	 * each ray, with the ray's position in the stream at the time of
+	 * the call, so it may safely modify the ray's data.
+	 *
+	 * Returns the position of the first ray of the second group.
+	 *
+	 * This follows the same algorithm as mutable_partition() in utils.hpp.
+	 */
+	template <typename Predicate>
+	size_t partition(size_t begin, size_t end, Predicate pred) {
+		while (true) {
+			while (true) {
+				if (begin == end)
+					return begin;
+				if (!pred(begin))
+					break;
+				++begin;
+			}
+
+			do {
+				if (begin == --end)
+					return begin;
+			} while (!pred(end));
+
+			swap(begin, end);
+
+			++begin;
+		}
+	}
+
+private:
+	void init_ray(size_t i, const WorldRay& wray, bool occlusion) {
+		if (indexed)
+			index[i] = i;
+
+		time[i] = wray.time;
+		trav_stack[i] = BitStack<uint64_t>();
+		id_and_flags[i] = i & Ray::ID_MASK;
+
+		// Ray type
+		if (occlusion) {
+			max_t[i] = 1.0f;
+			id_and_flags[i] |= Ray::OCCLUSION_FLAG | (Ray::SHADOW_VISIBILITY << Ray::VISIBILITY_SHIFT);
+		} else {
+			id_and_flags[i] |= WorldRay::visibility_class(wray.type) << Ray::VISIBILITY_SHIFT;
+			max_t[i] = std::numeric_limits<float>::infinity();
+		}
+
+		update_ray(i, wray);
+	}
+
+	template <typename T>
+	static void permute_array(std::vector<T>* array, const std::vector<uint32_t>& order) {
+		std::vector<T> tmp;
+		tmp.reserve(array->size());
+		for (const auto i: order)
+			tmp.push_back((*array)[i]);
+		array->swap(tmp);
+	}
+};
+
+#endif // RAY_STREAM_HPP
@@ -0,0 +1,194 @@
+#include "test.hpp"
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "vector.hpp"
+#include "ray.hpp"
+#include "ray_stream.hpp"
+
+
+/*
+ ************************************************************************
+ * Testing suite for RayStream.
+ ************************************************************************
+ */
+
+static WorldRay make_world_ray(float x, WorldRay::Type type) {
+	WorldRay wr;
+	wr.o = Vec3(x, 1.0f, 2.0f);
+	wr.d = Vec3(1.0f, x + 1.0f, 4.0f);
+	wr.odx = Vec3(0.0f, 0.0f, 0.0f);
+	wr.ody = Vec3(0.0f, 0.0f, 0.0f);
+	wr.ddx = Vec3(0.01f, 0.0f, 0.0f);
+	wr.ddy = Vec3(0.0f, 0.01f, 0.0f);
+	wr.time = x * 0.1f;
+	wr.type = type;
+	return wr;
+}
+
+TEST_CASE("ray_stream") {
+	SECTION("init_ray") {
+		RayStream rays;
+		rays.resize(2);
+		rays.init_ray(0, make_world_ray(1.0f, WorldRay::CAMERA));
+		rays.init_ray(1, make_world_ray(2.0f, WorldRay::OCCLUSION));
+
+		REQUIRE(rays.id(0) == 0);
+		REQUIRE(rays.id(1) == 1);
+		REQUIRE(!rays.is_occlusion(0));
+		REQUIRE(rays.is_occlusion(1));
+		REQUIRE(rays.visibility_class(0) == Ray::CAMERA_VISIBILITY);
+		REQUIRE(rays.visibility_class(1) == Ray::SHADOW_VISIBILITY);
+		REQUIRE(!rays.is_done(0));
+		REQUIRE(rays.max_t[0] == std::numeric_limits<float>::infinity());
+		REQUIRE(rays.max_t[1] == 1.0f);
+		REQUIRE(rays.o[1] == Vec3(2.0f, 1.0f, 2.0f));
+		REQUIRE(rays.d[1] == Vec3(1.0f, 3.0f, 4.0f));
+		REQUIRE(rays.d_inv[1] == Vec3(1.0f, 1.0f / 3.0f, 0.25f));
+		REQUIRE(rays.time[1] == 0.2f);
+	}
+
+	SECTION("matches_world_ray_to_ray") {
+		const WorldRay wr = make_world_ray(1.0f, WorldRay::CAMERA);
+		const Ray r = wr.to_ray();
+
+		RayStream rays;
+		rays.resize(1);
+		rays.init_ray(0, wr);
+		REQUIRE(!rays.has_width(0));
+		rays.update_width(0, wr);
+		REQUIRE(rays.has_width(0));
+		const Ray g = rays.gather(0);
+
+		REQUIRE(g.o == r.o);
+		REQUIRE(g.d == r.d);
+		REQUIRE(g.d_inv == r.d_inv);
+		REQUIRE(g.time == r.time);
+		REQUIRE(g.max_t == r.max_t);
+		REQUIRE(g.width(0.5f) == r.width(0.5f));
+		REQUIRE(g.min_width(0.5f, 4.0f) == r.min_width(0.5f, 4.0f));
+	}
+
+	SECTION("partition") {
+		RayStream rays;
+		rays.resize(8);
+		for (int i = 0; i < 8; ++i) {
+			rays.init_ray(i, make_world_ray(i, WorldRay::CAMERA));
+		}
+
+		// Put the odd ids first
+		size_t calls = 0;
+		const size_t split = rays.partition(0, 8, [&](size_t i) {
+			++calls;
+			return (rays.id(i) % 2) == 1;
+		});
+
+		REQUIRE(split == 4);
+		REQUIRE(calls == 8);
+		for (size_t i = 0; i < 8; ++i) {
+			const uint32_t id = rays.id(i);
+			REQUIRE(((id % 2) == 1) == (i < split));
+
+			// Hot data moves with the ray
+			REQUIRE(rays.o[i] == Vec3(id, 1.0f, 2.0f));
+			REQUIRE(rays.time[i] == id * 0.1f);
+
+			// Cold data stays put, indexed by id
+			REQUIRE(rays.d[i] == Vec3(1.0f, i + 1.0f, 4.0f));
+		}
+	}
+
+	SECTION("partition_indexed") {
+		RayStream rays;
+		rays.set_indexed(true);
+		rays.resize(8);
+		for (int i = 0; i < 8; ++i) {
+			rays.init_ray(i, make_world_ray(i, WorldRay::CAMERA));
+		}
+
+		const size_t split = rays.partition(0, 8, [&](size_t i) {
+			return (rays.id(i) % 2) == 1;
+		});
+
+		REQUIRE(split == 4);
+		for (size_t i = 0; i < 8; ++i) {
+			const uint32_t id = rays.id(i);
+			REQUIRE(((id % 2) == 1) == (i < split));
+			REQUIRE(rays.slot(i) == id);
+
+			// The ray data itself stays put
+			REQUIRE(rays.o[i] == Vec3(i, 1.0f, 2.0f));
+			REQUIRE(rays.gather(i).o == Vec3(id, 1.0f, 2.0f));
+		}
+	}
+
+	SECTION("update_ray_transformed") {
+		const WorldRay wr = make_world_ray(1.0f, WorldRay::CAMERA);
+		Transform t;
+		t.to[3][0] = 5.0f; // Translate by 5 in x
+
+		RayStream rays;
+		rays.resize(1);
+		rays.init_ray(0, wr);
+		rays.update_width(0, wr);
+		rays.update_ray(0, wr, t);
+		REQUIRE(!rays.has_width(0));
+		rays.update_width(0, wr, t);
+
+		const Ray r = wr.to_ray(t);
+
+		REQUIRE(rays.o[0] == r.o);
+		REQUIRE(rays.d[0] == r.d);
+		REQUIRE(rays.d_inv[0] == r.d_inv);
+		REQUIRE(rays.w[0].min_width(0.5f, 4.0f) == r.min_width(0.5f, 4.0f));
+	}
+
+	SECTION("update_rays_batched") {
+		Transform t;
+		t.to[0][0] = 0.8f;
+		t.to[0][1] = 0.6f;
+		t.to[1][0] = -0.6f;
+		t.to[1][1] = 0.8f;
+		t.to[2][2] = 1.5f;
+		t.to[3][0] = 5.0f;
+		t.to[3][2] = -2.0f;
+
+		// Enough rays for a couple of batches plus a remainder
+		std::vector<WorldRay> w_rays;
+		for (int i = 0; i < 11; ++i)
+			w_rays.push_back(make_world_ray(i * 0.7f, WorldRay::CAMERA));
+
+		RayStream batched;
+		batched.set_indexed(true);
+		batched.resize(11);
+		RayStream single;
+		single.resize(11);
+		for (int i = 0; i < 11; ++i) {
+			batched.init_ray(i, w_rays[i]);
+			single.init_ray(i, w_rays[i]);
+		}
+
+		// Shuffle the batched stream's positions a bit
+		batched.partition(0, 11, [&](size_t i) {
+			return (batched.id(i) % 3) == 0;
+		});
+
+		batched.update_rays(0, 11, &w_rays[0], t);
+		for (size_t i = 0; i < 11; ++i) {
+			REQUIRE(!batched.has_width(i));
+			batched.update_width(i, w_rays[batched.id(i)], t);
+			single.update_ray(i, w_rays[i], t);
+			single.update_width(i, w_rays[i], t);
+		}
+
+		for (size_t i = 0; i < 11; ++i) {
+			const Ray a = batched.gather(i);
+			const Ray b = single.gather(a.id());
+			REQUIRE(a.o == b.o);
+			REQUIRE(a.d == b.d);
+			REQUIRE(a.d_inv == b.d_inv);
+			REQUIRE(a.width(2.0f) == b.width(2.0f));
+		}
+	}
+}
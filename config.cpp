@@ -12,4 +12,19 @@ float grid_cache_size = 64.0; // In MB
 int samples_per_bucket = 1 << 16; // The number of samples to aim to take per-bucket (used in auto-sizing buckets)
 
 float displace_distance = 0.00f;
+
+bool ray_index_partition = false; // Partition ray indices instead of the ray data itself during traversal
+int ray_reorder_mode = 1; // How to reorder rays before tracing, see RayReorder::Mode
+bool trace_pool = true; // Share the work of each trace with a pool of helper threads
+size_t trace_task_size = 1 << 14; // Max rays per task when splitting a trace across threads, zero means only split by octant
+size_t transform_time_buckets = 0; // Time buckets to pre-interpolate motion blurred instance transforms at, so rays can share them, zero means interpolate exactly per ray
+size_t build_threads = 1; // Max threads to use for building acceleration structures
+int bvh_bounds_bits = 32; // Precision of BVH4 node bounds: 32 (full), 16, or 8 bits, lower saves memory
+int bvh_width = 4; // Width of the BVHs of assemblies that don't specify one: 4 or 8
+size_t ray_parallel_min = 64; // Min rays at a BVH4 node to test them four at a time against each child instead of one at a time against all children, zero means never
+size_t single_ray_max = 4; // Max rays at a BVH4 node to finish traversing its subtree one ray at a time, zero means never
+int bvh_time_segments = 1; // Number of time segments to build separate BVH4 trees for in motion blurred assemblies, 1 to 8
+float bvh_split_budget = 0.0f; // Max extra references to split large static instances into in BVH4s, as a fraction of the instance count, zero means never
+float refit_threshold = 0.0f; // Max growth of a refit acceleration structure's SAH cost over its built cost before rebuilding it instead, zero means never refit
+std::string accel_cache_dir = ""; // Directory to cache acceleration structures and refined subdivision surfaces in across renders, empty means no caching
 }
@@ -1,6 +1,8 @@
 #ifndef CONFIG_HPP
 #define CONFIG_HPP
 
+#include <string>
+
 #include "numtype.h"
 
 namespace Config {
@@ -13,6 +15,21 @@ extern float grid_cache_size;
 extern int samples_per_bucket;
 
 extern float displace_distance;
+
+extern bool ray_index_partition;
+extern int ray_reorder_mode;
+extern bool trace_pool;
+extern size_t trace_task_size;
+extern size_t transform_time_buckets;
+extern size_t build_threads;
+extern int bvh_bounds_bits;
+extern int bvh_width;
+extern size_t ray_parallel_min;
+extern size_t single_ray_max;
+extern int bvh_time_segments;
+extern float bvh_split_budget;
+extern float refit_threshold;
+extern std::string accel_cache_dir;
 }
 
 #endif
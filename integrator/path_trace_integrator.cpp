@@ -5,6 +5,8 @@
 #include <assert.h>
 #include <cmath>
 #include <vector>
+#include <memory>
+#include <algorithm>
 
 #include "utils.hpp"
 #include "monte_carlo.hpp"
@@ -15,6 +17,7 @@
 #include "tracer.hpp"
 #include "mis.hpp"
 #include "config.hpp"
+#include "cpu_dispatch.hpp"
 
 #include "surface_closure.hpp"
 
@@ -35,6 +38,19 @@ void PathTraceIntegrator::integrate() {
 
 	total_items = std::ceil(float(image->width) / bucket_size) * std::ceil(float(image->height) / bucket_size);
 
+	// Set up the trace pool.  Each trace is split into tasks that idle
+	// threads can pick up, which keeps all the cores busy once there are
+	// fewer buckets left than render threads.  The pool has no threads of
+	// its own: render threads that run out of buckets help the others
+	// instead, so there are never more runnable threads than render
+	// threads.
+	std::unique_ptr<JobQueue<>> pool;
+	if (Config::trace_pool && thread_count > 1) {
+		pool.reset(new JobQueue<>(0, thread_count * 8));
+		trace_pool = pool.get();
+	}
+	rendering_threads = thread_count;
+
 	// Start the rendering threads
 	std::vector<std::thread> threads(thread_count);
 	for (auto& t: threads) {
@@ -80,6 +96,7 @@ void PathTraceIntegrator::integrate() {
 	for (auto& t: threads) {
 		t.join();
 	}
+	trace_pool = nullptr;
 
 	std::cout << std::flush;
 }
@@ -103,7 +120,7 @@ void PathTraceIntegrator::init_path(PTState* pstate, Sampler s, short x, short y
 /*
  * Calculate the next ray the path needs to shoot.
  */
-WorldRay PathTraceIntegrator::next_ray_for_path(const WorldRay& prev_ray, PTState* pstate) {
+CPU_DISPATCH WorldRay PathTraceIntegrator::next_ray_for_path(const WorldRay& prev_ray, PTState* pstate) {
 	PTState& path = *pstate; // Shorthand for the passed path
 	WorldRay ray;
 
@@ -203,7 +220,14 @@ WorldRay PathTraceIntegrator::next_ray_for_path(const WorldRay& prev_ray, PTStat
 		ray.o = geo.p + pos_offset;
 		ray.d = out;
 		ray.time = path.time;
-		ray.type = WorldRay::R_DIFFUSE;
+
+		// Ray type, by whether the bounce is specular, and whether it
+		// continues through the surface (transmission) or back from it
+		const bool transmitted = (dot(out, geo.n) > 0.0f) == (dot(path.prev_ray.d, geo.n) > 0.0f);
+		if (bsdf->is_delta())
+			ray.type = transmitted ? WorldRay::T_SPECULAR : WorldRay::R_SPECULAR;
+		else
+			ray.type = transmitted ? WorldRay::T_DIFFUSE : WorldRay::R_DIFFUSE;
 
 		// Propagate ray differentials
 		bsdf->propagate_differentials(path.inter.t, path.prev_ray, geo, &ray);
@@ -229,48 +253,72 @@ WorldRay PathTraceIntegrator::next_ray_for_path(const WorldRay& prev_ray, PTStat
 /*
  * Update the path based on the result of a ray shot
  */
-void PathTraceIntegrator::update_path(PTState* pstate, const WorldRay& ray, const Intersection& inter) {
+CPU_DISPATCH void PathTraceIntegrator::update_path(PTState* pstate, const WorldRay& ray, const HitRecord& hit) {
 	PTState& path = *pstate; // Shorthand for the passed path
 
 	if (path.step % 2) {
 		// Result of shadow ray
-		if (!inter.hit) {
-			// Sample was lit
-			SurfaceClosure* bsdf = path.inter.surface_closure.get();
-
-			if (!bsdf->is_delta()) {
-				const DifferentialGeometry geo = path.inter.geo.transformed_from(path.inter.space);
+		update_path_occlusion(pstate, ray, hit.hit);
+		return;
+	}
 
-				SpectralSample fac = bsdf->evaluate(path.prev_ray.d, ray.d, geo, path.wavelength);
+	// Result of bounce or camera ray.  The tracer has already filled in
+	// the path's intersection data if the ray hit something.
+	const Intersection& inter = path.inter;
+	if (hit.hit) {
+		// Ray hit something!
+		if (auto emit_closure = dynamic_cast<const EmitClosure*>(inter.surface_closure.get())) {
+			// Hit emitting surface, handle specially
+			path.done = true;
 
-				path.col += path.fcol * path.lcol * fac;
-			}
-		}
-	} else {
-		// Result of bounce or camera ray
-		if (inter.hit) {
-			// Ray hit something!
-			if (auto emit_closure = dynamic_cast<const EmitClosure*>(inter.surface_closure.get())) {
-				// Hit emitting surface, handle specially
-				path.done = true;
-
-				if (path.last_pdf != 0.0f) {
-					const float mis_inv_pdf = power_heuristic(path.last_pdf, inter.light_pdf) / path.last_pdf;
-					path.col += (path.fcol * path.last_pdf) * emit_closure->emitted_color(path.wavelength) * mis_inv_pdf;
-				} else {
-					path.col += path.fcol * emit_closure->emitted_color(path.wavelength);
-				}
+			if (path.last_pdf != 0.0f) {
+				const float mis_inv_pdf = power_heuristic(path.last_pdf, inter.light_pdf) / path.last_pdf;
+				path.col += (path.fcol * path.last_pdf) * emit_closure->emitted_color(path.wavelength) * mis_inv_pdf;
 			} else {
-				path.inter = inter; // Store intersection data for creating shadow ray
-				path.prev_ray = ray;  // Store incoming ray direction for use in shading calculations
+				path.col += path.fcol * emit_closure->emitted_color(path.wavelength);
 			}
 		} else {
-			// Ray didn't hit anything
-			path.done = true;
-			path.col += path.fcol * Color_to_SpectralSample(scene->background_color, path.wavelength);
+			path.prev_ray = ray;  // Store incoming ray direction for use in shading calculations
+		}
+	} else {
+		// Ray didn't hit anything
+		path.done = true;
+		path.col += path.fcol * Color_to_SpectralSample(scene->background_color, path.wavelength);
+	}
+
+	advance_path(pstate);
+}
+
+
+/*
+ * Update the path based on the result of a shadow ray
+ */
+void PathTraceIntegrator::update_path_occlusion(PTState* pstate, const WorldRay& ray, bool occluded) {
+	PTState& path = *pstate; // Shorthand for the passed path
+
+	if (!occluded) {
+		// Sample was lit
+		SurfaceClosure* bsdf = path.inter.surface_closure.get();
+
+		if (!bsdf->is_delta()) {
+			const DifferentialGeometry geo = path.inter.geo.transformed_from(path.inter.space);
+
+			SpectralSample fac = bsdf->evaluate(path.prev_ray.d, ray.d, geo, path.wavelength);
+
+			path.col += path.fcol * path.lcol * fac;
 		}
 	}
 
+	advance_path(pstate);
+}
+
+
+/*
+ * Move the path on to its next step
+ */
+void PathTraceIntegrator::advance_path(PTState* pstate) {
+	PTState& path = *pstate; // Shorthand for the passed path
+
 	path.step++;
 
 	// Has the path hit its maximum length?
@@ -283,14 +331,15 @@ void PathTraceIntegrator::render_blocks() {
 	PixelBlock pb {0,0,0,0};
 	RNG rng;
 	ImageSampler image_sampler(spp, image->width, image->height, seed);
-	Tracer tracer(scene);
+	Tracer tracer(scene, trace_pool);
 
 	// Light path array
 	std::vector<PTState> paths;
 
-	// Ray and Intersection arrays
+	// Ray, hit, and occlusion result arrays
 	std::vector<WorldRay> rays;
-	std::vector<Intersection> intersections;
+	std::vector<HitRecord> hits;
+	std::vector<uint32_t> occluded_bits;
 
 	// Keep rendering blocks as long as they exist in the queue
 	while (blocks.pop_blocking(&pb)) {
@@ -306,7 +355,7 @@ void PathTraceIntegrator::render_blocks() {
 			// Resize arrays for the apropriate sample count
 			paths.resize(sample_count);
 			rays.resize(sample_count);
-			intersections.resize(sample_count);
+			hits.resize(sample_count);
 
 			// Generate samples and corresponding paths
 			int samp_i = 0;
@@ -327,21 +376,44 @@ void PathTraceIntegrator::render_blocks() {
 			while (p_begin != p_end) {
 				int path_count = std::distance(p_begin, p_end);
 
-				// Size the ray buffer and intersection buffers appropriately
+				// Size the ray buffer and hit buffers appropriately
 				rays.resize(path_count);
-				intersections.resize(path_count);
+				hits.resize(path_count);
 
 				// Create path rays
 				for (int i = 0; i < path_count; ++i) {
 					rays[i] = next_ray_for_path(rays[i], p_begin+i);
 				}
 
-				// Trace rays
-				tracer.trace(&(*rays.begin()), &(*rays.end()), &(*intersections.begin()), &(*intersections.end()));
+				// Paths advance in lock-step, so either all of them are
+				// shooting shadow rays or none are
+				const bool shadow_rays = std::all_of(p_begin, p_end, [](const PTState& path) {
+					return (path.step % 2) != 0;
+				});
 
-				// Update paths based on result
-				for (int i = 0; i < path_count; ++i) {
-					update_path(p_begin+i, rays[i], intersections[i]);
+				if (shadow_rays) {
+					// Test rays for occlusion
+					occluded_bits.resize((path_count + 31) / 32);
+					tracer.occluded(&(*rays.begin()), &(*rays.end()), &(*occluded_bits.begin()));
+
+					// Update paths based on result
+					for (int i = 0; i < path_count; ++i) {
+						const bool occluded = (occluded_bits[i / 32] >> (i % 32)) & 1;
+						update_path_occlusion(p_begin+i, rays[i], occluded);
+					}
+				} else {
+					// Trace rays
+					tracer.trace(&(*rays.begin()), &(*rays.end()), &(*hits.begin()), &(*hits.end()));
+
+					// Reconstruct and shade the hits, straight into the paths
+					tracer.resolve([p_begin](size_t i) {
+						return &p_begin[i].inter;
+					});
+
+					// Update paths based on result
+					for (int i = 0; i < path_count; ++i) {
+						update_path(p_begin+i, rays[i], hits[i]);
+					}
 				}
 
 				// Partition paths based on which ones are active
@@ -381,4 +453,13 @@ void PathTraceIntegrator::render_blocks() {
 		print_progress();
 		progress_lock.unlock();
 	}
+
+	// Out of buckets, so help the render threads that are still going
+	// with their traces until the last of them is done
+	if (trace_pool != nullptr) {
+		if (--rendering_threads == 0)
+			trace_pool->finish();
+		else
+			trace_pool->help();
+	}
 }
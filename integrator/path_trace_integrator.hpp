@@ -10,6 +10,7 @@
 
 #include <functional>
 #include <mutex>
+#include <atomic>
 
 #include "numtype.h"
 
@@ -23,6 +24,7 @@
 #include "color.hpp"
 
 #include "ring_buffer_concurrent.hpp"
+#include "job_queue.hpp"
 
 /**
  * @brief An integrator for the rendering equation.
@@ -51,7 +53,7 @@ class PathTraceIntegrator final: Integrator {
 		float time;
 		int step = 0;
 		short pix_x, pix_y;  // Pixel coordinates of the path
-		Intersection inter {};
+		Intersection inter {}; // Filled in directly by the Tracer for the path's latest hit
 		WorldRay prev_ray {};
 		float wavelength;  // The wavelength of light of the path (in nm)
 		float last_pdf = 0.0f;
@@ -64,7 +66,9 @@ class PathTraceIntegrator final: Integrator {
 
 	void init_path(PTState* pstate, Sampler s, short x, short y);
 	WorldRay next_ray_for_path(const WorldRay& prev_ray, PTState* pstate);
-	void update_path(PTState* pstate, const WorldRay& ray, const Intersection& inter);
+	void update_path(PTState* pstate, const WorldRay& ray, const HitRecord& hit);
+	void update_path_occlusion(PTState* pstate, const WorldRay& ray, bool occluded);
+	void advance_path(PTState* pstate);
 
 
 
@@ -89,6 +93,9 @@ public:
 	int thread_count;
 	std::function<void()> callback;
 
+	JobQueue<>* trace_pool {nullptr}; // Lets render threads that are out of buckets help the others with individual traces
+	std::atomic<int> rendering_threads {0}; // Render threads that are still working on buckets
+
 	RingBufferConcurrent<PixelBlock> blocks; // Queue for pending blocks of pixels to be rendered
 
 	/**
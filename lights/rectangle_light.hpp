@@ -125,20 +125,22 @@ public:
 
 		// Check if we hit
 		if (x >= (dim.first * -0.5f) && x <= (dim.first * 0.5f) && y >= (dim.second * -0.5f) && y <= (dim.first * 0.5f)) {
-			intersection->t = t;
+			if (intersection && !ray.is_occlusion()) {
+				intersection->t = t;
 
-			intersection->geo.p = Vec3(x, y, 0.0f);
-			intersection->geo.n = Vec3(0.0f, 0.0f, 1.0f);
+				intersection->geo.p = Vec3(x, y, 0.0f);
+				intersection->geo.n = Vec3(0.0f, 0.0f, 1.0f);
 
-			intersection->backfacing = ray.d.z > 0.0f;
+				intersection->backfacing = ray.d.z > 0.0f;
 
-			intersection->light_pdf = sample_pdf(ray.o, ray.d, 0.0f, 0.0f, 0.0f, ray.time);
+				intersection->light_pdf = sample_pdf(ray.o, ray.d, 0.0f, 0.0f, 0.0f, ray.time);
 
-			intersection->offset = intersection->geo.n * 0.000001f;
+				intersection->offset = intersection->geo.n * 0.000001f;
 
-			const double surface_area = dim.first * dim.second;
-			const Color col = lerp_seq(ray.time, colors) * 0.5f / surface_area;
-			intersection->surface_closure.init(EmitClosure(col));
+				const double surface_area = dim.first * dim.second;
+				const Color col = lerp_seq(ray.time, colors) * 0.5f / surface_area;
+				intersection->surface_closure.init(EmitClosure(col));
+			}
 
 			return true;
 		} else {
@@ -25,11 +25,14 @@
 
 #include "ray.hpp"
 #include "intersection.hpp"
+#include "hit_record.hpp"
 #include "potentialinter.hpp"
+#include "ray_reorder.hpp"
 
 #include "global.hpp"
 
 #include "timer.hpp"
+#include "cpu_dispatch.hpp"
 
 #include "parser.hpp"
 #include "data_tree.hpp"
@@ -140,6 +143,7 @@ int main(int argc, char **argv) {
 	std::cout << " (DEBUG build)";
 #endif
 	std::cout << std::endl;
+	std::cout << "SIMD instruction set: " << CPUDispatch::instruction_set() << std::endl;
 
 #ifdef DEBUG
 	std::cout << std::endl << "Struct sizes:" << std::endl;
@@ -148,8 +152,11 @@ int main(int argc, char **argv) {
 	std::cout << "\tBBox: " << sizeof(BBox) << std::endl;
 	std::cout << "\tRay: " << sizeof(Ray) << std::endl;
 	std::cout << "\tIntersection: " << sizeof(Intersection) << std::endl;
+	std::cout << "\tHitRecord: " << sizeof(HitRecord) << std::endl;
 	std::cout << "\tPotentialInter: " << sizeof(PotentialInter) << std::endl;
 	std::cout << "\tBVH::Node: " << sizeof(BVH::Node) << std::endl;
+	std::cout << "\tBVH4::Node: " << sizeof(BVH4::Node) << std::endl;
+	std::cout << "\tBVH8::Node: " << sizeof(BVH8::Node) << std::endl;
 #endif
 
 
@@ -178,6 +185,18 @@ int main(int argc, char **argv) {
 	("threads,t", BPO::value<int>(), "Number of threads to render with")
 	("output,o", BPO::value<std::string>(), "The PNG file to render to")
 	("nooutput,n", "Don't save render (for timing tests)")
+	("rayindices", "Partition ray indices instead of ray data during traversal")
+	("notracepool", "Don't split individual traces across threads")
+	("rayreorder", BPO::value<int>(), "How to reorder rays before tracing: 0 = by direction octant, 1 = by octant and Morton code (default)")
+	("xformbuckets", BPO::value<size_t>(), "Pre-interpolate motion blurred instance transforms at this many time buckets, which rays share instead of interpolating their own (default 0, exact)")
+	("bvhbits", BPO::value<int>(), "Precision to store BVH node bounds with: 32 (default), 16, or 8 bits.  Lower precision uses less memory")
+	("bvhwidth", BPO::value<int>(), "Width of the BVH of assemblies that don't specify one: 4 (default) or 8")
+	("rayparallel", BPO::value<size_t>(), "Min rays at a BVH4 node to test four rays at a time against each child box, rather than each ray against all child boxes at once (default 64, 0 = never)")
+	("singleray", BPO::value<size_t>(), "Max rays at a BVH4 node to traverse the rest of its subtree one ray at a time (default 4, 0 = never)")
+	("bvhtimesegs", BPO::value<int>(), "Number of time segments to split the BVH4 of motion blurred assemblies into, 1 (default) to 8")
+	("bvhsplits", BPO::value<float>(), "Max extra BVH4 references to split large static instances into, as a fraction of the instance count (default 0 = never)")
+	("refit", BPO::value<float>(), "Refit the acceleration structures of each frame from the previous frame's when their SAH cost grows by at most this factor, e.g. 1.5 (default 0 = always rebuild)")
+	("accelcache", BPO::value<std::string>(), "Directory to cache acceleration structures and refined subdivision surfaces in, to reuse them across renders")
 	("resolution,r", BPO::value<Resolution>()->multitoken(), "The resolution to render at, e.g. 1280 720")
 	("subimage", BPO::value<SubImage>()->multitoken(), "The portion of the image to render as x1 y1 x2 y2, e.g. 24 24 100 120")
 	;
@@ -196,6 +215,96 @@ int main(int argc, char **argv) {
 	// Suppress image writing
 	Config::no_output = bool(vm.count("nooutput"));
 
+	// Ray partitioning mode
+	Config::ray_index_partition = bool(vm.count("rayindices"));
+
+	// Intra-trace threading
+	Config::trace_pool = !vm.count("notracepool");
+
+	// Ray reordering mode
+	if (vm.count("rayreorder")) {
+		Config::ray_reorder_mode = vm["rayreorder"].as<int>();
+		if (Config::ray_reorder_mode < 0 || Config::ray_reorder_mode >= RayReorder::MODE_COUNT) {
+			std::cout << "WARNING: unknown ray reorder mode " << Config::ray_reorder_mode << ", using default." << std::endl;
+			Config::ray_reorder_mode = RayReorder::OCTANT_MORTON;
+		}
+		std::cout << "Ray reorder mode: " << Config::ray_reorder_mode << "\n";
+	}
+
+	// Instance transform time buckets
+	if (vm.count("xformbuckets")) {
+		Config::transform_time_buckets = vm["xformbuckets"].as<size_t>();
+		std::cout << "Transform time buckets: " << Config::transform_time_buckets << "\n";
+	}
+
+	// BVH bounds precision
+	if (vm.count("bvhbits")) {
+		Config::bvh_bounds_bits = vm["bvhbits"].as<int>();
+		if (Config::bvh_bounds_bits != 32 && Config::bvh_bounds_bits != 16 && Config::bvh_bounds_bits != 8) {
+			std::cout << "WARNING: unsupported BVH bounds precision " << Config::bvh_bounds_bits << ", using 32 bits." << std::endl;
+			Config::bvh_bounds_bits = 32;
+		}
+		std::cout << "BVH bounds bits: " << Config::bvh_bounds_bits << "\n";
+	}
+
+	// BVH width
+	if (vm.count("bvhwidth")) {
+		Config::bvh_width = vm["bvhwidth"].as<int>();
+		if (Config::bvh_width != 4 && Config::bvh_width != 8) {
+			std::cout << "WARNING: unsupported BVH width " << Config::bvh_width << ", using 4." << std::endl;
+			Config::bvh_width = 4;
+		}
+		std::cout << "BVH width: " << Config::bvh_width << "\n";
+	}
+
+	// Ray-parallel BVH traversal threshold
+	if (vm.count("rayparallel")) {
+		Config::ray_parallel_min = vm["rayparallel"].as<size_t>();
+		std::cout << "Ray-parallel traversal min rays: " << Config::ray_parallel_min << "\n";
+	}
+
+	// Single-ray BVH traversal threshold
+	if (vm.count("singleray")) {
+		Config::single_ray_max = vm["singleray"].as<size_t>();
+		std::cout << "Single-ray traversal max rays: " << Config::single_ray_max << "\n";
+	}
+
+	// BVH time segments
+	if (vm.count("bvhtimesegs")) {
+		Config::bvh_time_segments = vm["bvhtimesegs"].as<int>();
+		if (Config::bvh_time_segments < 1 || Config::bvh_time_segments > BVH4::MAX_TIME_SEGMENTS) {
+			std::cout << "WARNING: unsupported number of BVH time segments " << Config::bvh_time_segments << ", using 1." << std::endl;
+			Config::bvh_time_segments = 1;
+		}
+		std::cout << "BVH time segments: " << Config::bvh_time_segments << "\n";
+	}
+
+	// BVH instance splitting budget
+	if (vm.count("bvhsplits")) {
+		Config::bvh_split_budget = vm["bvhsplits"].as<float>();
+		if (!(Config::bvh_split_budget >= 0.0f)) {
+			std::cout << "WARNING: invalid BVH split budget " << Config::bvh_split_budget << ", using 0." << std::endl;
+			Config::bvh_split_budget = 0.0f;
+		}
+		std::cout << "BVH split budget: " << Config::bvh_split_budget << "\n";
+	}
+
+	// Acceleration structure refitting
+	if (vm.count("refit")) {
+		Config::refit_threshold = vm["refit"].as<float>();
+		if (!(Config::refit_threshold >= 0.0f)) {
+			std::cout << "WARNING: invalid refit threshold " << Config::refit_threshold << ", using 0." << std::endl;
+			Config::refit_threshold = 0.0f;
+		}
+		std::cout << "Refit threshold: " << Config::refit_threshold << "\n";
+	}
+
+	// Acceleration structure cache
+	if (vm.count("accelcache")) {
+		Config::accel_cache_dir = vm["accelcache"].as<std::string>();
+		std::cout << "Acceleration structure cache: " << Config::accel_cache_dir << "\n";
+	}
+
 	// Samples per pixel
 	if (vm.count("spp")) {
 		spp = vm["spp"].as<int>();
@@ -221,6 +330,7 @@ int main(int argc, char **argv) {
 			threads = 1;
 		std::cout << "Threads: " << threads << "\n";
 	}
+	Config::build_threads = threads;
 
 	// Input file
 	if (vm.count("scenefile")) {
@@ -255,6 +365,7 @@ int main(int argc, char **argv) {
 	 */
 	Parser parser(input_path);
 	Timer<> total_timer;
+	std::unique_ptr<Renderer> previous; // The previous frame, if its acceleration structures may be refit
 	while (true) {
 		Timer<> parse_timer;
 		std::unique_ptr<Renderer> r {parser.parse_next_frame()};
@@ -265,7 +376,8 @@ int main(int argc, char **argv) {
 		std::cout << "Parse time (seconds): " << parse_timer.time() << std::endl;
 
 		Timer<> preprocessing_timer;
-		r->scene->finalize();
+		r->scene->finalize(previous ? previous->scene.get() : nullptr);
+		previous.reset();
 		std::cout << "Preprocessing time (seconds): " << preprocessing_timer.time() << std::endl;
 
 		// Resolution and sampling overrides
@@ -287,6 +399,9 @@ int main(int argc, char **argv) {
 		 */
 		r->render(threads);
 
+		if (Config::refit_threshold > 0.0f)
+			previous = std::move(r);
+
 		std::cout << std::endl << std::endl;
 	}
 
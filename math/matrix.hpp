@@ -113,6 +113,30 @@ struct alignas(16) Matrix44 {
 		dst.z = r[2];
 	}
 
+	// Versions of the above that transform four vectors at once.  The
+	// vectors are in SoA form, i.e. src[0] holds the x components of all
+	// four vectors, etc.  The results are identical to transforming the
+	// vectors one at a time.
+	void multVecMatrix4(const SIMD::float4* src, SIMD::float4* dst) const {
+		SIMD::float4 r[4];
+		for (int i = 0; i < 4; ++i)
+			r[i] = (src[0] * data[0][i]) + (src[1] * data[1][i]) + (src[2] * data[2][i]) + SIMD::float4(data[3][i]);
+
+		dst[0] = r[0] / r[3];
+		dst[1] = r[1] / r[3];
+		dst[2] = r[2] / r[3];
+	}
+
+	void multDirMatrix4(const SIMD::float4* src, SIMD::float4* dst) const {
+		SIMD::float4 r[3];
+		for (int i = 0; i < 3; ++i)
+			r[i] = (src[0] * data[0][i]) + (src[1] * data[1][i]) + (src[2] * data[2][i]);
+
+		dst[0] = r[0];
+		dst[1] = r[1];
+		dst[2] = r[2];
+	}
+
 
 // Matrix/Matrix operations
 	Matrix44 operator+(const Matrix44& m) const {
@@ -4,6 +4,7 @@
 #include "numtype.h"
 
 #include <string>
+#include <algorithm>
 
 #include "utils.hpp"
 #include "range.hpp"
@@ -153,6 +154,15 @@ public:
 		return static_cast<Vec3>(r);
 	}
 
+	// Transform four vectors at once as positions or directions, in SoA
+	// form.  See Matrix44::multVecMatrix4().
+	void pos_to_4(const SIMD::float4* v, SIMD::float4* r) const {
+		to.multVecMatrix4(v, r);
+	}
+	void dir_to_4(const SIMD::float4* v, SIMD::float4* r) const {
+		to.multDirMatrix4(v, r);
+	}
+
 	// Transform vector as surface normal
 	Vec3 nor_to(const Vec3 &v) const {
 		ImathVec3 r;
@@ -293,4 +303,28 @@ static inline std::vector<Transform> merge(const std::vector<Transform>& a, cons
 	return merge(a.cbegin(), a.cend(), b.cbegin(), b.cend());
 }
 
+/**
+ * Returns the time bucket of a time in [0, 1] when times are quantized to
+ * the given number of buckets, i.e. the index of the nearest of the times
+ * 0/buckets, 1/buckets, ... buckets/buckets.
+ */
+static inline size_t time_bucket(float time, size_t buckets) {
+	return std::min(static_cast<size_t>(time * buckets + 0.5f), buckets);
+}
+
+
+/**
+ * Interpolates an array of Transforms over time at the times of the given
+ * number of time buckets (see time_bucket()), and writes the result into a
+ * third array with room for buckets + 1 Transforms.
+ *
+ * The result is itself an array of Transforms over time, with its time
+ * samples evenly spaced, so it can be merged like any other.
+ */
+static inline void bucket_transforms(Transform* dest, const Transform* begin, const Transform* end, size_t buckets) {
+	for (size_t i = 0; i <= buckets; ++i) {
+		dest[i] = lerp_seq(static_cast<float>(i) / buckets, begin, end);
+	}
+}
+
 #endif // TRANSFORM_HPP
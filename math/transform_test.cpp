@@ -0,0 +1,71 @@
+#include "test.hpp"
+
+#include <cmath>
+#include <vector>
+#include "transform.hpp"
+
+/*
+ ************************************************************************
+ * Test suite for interpolating Transforms over time.
+ ************************************************************************
+ */
+
+// Translation by (x, y, z) combined with a uniform scale s
+static Transform translate_scale(float x, float y, float z, float s) {
+	return Transform(Matrix44(s, 0.0f, 0.0f, 0.0f,
+	                          0.0f, s, 0.0f, 0.0f,
+	                          0.0f, 0.0f, s, 0.0f,
+	                          x, y, z, 1.0f));
+}
+
+TEST_CASE("transform_time_buckets") {
+	SECTION("time_bucket") {
+		REQUIRE(time_bucket(0.0f, 8) == 0);
+		REQUIRE(time_bucket(1.0f, 8) == 8);
+		REQUIRE(time_bucket(0.5f, 8) == 4);
+		REQUIRE(time_bucket(0.06f, 8) == 0);
+		REQUIRE(time_bucket(0.07f, 8) == 1);
+		REQUIRE(time_bucket(0.99f, 8) == 8);
+		REQUIRE(time_bucket(0.5f, 1) == 1);
+	}
+
+	SECTION("bucket_transforms") {
+		const std::vector<Transform> xforms = {translate_scale(0.0f, 0.0f, 0.0f, 1.0f), translate_scale(10.0f, -4.0f, 2.0f, 2.0f), translate_scale(30.0f, 0.0f, 8.0f, 1.5f)};
+		const size_t buckets = 6;
+		Transform bucketed[buckets + 1];
+		bucket_transforms(bucketed, xforms.data(), xforms.data() + xforms.size(), buckets);
+
+		for (size_t i = 0; i <= buckets; ++i) {
+			const Transform exact = lerp_seq(static_cast<float>(i) / buckets, xforms);
+			for (int r = 0; r < 4; ++r) {
+				for (int c = 0; c < 4; ++c)
+					REQUIRE(bucketed[i].to[r][c] == exact.to[r][c]);
+			}
+		}
+	}
+
+	SECTION("bucketed_vs_exact") {
+		// Moves a point less than 43 units per unit of time, and scales it
+		// by at most 2 per unit of time
+		const std::vector<Transform> xforms = {translate_scale(0.0f, 0.0f, 0.0f, 1.0f), translate_scale(10.0f, -4.0f, 2.0f, 2.0f), translate_scale(30.0f, 0.0f, 8.0f, 1.5f)};
+		const Vec3 p(1.0f, -2.0f, 3.0f);
+		const float max_speed = 43.0f + (2.0f * p.length());
+
+		for (size_t buckets: {1, 4, 16, 64}) {
+			std::vector<Transform> bucketed(buckets + 1);
+			bucket_transforms(bucketed.data(), xforms.data(), xforms.data() + xforms.size(), buckets);
+
+			// Each time is at most half a bucket from its bucket's time,
+			// so the transformed points can only be that far apart
+			const float max_error = max_speed * (0.5f / buckets);
+			for (int i = 0; i <= 1000; ++i) {
+				const float time = i / 1000.0f;
+				const Transform exact = lerp_seq(time, xforms);
+				const Transform& approx = bucketed[time_bucket(time, buckets)];
+
+				REQUIRE((exact.pos_to(p) - approx.pos_to(p)).length() <= max_error);
+				REQUIRE(std::abs(time_bucket(time, buckets) / static_cast<float>(buckets) - time) <= (0.5f / buckets) + 0.0001f);
+			}
+		}
+	}
+}
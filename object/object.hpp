@@ -9,7 +9,9 @@
 #include <stdlib.h>
 #include "stack.hpp"
 #include "ray.hpp"
+#include "ray_stream.hpp"
 #include "intersection.hpp"
+#include "hit_record.hpp"
 #include "bbox.hpp"
 #include "transform.hpp"
 #include "surface_shader.hpp"
@@ -53,6 +55,16 @@ public:
 	 */
 	virtual void finalize() {}
 
+	/**
+	 * Finalizes an object like finalize(), but may reuse data from the
+	 * same object in the previous frame of an animation, e.g. refitting
+	 * its acceleration structure instead of rebuilding it.  previous may
+	 * be of a different type, and may be left unusable.
+	 */
+	virtual void finalize_from(Object* previous) {
+		finalize();
+	}
+
 	/**
 	 * @brief Returns the bounds of the object.
 	 */
@@ -88,7 +100,7 @@ public:
 	/**
 	 * @brief Tests a ray against the surface.
 	 */
-	virtual bool intersect_ray(const Ray &ray, Intersection *intersection=nullptr) = 0;
+	virtual bool intersect_ray(const Ray &ray, Intersection *intersection=nullptr) const = 0;
 };
 
 
@@ -106,10 +118,19 @@ public:
 
 	/**
 	 * @brief Tests a batch of rays against the surface.
+	 *
+	 * Only a compact HitRecord (indexed by ray id) should be filled in for
+	 * each ray's closest hit, with surface_shader recorded in it rather
+	 * than run.  The object of the record must be a PatchSurface, from
+	 * which the Tracer reconstructs the full intersection later.
+	 *
+	 * hits may be null if all of the rays are occlusion rays, in which
+	 * case hits are only recorded by marking the rays as done.
+	 *
+	 * The widths of the rays that aren't done are up to date.
 	 */
-	virtual void intersect_rays(Ray* rays_begin, Ray* rays_end,
-	                            Intersection *intersections,
-	                            const Range<const Transform*> parent_xforms,
+	virtual void intersect_rays(RayStream* rays, size_t rays_begin, size_t rays_end,
+	                            HitRecord *hits,
 	                            Stack* data_stack,
 	                            const SurfaceShader* surface_shader,
 	                            const InstanceID& element_id) const = 0;
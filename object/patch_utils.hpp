@@ -7,19 +7,44 @@
 #include "vector.hpp"
 #include "bbox.hpp"
 #include "ray.hpp"
-#include "intersection.hpp"
+#include "ray_stream.hpp"
+#include "hit_record.hpp"
+#include "differential_geometry.hpp"
 #include "stack.hpp"
 #include "surface_shader.hpp"
+#include "motion_policy.hpp"
+#include "cpu_dispatch.hpp"
 
 
 
 #define SPLIT_STACK_SIZE 64
 
-template <typename PATCH>
-void intersect_rays_with_patch(const PATCH &patch, const Range<const Transform*> parent_xforms, Ray* ray_begin, Ray* ray_end, Intersection *intersections, Stack* data_stack, const SurfaceShader* surface_shader, const InstanceID& element_id) {
-	const size_t tsc = patch.verts.size(); // Time sample count
+/**
+ * Intersects a batch of rays with a patch, dicing it down as needed for
+ * each ray's width.
+ *
+ * For each ray's closest hit only a compact HitRecord (indexed by ray id)
+ * is filled in, with the uv coordinates and offset needed to compute the
+ * full surface geometry later via patch_differential_geometry().
+ *
+ * hits may be null if all of the rays are occlusion rays, in which case
+ * hits are only recorded by marking the rays as done.
+ *
+ * The widths of the rays that aren't done must be up to date, see
+ * RayStream::update_width().
+ *
+ * MOTION is StaticPolicy or MotionPolicy (see motion_policy.hpp).  The
+ * static version may only be used with patches that have one time sample.
+ *
+ * Compiled for several instruction sets, see cpu_dispatch.hpp.
+ */
+template <typename PATCH, typename MOTION>
+CPU_DISPATCH void intersect_rays_with_patch(const PATCH &patch, RayStream* ray_stream, size_t ray_begin, size_t ray_end, HitRecord *hits, Stack* data_stack, const SurfaceShader* surface_shader, const InstanceID& element_id) {
+	assert(MOTION::MOTION || patch.verts.size() == 1);
+	const size_t tsc = MOTION::MOTION ? patch.verts.size() : 1; // Time sample count
+	RayStream &rays = *ray_stream;
 	int stack_i = 0;
-	std::pair<Ray*, Ray*> ray_stack[SPLIT_STACK_SIZE];
+	std::pair<size_t, size_t> ray_stack[SPLIT_STACK_SIZE];
 	BBox* bboxes = data_stack->push_frame<BBox>(tsc).first;
 	Stack &patch_stack = *data_stack;
 	std::tuple<float, float, float, float> uv_stack[SPLIT_STACK_SIZE]; // (min_u, max_u, min_v, max_v)
@@ -46,87 +71,55 @@ void intersect_rays_with_patch(const PATCH &patch, const Range<const Transform*>
 		}
 
 		// TEST RAYS AGAINST BBOX
-		ray_stack[stack_i].first = mutable_partition(ray_stack[stack_i].first, ray_stack[stack_i].second, [&](Ray& ray) {
-			if (ray.is_done()) {
+		ray_stack[stack_i].first = rays.partition(ray_stack[stack_i].first, ray_stack[stack_i].second, [&](size_t i) {
+			if (rays.is_done(i)) {
 				return true;
 			}
-
-			// Time interpolation values, which may be used twice in the case
-			// that there is more than one time sample, so store them outside
-			// of the if statement below.
-			float t_time;
-			size_t t_index = 0;
-			float t_nalpha = 0.0f;
+			const size_t s = rays.slot(i);
 
 			// Ray test
 			float hitt0, hitt1;
 			bool hit;
-			if (tsc == 1) {
+			if (!MOTION::MOTION || tsc == 1) {
 				// If we only have one time sample, we can skip the bbox interpolation
-				hit = bboxes[0].intersect_ray(ray, &hitt0, &hitt1, ray.max_t);
+				hit = bboxes[0].intersect_ray(rays.o[s], rays.d_inv[s], &hitt0, &hitt1, rays.max_t[s]);
 			} else {
 				// If we have more than one time sample, we need to interpolate the bbox
 				// before testing.
-				t_time = ray.time * (tsc - 1);
-				t_index = t_time;
-				t_nalpha = t_time - t_index;
-				hit = lerp(t_nalpha, bboxes[t_index], bboxes[t_index+1]).intersect_ray(ray, &hitt0, &hitt1, ray.max_t);
+				const float t_time = rays.time[s] * (tsc - 1);
+				const size_t t_index = t_time;
+				const float t_nalpha = t_time - t_index;
+				hit = lerp(t_nalpha, bboxes[t_index], bboxes[t_index+1]).intersect_ray(rays.o[s], rays.d_inv[s], &hitt0, &hitt1, rays.max_t[s]);
 			}
 
 			if (hit) {
-				const float width = std::max(ray.min_width(hitt0, hitt1) * Config::dice_rate, Config::min_upoly_size);
+				const uint32_t ray_id = rays.id(i);
+				const float width = std::max(rays.w[ray_id].min_width(hitt0, hitt1) * Config::dice_rate, Config::min_upoly_size);
 				// LEAF, so we don't have to go deeper, regardless of whether
 				// we hit it or not.
 				if (max_dim <= width || stack_i == (SPLIT_STACK_SIZE-1)) {
 					const float tt = (hitt0 + hitt1) * 0.5f;
-					if (tt > 0.0f && tt < ray.max_t) {
-						auto &inter = intersections[ray.id()];
-						inter.hit = true;
-						inter.id = element_id;
-						if (ray.is_occlusion()) {
-							ray.set_done_true();
-						} else {
-							// Get the time-interpolated patch, for calculating
-							// surface derivatives and normals below
-							typename PATCH::store_type ipatch;
-							if (tsc == 1) {
-								// If we only have one time sample, we can skip the interpolation
-								ipatch = patch.verts[0];
-							} else {
-								// If we have more than one time sample, we need to interpolate the patch
-								ipatch = PATCH::interpolate_patch(t_nalpha, patch.verts[t_index], patch.verts[t_index+1]);
-							}
-
-
-							// Fill in intersection and ray info
-							ray.max_t = tt;
-
-							const float u = (std::get<0>(uv_stack[stack_i]) + std::get<1>(uv_stack[stack_i])) * 0.5f;
-							const float v = (std::get<2>(uv_stack[stack_i]) + std::get<3>(uv_stack[stack_i])) * 0.5f;
-							const float offset = max_dim * 1.74f;
-
-							inter.t = tt;
-
-							inter.space = parent_xforms.size() > 0 ? lerp_seq(ray.time, parent_xforms) : Transform();
-
-							inter.geo.p = ray.o + (ray.d * tt);
-							inter.geo.u = u;
-							inter.geo.v = v;
-
-							// Surface normal and differential geometry
-							std::tie(inter.geo.n, inter.geo.dpdu, inter.geo.dpdv, inter.geo.dndu, inter.geo.dndv) = PATCH::differential_geometry(ipatch, u, v);
-
-							// Did te ray hit from the back-side of the surface?
-							inter.backfacing = dot(inter.geo.n, ray.d.normalized()) > 0.0f;
-
-							inter.offset = inter.geo.n * offset;
-
-							// Do shading
-							if (surface_shader != nullptr) {
-								surface_shader->shade(&inter);
-							} else {
-								inter.surface_closure.init(EmitClosure(Color(1.0, 0.0, 1.0)));
+					if (tt > 0.0f && tt < rays.max_t[s]) {
+						if (rays.is_occlusion(i)) {
+							if (hits != nullptr) {
+								hits[ray_id].hit = true;
+								hits[ray_id].id = element_id;
 							}
+							rays.set_done_true(i);
+						} else {
+							// Record the hit.  The full intersection is
+							// reconstructed from it after traversal.
+							auto &hit = hits[ray_id];
+							hit.hit = true;
+							hit.object = &patch;
+							hit.shader = surface_shader;
+							hit.id = element_id;
+							hit.t = tt;
+							hit.u = (std::get<0>(uv_stack[stack_i]) + std::get<1>(uv_stack[stack_i])) * 0.5f;
+							hit.v = (std::get<2>(uv_stack[stack_i]) + std::get<3>(uv_stack[stack_i])) * 0.5f;
+							hit.offset = max_dim * 1.74f;
+
+							rays.max_t[s] = tt;
 						}
 					}
 
@@ -200,6 +193,37 @@ void intersect_rays_with_patch(const PATCH &patch, const Range<const Transform*>
 }
 
 
+/**
+ * Computes the differential geometry of a patch at the given time and uv
+ * coordinates, interpolating between time samples the same way
+ * intersect_rays_with_patch() does.
+ *
+ * Only the surface normal and derivatives are filled in, along with u and
+ * v.  The hit point itself is left to the caller.
+ */
+template <typename PATCH>
+void patch_differential_geometry(const PATCH &patch, float time, float u, float v, DifferentialGeometry* geo) {
+	const size_t tsc = patch.verts.size(); // Time sample count
+
+	// Get the time-interpolated patch
+	typename PATCH::store_type ipatch;
+	if (tsc == 1) {
+		// If we only have one time sample, we can skip the interpolation
+		ipatch = patch.verts[0];
+	} else {
+		// If we have more than one time sample, we need to interpolate the patch
+		const float t_time = time * (tsc - 1);
+		const size_t t_index = t_time;
+		const float t_nalpha = t_time - t_index;
+		ipatch = PATCH::interpolate_patch(t_nalpha, patch.verts[t_index], patch.verts[t_index+1]);
+	}
+
+	geo->u = u;
+	geo->v = v;
+	std::tie(geo->n, geo->dpdu, geo->dpdv, geo->dndu, geo->dndv) = PATCH::differential_geometry(ipatch, u, v);
+}
+
+
 // Modifies a bicubic patch in place to convert it from bspline to bezier.
 static inline void bspline_to_bezier_curve(Vec3* v1, Vec3* v2, Vec3* v3, Vec3* v4) {
 	const Vec3 tmp_v2 = *v2;
@@ -64,7 +64,7 @@ void Sphere::finalize() {
 
 //////////////////////////////////////////////////////////////
 
-bool Sphere::intersect_ray(const Ray &ray, Intersection *intersection) {
+bool Sphere::intersect_ray(const Ray &ray, Intersection *intersection) const {
 	// Get the center and radius of the sphere at the ray's time
 	const Vec3 cent = lerp_seq(ray.time, center); // Center of the sphere
 	const float radi = lerp_seq(ray.time, radius); // Radius of the sphere
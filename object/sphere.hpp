@@ -27,7 +27,7 @@ public:
 
 	void finalize();
 
-	virtual bool intersect_ray(const Ray &ray, Intersection *intersection=nullptr);
+	virtual bool intersect_ray(const Ray &ray, Intersection *intersection=nullptr) const override;
 	virtual const std::vector<BBox> &bounds() const;
 	virtual Color total_emitted_color() const override final {
 		return Color(0.0f);
@@ -5,8 +5,12 @@
 #include <vector>
 #include <array>
 #include <algorithm>
+#include <thread>
 
 #include "patch_utils.hpp"
+#include "binned_sah.hpp"
+#include "config.hpp"
+#include "accel_cache.hpp"
 
 #include <opensubdiv/far/topologyDescriptor.h>
 #include <opensubdiv/far/primvarRefiner.h>
@@ -17,6 +21,10 @@
 // Max depth of the BVH tree
 static constexpr int DEPTH_LIMIT = 64;
 
+// The minimum number of patches in a BVH subtree to bother building its
+// children on separate threads
+static constexpr size_t PARALLEL_BUILD_MIN = 1 << 10;
+
 
 /*
  * A variation on Vec3 with the needed interface for OpenSubdiv.
@@ -38,16 +46,15 @@ struct SubdivVec3 {
 };
 
 
-void SubdivisionSurface::intersect_rays(Ray* rays_begin, Ray* rays_end,
-                                        Intersection *intersections,
-                                        const Range<const Transform*> parent_xforms,
+void SubdivisionSurface::intersect_rays(RayStream* rays, size_t rays_begin, size_t rays_end,
+                                        HitRecord *hits,
                                         Stack* data_stack,
                                         const SurfaceShader* surface_shader,
                                         const InstanceID& element_id
                                        ) const {
 	int stack_i = 0;
 	SubdivisionSurface::Node* node_stack[DEPTH_LIMIT];
-	Ray* ray_end_stack[DEPTH_LIMIT];
+	size_t ray_end_stack[DEPTH_LIMIT];
 
 	node_stack[0] = bvh_root;
 	ray_end_stack[0] = rays_end;
@@ -58,8 +65,10 @@ void SubdivisionSurface::intersect_rays(Ray* rays_begin, Ray* rays_end,
 		// If node is not a leaf
 		if (node_stack[stack_i]->leaf_data == nullptr) {
 			// Test rays against current node
-			ray_end_stack[stack_i] = mutable_partition(rays_begin, ray_end_stack[stack_i], [&](Ray& ray) {
-				return lerp_seq(ray.time, node_stack[stack_i]->bounds).intersect_ray(ray);
+			ray_end_stack[stack_i] = rays->partition(rays_begin, ray_end_stack[stack_i], [&](size_t i) {
+				const size_t s = rays->slot(i);
+				float hitt0, hitt1;
+				return lerp_seq(rays->time[s], node_stack[stack_i]->bounds).intersect_ray(rays->o[s], rays->d_inv[s], &hitt0, &hitt1, rays->max_t[s]);
 			});
 
 			// If any of the rays hit, proceed deeper with the ones that did
@@ -76,13 +85,210 @@ void SubdivisionSurface::intersect_rays(Ray* rays_begin, Ray* rays_end,
 		}
 		// If node is a leaf
 		else {
-			intersect_rays_with_patch<Bicubic>(*(node_stack[stack_i]->leaf_data), parent_xforms, rays_begin, ray_end_stack[stack_i], intersections, data_stack, surface_shader, element_id);
+			const Bicubic& patch = *(node_stack[stack_i]->leaf_data);
+			if (patch.verts.size() == 1)
+				intersect_rays_with_patch<Bicubic, StaticPolicy>(patch, rays, rays_begin, ray_end_stack[stack_i], hits, data_stack, surface_shader, element_id);
+			else
+				intersect_rays_with_patch<Bicubic, MotionPolicy>(patch, rays, rays_begin, ray_end_stack[stack_i], hits, data_stack, surface_shader, element_id);
 			--stack_i;
 		}
 	}
 }
 
 void SubdivisionSurface::finalize() {
+	if (Config::accel_cache_dir.empty()) {
+		evaluate_patches();
+		build_bvh();
+		return;
+	}
+
+	const uint64_t key = cache_key();
+	if (!load_cache(key)) {
+		evaluate_patches();
+		build_bvh();
+		save_cache(key);
+	}
+}
+
+
+/*
+ * A BVH node as stored in the cache, with indices in place of pointers.
+ */
+struct CachedNode {
+	int64_t bounds_begin, bounds_end; // Range in bvh_bboxes
+	int64_t children[2]; // Indices in bvh_nodes, or -1
+	int64_t patch; // Index in patches, or -1 for inner nodes
+};
+
+
+/*
+ * Returns the key for caching the patches and BVH of the surface (see
+ * AccelCache), which covers everything they're computed from.
+ */
+uint64_t SubdivisionSurface::cache_key() const {
+	AccelCache::Key key;
+	key.add(motion_samples);
+	key.add(verts_per_motion_sample);
+	key.add(verts);
+	key.add(face_vert_counts);
+	key.add(face_vert_indices);
+	key.add(Config::displace_distance);
+	return key.value();
+}
+
+
+/*
+ * Loads the patches and BVH from the cache file with the given key, if
+ * there is one.  Returns whether that succeeded.
+ */
+bool SubdivisionSurface::load_cache(const uint64_t key) {
+	AccelCache::Reader reader;
+	std::vector<std::array<Vec3, 16>> patch_verts;
+	std::vector<CachedNode> nodes;
+	int64_t root;
+	if (!reader.open(Config::accel_cache_dir, "subdiv", key)
+	        || !reader.read(&patch_verts)
+	        || !reader.read(&nodes)
+	        || !reader.read(&bvh_bboxes)
+	        || !reader.read_value(&root)
+	        || !reader.read_value(&max_depth)
+	        || !reader.read_value(&bvh_built_sah_cost)
+	        || motion_samples <= 0
+	        || (patch_verts.size() % motion_samples) != 0
+	        || root < 0 || root >= static_cast<int64_t>(nodes.size())) {
+		bvh_bboxes.clear();
+		return false;
+	}
+
+	// Patches
+	patches.clear();
+	patches.resize(patch_verts.size() / motion_samples);
+	for (size_t i = 0; i < patches.size(); ++i) {
+		for (int ms = 0; ms < motion_samples; ++ms)
+			patches[i].add_time_sample(patch_verts[(i * motion_samples) + ms]);
+		patches[i].finalize();
+	}
+
+	// BVH
+	const auto in_range = [](int64_t i, size_t size) {
+		return i >= -1 && i < static_cast<int64_t>(size);
+	};
+	bvh_nodes.resize(nodes.size());
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		const CachedNode& cn = nodes[i];
+		if (cn.bounds_begin < 0 || cn.bounds_begin > cn.bounds_end || cn.bounds_end > static_cast<int64_t>(bvh_bboxes.size())
+		        || !in_range(cn.children[0], nodes.size()) || !in_range(cn.children[1], nodes.size())
+		        || !in_range(cn.patch, patches.size())) {
+			bvh_nodes.clear();
+			bvh_bboxes.clear();
+			return false;
+		}
+
+		auto& node = bvh_nodes[i];
+		node.bounds = Range<BBox*>(bvh_bboxes.data() + cn.bounds_begin, bvh_bboxes.data() + cn.bounds_end);
+		node.children[0] = (cn.children[0] >= 0) ? &bvh_nodes[cn.children[0]] : nullptr;
+		node.children[1] = (cn.children[1] >= 0) ? &bvh_nodes[cn.children[1]] : nullptr;
+		node.leaf_data = (cn.patch >= 0) ? &patches[cn.patch] : nullptr;
+	}
+	bvh_root = &bvh_nodes[root];
+
+	// Bounds
+	BBox bb;
+	for (const auto& v: verts) {
+		bb.min = min(bb.min, v);
+		bb.max = max(bb.max, v);
+	}
+	bbox.emplace_back(bb);
+
+	return true;
+}
+
+
+/*
+ * Saves the patches and BVH to the cache file with the given key.
+ */
+void SubdivisionSurface::save_cache(const uint64_t key) const {
+	if (patches.empty())
+		return;
+
+	std::vector<std::array<Vec3, 16>> patch_verts;
+	patch_verts.reserve(patches.size() * motion_samples);
+	for (const auto& patch: patches) {
+		if (static_cast<int>(patch.verts.size()) != motion_samples)
+			return;
+		patch_verts.insert(patch_verts.end(), patch.verts.begin(), patch.verts.end());
+	}
+
+	std::vector<CachedNode> nodes(bvh_nodes.size());
+	for (size_t i = 0; i < bvh_nodes.size(); ++i) {
+		const auto& node = bvh_nodes[i];
+		nodes[i].bounds_begin = node.bounds.begin() - bvh_bboxes.data();
+		nodes[i].bounds_end = node.bounds.end() - bvh_bboxes.data();
+		nodes[i].children[0] = (node.children[0] != nullptr) ? (node.children[0] - bvh_nodes.data()) : -1;
+		nodes[i].children[1] = (node.children[1] != nullptr) ? (node.children[1] - bvh_nodes.data()) : -1;
+		nodes[i].patch = (node.leaf_data != nullptr) ? (node.leaf_data - patches.data()) : -1;
+	}
+
+	AccelCache::Writer writer(Config::accel_cache_dir, "subdiv", key);
+	writer.write(patch_verts);
+	writer.write(nodes);
+	writer.write(bvh_bboxes);
+	writer.write_value(static_cast<int64_t>(bvh_root - bvh_nodes.data()));
+	writer.write_value(max_depth);
+	writer.write_value(bvh_built_sah_cost);
+	if (!writer.commit())
+		std::cout << "WARNING: couldn't write subdivision surface to the cache in '" << Config::accel_cache_dir << "'." << std::endl;
+}
+
+
+/*
+ * Finalizes the surface like finalize(), but if the previous frame's
+ * surface has the same topology, refits its BVH to the new patches instead
+ * of building a new one (see Config::refit_threshold).
+ */
+void SubdivisionSurface::finalize_from(Object* previous) {
+	auto prev = dynamic_cast<SubdivisionSurface*>(previous);
+	if (prev == nullptr || prev->bvh_nodes.empty()
+	        || prev->motion_samples != motion_samples
+	        || prev->verts_per_motion_sample != verts_per_motion_sample
+	        || prev->face_vert_counts != face_vert_counts
+	        || prev->face_vert_indices != face_vert_indices) {
+		finalize();
+		return;
+	}
+
+	evaluate_patches();
+
+	if (patches.size() == prev->patches.size()) {
+		// Take over the previous BVH.  Moving the vectors keeps their
+		// storage, so the pointers between nodes and to bounds stay
+		// valid, and only the leaves' patch pointers need updating.
+		const Bicubic* prev_patches = prev->patches.data();
+		bvh_nodes = std::move(prev->bvh_nodes);
+		bvh_bboxes = std::move(prev->bvh_bboxes);
+		bvh_root = prev->bvh_root;
+		max_depth = prev->max_depth;
+		bvh_built_sah_cost = prev->bvh_built_sah_cost;
+		for (auto& node: bvh_nodes) {
+			if (node.leaf_data != nullptr)
+				node.leaf_data = &patches[node.leaf_data - prev_patches];
+		}
+
+		if (refit_bvh())
+			return;
+
+		bvh_nodes.clear();
+		bvh_bboxes.clear();
+	}
+
+	build_bvh();
+}
+
+
+/*
+ * Refines the mesh and evaluates its bicubic patches and bounds.
+ */
+void SubdivisionSurface::evaluate_patches() {
 	using namespace OpenSubdiv;
 	constexpr int maxIsolation = 5; // Max depth of refinement of the subdiv mesh
 
@@ -256,9 +462,6 @@ void SubdivisionSurface::finalize() {
 		bb.max = max(bb.max, v);
 	}
 	bbox.emplace_back(bb);
-
-	// Build bvh of patches
-	build_bvh();
 }
 
 
@@ -289,10 +492,19 @@ void SubdivisionSurface::build_bvh() {
 		bvh_nodes.emplace_back(node);
 	}
 
-	// Recursively build bvh from leaf nodes
-	depth = 1;
+	// Recursively build bvh from leaf nodes.  The inner nodes and their
+	// bounds go after the leaves, in slots that are allocated up front so
+	// that subtrees can be built in parallel.
+	if (patches.empty())
+		return;
+	const size_t leaf_count = bvh_nodes.size();
+	const size_t leaf_bbox_count = bvh_bboxes.size();
+	bvh_nodes.resize((leaf_count * 2) - 1);
+	bvh_bboxes.resize(leaf_bbox_count + ((leaf_count - 1) * bvh_nodes[0].bounds.size()));
 	max_depth = 1;
-	bvh_root = build_bvh_recursive(&(*bvh_nodes.begin()), &(*bvh_nodes.end()));
+	bvh_root = build_bvh_recursive(&bvh_nodes[0], &bvh_nodes[0] + leaf_count, leaf_count, leaf_bbox_count, 1, &max_depth, Config::build_threads);
+
+	bvh_built_sah_cost = bvh_sah_cost();
 
 	// Max sure max_depth isn't too large
 	if (max_depth >= (DEPTH_LIMIT - 1)) {
@@ -301,54 +513,115 @@ void SubdivisionSurface::build_bvh() {
 	}
 }
 
-SubdivisionSurface::Node* SubdivisionSurface::build_bvh_recursive(SubdivisionSurface::Node* begin, SubdivisionSurface::Node* end) {
-	max_depth = std::max(depth, max_depth);
+/*
+ * Updates the bounds of the BVH for the current patches, keeping its
+ * structure.  Returns false if its SAH cost has grown by more than
+ * Config::refit_threshold times its cost when it was built.
+ */
+bool SubdivisionSurface::refit_bvh() {
+	// The leaves come first, and then the inner nodes with children
+	// after their parents, so going backwards updates the children first
+	const size_t leaf_count = patches.size();
+	for (size_t i = 0; i < leaf_count; ++i) {
+		const auto& patch_bounds = bvh_nodes[i].leaf_data->bounds();
+		std::copy(patch_bounds.begin(), patch_bounds.end(), bvh_nodes[i].bounds.begin());
+	}
+	for (size_t i = bvh_nodes.size(); i-- > leaf_count;) {
+		auto& node = bvh_nodes[i];
+		for (int t = 0; t < node.bounds.size(); ++t)
+			node.bounds[t] = node.children[0]->bounds[t] | node.children[1]->bounds[t];
+	}
+
+	return bvh_sah_cost() <= (bvh_built_sah_cost * Config::refit_threshold);
+}
+
+
+/*
+ * Returns the SAH cost of the BVH: the sum of the surface areas of all
+ * nodes below the root, relative to the root's, and averaged over their
+ * time samples.
+ */
+float SubdivisionSurface::bvh_sah_cost() const {
+	const auto average_area = [](const Range<BBox*>& bbs) {
+		float area = 0.0f;
+		for (const auto& bb: bbs)
+			area += bb.surface_area() / bbs.size();
+		return area;
+	};
+
+	float sum = 0.0f;
+	for (const auto& node: bvh_nodes) {
+		if (&node != bvh_root)
+			sum += average_area(node.bounds);
+	}
+
+	const float root_area = average_area(bvh_root->bounds);
+	return (root_area > 0.0f) ? (sum / root_area) : 0.0f;
+}
+
+
+/*
+ * Recursively builds the BVH over the leaf nodes in [begin, end), returning
+ * the root of the subtree.
+ *
+ * A subtree of k leaves has exactly k-1 inner nodes, so their slots are
+ * known ahead of time: the inner nodes are laid out depth-first starting at
+ * bvh_nodes[node_i], and their bounds are laid out with each node's bounds
+ * after its children's, starting at bvh_bboxes[bbox_i].  That lets the two
+ * children be built on separate threads, with the same result as building
+ * them one after the other.
+ *
+ * The maximum depth reached is merged into *max_depth_out.
+ */
+SubdivisionSurface::Node* SubdivisionSurface::build_bvh_recursive(SubdivisionSurface::Node* begin, SubdivisionSurface::Node* end, size_t node_i, size_t bbox_i, int depth, int* max_depth_out, size_t threads) {
+	*max_depth_out = std::max(depth, *max_depth_out);
 
 	if (begin+1 == end) {
 		// LEAF
 		return begin;
 	} else {
-		// Get bounds of the given leaf nodes' centroids.
-		BBox center_bounds;
-		for (auto node_itr = begin; node_itr < end; ++node_itr) {
-			center_bounds = center_bounds | node_itr->bounds[0].center();
-		}
-		const Vec3 extent = center_bounds.max - center_bounds.min;
-
-		// Find which axis to split the leaf nodes on
-		int max_axis = 0;
-		if (extent.y > extent.x)
-			max_axis = 1;
-		if (extent.z > extent.y)
-			max_axis = 2;
+		const size_t time_samples = begin->bounds.size();
 
 		// Partition the leaf nodes
-		const float pmid = (center_bounds.min[max_axis] + center_bounds.max[max_axis]) * 0.5f;
-		auto mid_itr = std::partition(begin, end, [max_axis, pmid](const SubdivisionSurface::Node& bn) {
-			return bn.bounds[0].center()[max_axis] < pmid;
-		});
-
-		if (mid_itr == begin)
-			++mid_itr;
-
-		// Create new node
-		bvh_nodes.emplace_back(SubdivisionSurface::Node());
-		auto& node = bvh_nodes.back();
+		auto mid_itr = BinnedSAH::split(begin, end, time_samples,
+		[](const SubdivisionSurface::Node & bn) {
+			return bn.bounds[0].center();
+		},
+		[](const SubdivisionSurface::Node & bn, size_t t) {
+			return bn.bounds[t];
+		}, threads);
+
+		// Slots of the children's inner nodes and bounds
+		const size_t inner_count_0 = std::distance(begin, mid_itr) - 1;
+		const size_t inner_count_1 = std::distance(mid_itr, end) - 1;
+		const size_t node_i_0 = node_i + 1;
+		const size_t node_i_1 = node_i_0 + inner_count_0;
+		const size_t bbox_i_0 = bbox_i;
+		const size_t bbox_i_1 = bbox_i_0 + (inner_count_0 * time_samples);
+		const size_t first_bbox_i = bbox_i_1 + (inner_count_1 * time_samples);
 
 		// Populate new node, further recursively building in the process
-		++depth;
-		node.children[0] = build_bvh_recursive(begin, mid_itr);
-		node.children[1] = build_bvh_recursive(mid_itr, end);
+		auto& node = bvh_nodes[node_i];
+		if (threads > 1 && std::distance(begin, end) >= static_cast<ptrdiff_t>(PARALLEL_BUILD_MIN)) {
+			int max_depth_1 = depth + 1;
+			std::thread thread([&]() {
+				node.children[1] = build_bvh_recursive(mid_itr, end, node_i_1, bbox_i_1, depth + 1, &max_depth_1, threads / 2);
+			});
+			node.children[0] = build_bvh_recursive(begin, mid_itr, node_i_0, bbox_i_0, depth + 1, max_depth_out, threads - (threads / 2));
+			thread.join();
+			*max_depth_out = std::max(max_depth_1, *max_depth_out);
+		} else {
+			node.children[0] = build_bvh_recursive(begin, mid_itr, node_i_0, bbox_i_0, depth + 1, max_depth_out, threads);
+			node.children[1] = build_bvh_recursive(mid_itr, end, node_i_1, bbox_i_1, depth + 1, max_depth_out, threads);
+		}
 		node.leaf_data = nullptr;
-		--depth;
 
 		// Calculate bounds of the node
-		const int first_bbox_i = bvh_bboxes.size();
-		for (int i = 0; i < node.children[0]->bounds.size(); ++i) {
-			bvh_bboxes.emplace_back(node.children[0]->bounds[i] | node.children[1]->bounds[i]);
+		for (size_t i = 0; i < time_samples; ++i) {
+			bvh_bboxes[first_bbox_i + i] = node.children[0]->bounds[i] | node.children[1]->bounds[i];
 		}
-		node.bounds = Range<BBox*>(&bvh_bboxes[first_bbox_i], &(*bvh_bboxes.end()));
+		node.bounds = Range<BBox*>(&bvh_bboxes[first_bbox_i], &bvh_bboxes[first_bbox_i] + time_samples);
 
 		return &node;
 	}
-}
\ No newline at end of file
+}
@@ -6,6 +6,7 @@
 #include "object.hpp"
 #include "intersection.hpp"
 #include "ray.hpp"
+#include "ray_stream.hpp"
 #include "stack.hpp"
 #include "vector.hpp"
 #include "bbox.hpp"
@@ -19,8 +20,14 @@ class SubdivisionSurface final: public ComplexSurface {
 		Bicubic* leaf_data;
 	};
 
+	void evaluate_patches();
 	void build_bvh();
-	Node* build_bvh_recursive(Node* begin, Node* end);
+	Node* build_bvh_recursive(Node* begin, Node* end, size_t node_i, size_t bbox_i, int depth, int* max_depth_out, size_t threads);
+	bool refit_bvh();
+	float bvh_sah_cost() const;
+	uint64_t cache_key() const;
+	bool load_cache(uint64_t key);
+	void save_cache(uint64_t key) const;
 
 public:
 	// Final data
@@ -30,9 +37,9 @@ public:
 	std::vector<BBox> bvh_bboxes;
 	Node* bvh_root;
 	int max_depth;
+	float bvh_built_sah_cost = 0.0f; // bvh_sah_cost() when the BVH was built, for deciding when to rebuild instead of refit
 
 	// Intermediate data
-	int depth;
 	int motion_samples = 0;
 	int verts_per_motion_sample = 0;
 	std::vector<Vec3> verts;
@@ -53,6 +60,7 @@ public:
 		face_vert_indices = std::move(vert_indices);
 	}
 	void finalize();
+	void finalize_from(Object* previous) override;
 
 	virtual const std::vector<BBox> &bounds() const override {
 		return bbox;
@@ -62,9 +70,8 @@ public:
 		return Color(0.0f);
 	}
 
-	virtual void intersect_rays(Ray* rays_begin, Ray* rays_end,
-	                            Intersection *intersections,
-	                            const Range<const Transform*> parent_xforms,
+	virtual void intersect_rays(RayStream* rays, size_t rays_begin, size_t rays_end,
+	                            HitRecord *hits,
 	                            Stack* data_stack,
 	                            const SurfaceShader* surface_shader,
 	                            const InstanceID& element_id) const override;
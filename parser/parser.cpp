@@ -27,6 +27,7 @@
 
 static std::regex re_int("-?[0-9]+");
 static std::regex re_float("-?[0-9]+[.]?[0-9]*");
+static std::regex re_word("[A-Za-z]+");
 
 static std::regex re_quote("\"");
 static std::regex re_qstring("\".*\"");
@@ -295,12 +296,26 @@ std::unique_ptr<Assembly> Parser::parse_assembly(const DataTree::Node& node, con
 			assembly->add_object(child.name, parse_rectangle_light(child));
 		}
 
+		// BVH width
+		else if (child.type == "BVHWidth") {
+			std::sregex_iterator matches(child.leaf_contents.begin(), child.leaf_contents.end(), re_int);
+			if (matches != std::sregex_iterator()) {
+				const int width = std::stoi(matches->str());
+				if (width == 4 || width == 8) {
+					assembly->accel_width = width;
+				} else {
+					std::cout << "WARNING: unsupported BVH width " << width << ", ignoring." << std::endl;
+				}
+			}
+		}
+
 		// Instance
 		else if (child.type == "Instance") {
 			// Parse
 			std::string name = "";
 			std::vector<Transform> xforms;
 			const SurfaceShader *shader = nullptr;
+			uint8_t visibility = Ray::VISIBLE_TO_ALL;
 			for (const auto& child2: child.children) {
 				if (child2.type == "Transform") {
 					xforms.emplace_back(parse_matrix(child2.leaf_contents));
@@ -311,14 +326,31 @@ std::unique_ptr<Assembly> Parser::parse_assembly(const DataTree::Node& node, con
 					if (shader == nullptr) {
 						std::cout << "ERROR: attempted to bind surface shader that doesn't exist." << std::endl;
 					}
+				} else if (child2.type == "Visibility") {
+					// The classes of rays that can see the instance
+					visibility = 0;
+					for (std::sregex_iterator matches(child2.leaf_contents.begin(), child2.leaf_contents.end(), re_word); matches != std::sregex_iterator(); ++matches) {
+						const std::string ray_class = matches->str();
+						if (ray_class == "camera") {
+							visibility |= 1 << Ray::CAMERA_VISIBILITY;
+						} else if (ray_class == "diffuse") {
+							visibility |= 1 << Ray::DIFFUSE_VISIBILITY;
+						} else if (ray_class == "specular") {
+							visibility |= 1 << Ray::SPECULAR_VISIBILITY;
+						} else if (ray_class == "shadow") {
+							visibility |= 1 << Ray::SHADOW_VISIBILITY;
+						} else {
+							std::cout << "WARNING: unknown ray visibility class '" << ray_class << "', ignoring." << std::endl;
+						}
+					}
 				}
 			}
 
 			// Add instance
 			if (assembly->object_map.count(name) != 0) {
-				assembly->create_object_instance(name, xforms, shader);
+				assembly->create_object_instance(name, xforms, shader, visibility);
 			} else if (assembly->assembly_map.count(name) != 0) {
-				assembly->create_assembly_instance(name, xforms, shader);
+				assembly->create_assembly_instance(name, xforms, shader, visibility);
 			} else {
 				std::cout << "ERROR: attempted to add instace for data that doesn't exist." << std::endl;
 			}
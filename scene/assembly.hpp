@@ -4,7 +4,10 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <utility>
+#include <algorithm>
 #include <memory>
+#include <iostream>
 
 #include "numtype.h"
 #include "global.hpp"
@@ -14,6 +17,8 @@
 #include "bvh.hpp"
 #include "bvh2.hpp"
 #include "bvh4.hpp"
+#include "bvh8.hpp"
+#include "config.hpp"
 #include "light_array.hpp"
 #include "light_tree.hpp"
 #include "surface_shader.hpp"
@@ -38,6 +43,10 @@ struct Instance {
 
 	const SurfaceShader *surface_shader;
 
+	uint8_t visibility; // Mask of the ray visibility classes that can see the instance, see Ray::VisibilityClass
+
+	size_t bucket_index; // Index of the instance's first pre-interpolated transform in the assembly's xform_buckets, if it has any
+
 	std::string to_string() const {
 		std::string s;
 		s.append("Type: ");
@@ -58,6 +67,8 @@ struct Instance {
 		s.append(std::to_string(transform_index));
 		s.append("\nTransform Count: ");
 		s.append(std::to_string(transform_count));
+		s.append("\nVisibility: ");
+		s.append(std::to_string(visibility));
 		s.append("\n");
 
 		return s;
@@ -79,6 +90,11 @@ public:
 	std::vector<Instance> instances;
 	std::vector<Transform> xforms;
 
+	// The transforms of motion blurred instances, pre-interpolated at the
+	// times of Config::transform_time_buckets time buckets, so that rays
+	// can share them.  Built by finalize(), see trace_xforms().
+	std::vector<Transform> xform_buckets;
+
 	// Object list
 	std::vector<std::unique_ptr<Object>> objects;
 	std::unordered_map<std::string, size_t> object_map; // map Name -> Index
@@ -91,8 +107,11 @@ public:
 	std::vector<std::unique_ptr<SurfaceShader>> surface_shaders;
 	std::unordered_map<std::string, size_t> surface_shader_map; // map Name -> Index
 
-	// Object accel
+	// Object accel.  Only one of these is built, see accel_width.
+	int accel_width = 0; // 4 or 8 for a BVH4 or BVH8, or 0 to use Config::bvh_width
+	int trav_stack_bits = 0; // The most bits traversing the object accel, and those of nested assemblies, can leave on a ray's traversal stack
 	BVH4 object_accel;
+	BVH8 object_accel_8;
 
 	// Light accel
 	LightTree light_accel;
@@ -160,10 +179,13 @@ public:
 
 	/**
 	 * Creates an instance of an already added object.
+	 *
+	 * visibility is the mask of the ray visibility classes that can see
+	 * the instance (see Ray::VisibilityClass).
 	 */
-	bool create_object_instance(const std::string& name, const std::vector<Transform>& transforms, const SurfaceShader *surface_shader = nullptr) {
+	bool create_object_instance(const std::string& name, const std::vector<Transform>& transforms, const SurfaceShader *surface_shader = nullptr, uint8_t visibility = Ray::VISIBLE_TO_ALL) {
 		// Add the instance
-		instances.emplace_back(Instance {Instance::OBJECT, object_map[name], xforms.size(), transforms.size(), surface_shader});
+		instances.emplace_back(Instance {Instance::OBJECT, object_map[name], xforms.size(), transforms.size(), surface_shader, visibility, 0});
 
 		// Add transforms
 		for (const auto& trans: transforms) {
@@ -176,10 +198,13 @@ public:
 
 	/**
 	 * Creates an instance of an already added assembly.
+	 *
+	 * visibility is the mask of the ray visibility classes that can see
+	 * the instance (see Ray::VisibilityClass).
 	 */
-	bool create_assembly_instance(const std::string& name, const std::vector<Transform>& transforms, const SurfaceShader *surface_shader = nullptr) {
+	bool create_assembly_instance(const std::string& name, const std::vector<Transform>& transforms, const SurfaceShader *surface_shader = nullptr, uint8_t visibility = Ray::VISIBLE_TO_ALL) {
 		// Add the instance
-		instances.emplace_back(Instance {Instance::ASSEMBLY, assembly_map[name], xforms.size(), transforms.size(), surface_shader});
+		instances.emplace_back(Instance {Instance::ASSEMBLY, assembly_map[name], xforms.size(), transforms.size(), surface_shader, visibility, 0});
 
 		// Add transforms
 		for (const auto& trans: transforms) {
@@ -202,14 +227,27 @@ public:
 
 	/**
 	 * Prepares the assembly to be used for rendering.
+	 *
+	 * If given the same assembly from the previous frame of an animation,
+	 * its acceleration structures (and those of its sub-assemblies and
+	 * objects, matched by index) are refit to this frame where their
+	 * structure still fits, instead of rebuilt.  See
+	 * Config::refit_threshold.  The previous assembly may be left
+	 * unusable.
 	 */
-	bool finalize() {
+	bool finalize(Assembly* previous = nullptr) {
 		// Finalize all sub-assemblies and objects
-		for (auto& ass: assemblies) {
-			ass->finalize();
+		for (size_t i = 0; i < assemblies.size(); ++i) {
+			if (previous != nullptr && i < previous->assemblies.size())
+				assemblies[i]->finalize(previous->assemblies[i].get());
+			else
+				assemblies[i]->finalize();
 		}
-		for (auto& obj: objects) {
-			obj->finalize();
+		for (size_t i = 0; i < objects.size(); ++i) {
+			if (previous != nullptr && i < previous->objects.size())
+				objects[i]->finalize_from(previous->objects[i].get());
+			else
+				objects[i]->finalize();
 		}
 
 		// Clear maps (no longer needed).
@@ -228,16 +266,133 @@ public:
 		assemblies.shrink_to_fit();
 		assembly_map.rehash(0);
 
-		// Build object accel
-		object_accel.build(*this);
+		// Pre-interpolate the transforms of motion blurred instances.  The
+		// accels are built from the instance bounds, which depend on them.
+		bucket_xforms();
+
+		// Build object accel.  Only BVH4 traversal culls instances by ray
+		// visibility, so a BVH8 is only used if they're all fully visible.
+		if (accel_width == 0)
+			accel_width = Config::bvh_width;
+		if (accel_width == 8 && has_visibility_masks()) {
+			std::cout << "WARNING: BVH8 doesn't support instance visibility, using a BVH4 instead." << std::endl;
+			accel_width = 4;
+		}
+
+		// The traversals of nested assemblies push onto the same traversal
+		// stacks as this one's, which limits how deep a BVH8 can be.  They're
+		// finalized first, so their needs are known.
+		int nested_bits = 0;
+		for (const auto& instance: instances) {
+			if (instance.type == Instance::ASSEMBLY)
+				nested_bits = std::max(nested_bits, assemblies[instance.data_index]->trav_stack_bits);
+		}
+		if (accel_width == 8) {
+			object_accel_8.build(*this);
+			if (object_accel_8.trav_stack_bits(nested_bits) > RayStream::TRAV_STACK_BITS) {
+				std::cout << "WARNING: BVH8 is too deep to traverse (" << object_accel_8.depth() << " levels, nested assemblies need " << nested_bits << " traversal stack bits), using a BVH4 instead." << std::endl;
+				object_accel_8 = BVH8();
+				accel_width = 4;
+			}
+		} else {
+			accel_width = 4;
+		}
+		// The previous frame's accels can only be refit if the instances
+		// are the same (their visibility doesn't affect the structure)
+		bool refit = previous != nullptr && previous->instances.size() == instances.size();
+		for (size_t i = 0; refit && i < instances.size(); ++i)
+			refit = instances[i].type == previous->instances[i].type && instances[i].data_index == previous->instances[i].data_index;
+
+		if (accel_width == 4) {
+			if (refit && previous->accel_width == 4) {
+				object_accel = std::move(previous->object_accel);
+				if (!object_accel.refit(*this)) {
+					object_accel = BVH4();
+					object_accel.build(*this);
+				}
+			} else {
+				object_accel.build(*this);
+			}
+		}
+		trav_stack_bits = (accel_width == 8) ? object_accel_8.trav_stack_bits(nested_bits) : object_accel.trav_stack_bits(nested_bits);
+
+		// The accel always fits on the rays' traversal stacks by itself
+		// (BVH4::build() makes sure of that), but together with nested
+		// assemblies it may not.  Then the bits of the outer traversals
+		// are pushed off of the stacks, and some hits may be missed.
+		// Only warn at the level where the limit is first exceeded.
+		if (trav_stack_bits > RayStream::TRAV_STACK_BITS && nested_bits <= RayStream::TRAV_STACK_BITS)
+			std::cout << "WARNING: assemblies nested in this one are too deep to traverse together with it (" << trav_stack_bits << " traversal stack bits), some hits may be missed." << std::endl;
 
 		// Build light accel
-		light_accel.build(*this);
+		if (refit) {
+			light_accel = std::move(previous->light_accel);
+			if (!light_accel.refit(*this)) {
+				light_accel = LightTree();
+				light_accel.build(*this);
+			}
+		} else {
+			light_accel.build(*this);
+		}
 
 		return true;
 	}
 
 
+	/**
+	 * Fills in xform_buckets with the transforms of the motion blurred
+	 * instances interpolated at the times of Config::transform_time_buckets
+	 * time buckets, or leaves it empty if that's zero.
+	 */
+	void bucket_xforms() {
+		const size_t buckets = Config::transform_time_buckets;
+		xform_buckets.clear();
+		if (buckets > 0) {
+			for (auto& instance: instances) {
+				if (instance.transform_count > 1) {
+					const Transform* xbegin = &xforms[instance.transform_index];
+					instance.bucket_index = xform_buckets.size();
+					xform_buckets.resize(xform_buckets.size() + buckets + 1);
+					bucket_transforms(&xform_buckets[instance.bucket_index], xbegin, xbegin + instance.transform_count, buckets);
+				}
+			}
+		}
+		xform_buckets.shrink_to_fit();
+	}
+
+
+	/**
+	 * Returns the transform time samples that rays are traced through for
+	 * an instance.
+	 *
+	 * Those are the instance's transforms, except for motion blurred
+	 * instances when Config::transform_time_buckets is set.  Then they're
+	 * its pre-interpolated time buckets, and rays use the bucket nearest
+	 * their time instead of interpolating (see time_bucket()).
+	 */
+	std::pair<const Transform*, const Transform*> trace_xforms(size_t index) const {
+		const auto& instance = instances[index];
+		if (instance.transform_count > 1 && !xform_buckets.empty()) {
+			const Transform* begin = &xform_buckets[instance.bucket_index];
+			return std::make_pair(begin, begin + Config::transform_time_buckets + 1);
+		} else {
+			const Transform* begin = xforms.data() + instance.transform_index;
+			return std::make_pair(begin, begin + instance.transform_count);
+		}
+	}
+
+
+	/**
+	 * Returns the bounds of the object accel.
+	 */
+	const std::vector<BBox>& accel_bounds() const {
+		if (accel_width == 8)
+			return object_accel_8.bounds();
+		else
+			return object_accel.bounds();
+	}
+
+
 	/**
 	 * Returns the number of bits needed to give each scene
 	 * element in the assembly a unique integer id.
@@ -254,6 +409,19 @@ public:
 	}
 
 
+	/**
+	 * Returns whether any instance in the assembly is invisible to some
+	 * class of rays.
+	 */
+	bool has_visibility_masks() const {
+		for (const auto& instance: instances) {
+			if (instance.visibility != Ray::VISIBLE_TO_ALL)
+				return true;
+		}
+		return false;
+	}
+
+
 	/**
 	 * Calculates and returns the proper transformed bounding boxes of an
 	 * instance.
@@ -269,7 +437,7 @@ public:
 			}
 		} else { /* Instance::ASSEMBLY */
 			auto asmb = assemblies[instances[index].data_index].get();
-			bbs = asmb->object_accel.bounds();
+			bbs = asmb->accel_bounds();
 		}
 
 		// Transform the bounding boxes
@@ -277,6 +445,12 @@ public:
 		auto xend = xstart + instances[index].transform_count;
 		bbs = transform_from(bbs, xstart, xend);
 
+		// Rays see motion blurred instances at the nearest time bucket when
+		// bucketing (see trace_xforms()), up to half a bucket away from the
+		// ray's time
+		if (instances[index].transform_count > 1)
+			bbs = bucket_bounds(bbs, Config::transform_time_buckets);
+
 		return bbs;
 	}
 
@@ -294,7 +468,7 @@ public:
 			bb = lerp_seq(t, objects[instances[index].data_index]->bounds());
 		} else { /* Instance::ASSEMBLY */
 			// Get BBox at time t
-			const auto& bbs = assemblies[instances[index].data_index]->object_accel.bounds();
+			const auto& bbs = assemblies[instances[index].data_index]->accel_bounds();
 			auto begin = bbs.begin();
 			auto end = bbs.end();
 			bb = lerp_seq(t, begin, end);
@@ -46,9 +46,11 @@ struct Scene {
 	}
 
 
-	// Finalizes the scene for rendering
-	void finalize() {
-		root->finalize();
+	// Finalizes the scene for rendering.  If given the previous frame's
+	// scene, data that hasn't changed structure is refit from it instead
+	// of rebuilt, which may leave the previous scene unusable.
+	void finalize(Scene* previous = nullptr) {
+		root->finalize(previous ? previous->root.get() : nullptr);
 	}
 };
 
@@ -0,0 +1,122 @@
+#include "ray_reorder.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <assert.h>
+
+#include "numtype.h"
+#include "counting_sort.hpp"
+#include "morton.hpp"
+#include "vector.hpp"
+
+
+namespace RayReorder {
+
+namespace {
+
+struct RaySortItem {
+	uint64_t key;
+	uint32_t octant;
+	uint32_t index;
+};
+
+inline uint32_t octant_of(const Vec3& d) {
+	return ((d.x > 0.0f) ? 0 : 4) | ((d.y > 0.0f) ? 0 : 2) | ((d.z > 0.0f) ? 0 : 1);
+}
+
+// Maps x in [0, 1] to an integer in [0, max]
+inline uint32_t quantize(float x, uint32_t max) {
+	const float q = x * max;
+	return q <= 0.0f ? 0 : (q >= max ? max : static_cast<uint32_t>(q));
+}
+
+}
+
+
+std::array<size_t, 9> reorder(RayStream* rays, Mode mode) {
+	RayStream& rs = *rays;
+	const size_t ray_count = rs.size();
+
+	if (ray_count == 0) {
+		std::array<size_t, 9> octants;
+		octants.fill(0);
+		return octants;
+	}
+
+	// Build sort items and count the rays in each octant
+	std::vector<RaySortItem> items(ray_count);
+	std::array<size_t, 8> octant_counts {{0, 0, 0, 0, 0, 0, 0, 0}};
+	for (size_t i = 0; i < ray_count; ++i) {
+		assert(rs.id(i) == i);
+		items[i].key = 0;
+		items[i].octant = octant_of(rs.d[i]);
+		items[i].index = i;
+		++octant_counts[items[i].octant];
+	}
+
+	// Octant start positions
+	std::array<size_t, 9> octants;
+	octants[0] = 0;
+	for (int i = 0; i < 8; ++i)
+		octants[i+1] = octants[i] + octant_counts[i];
+
+	// Morton keys
+	if (mode == OCTANT_MORTON) {
+		// Find the bounds of the points we're going to sort by: the
+		// origins of normal rays and the end points of shadow rays
+		auto sort_point = [&rs](size_t i) {
+			return rs.is_occlusion(i) ? (rs.o[i] + rs.d[i]) : rs.o[i];
+		};
+		Vec3 bmin = sort_point(0);
+		Vec3 bmax = bmin;
+		for (size_t i = 1; i < ray_count; ++i) {
+			const Vec3 p = sort_point(i);
+			bmin = min(bmin, p);
+			bmax = max(bmax, p);
+		}
+		Vec3 inv_extent = bmax - bmin;
+		for (int i = 0; i < 3; ++i)
+			inv_extent[i] = inv_extent[i] > 0.0f ? (1.0f / inv_extent[i]) : 0.0f;
+
+		for (size_t i = 0; i < ray_count; ++i) {
+			const bool occlusion = rs.is_occlusion(i);
+			const Vec3 p = sort_point(i) - bmin;
+			const uint32_t p_code = Morton::xyz2d(quantize(p.x * inv_extent.x, 1023),
+			                                      quantize(p.y * inv_extent.y, 1023),
+			                                      quantize(p.z * inv_extent.z, 1023));
+
+			// Direction within the octant, projected onto the octahedron
+			const Vec3& d = rs.d[i];
+			const float d_sum = std::abs(d.x) + std::abs(d.y) + std::abs(d.z);
+			const uint32_t d_code = Morton::xy2d(quantize(std::abs(d.x) / d_sum, 255),
+			                                     quantize(std::abs(d.y) / d_sum, 255));
+
+			items[i].key = (static_cast<uint64_t>(occlusion) << 62) | (static_cast<uint64_t>(p_code) << 16) | d_code;
+		}
+	}
+
+	// Bucket the rays by octant
+	CountingSort::sort(&items[0], ray_count, 8, [](const RaySortItem & item) {
+		return static_cast<size_t>(item.octant);
+	});
+
+	// Sort within each octant
+	if (mode == OCTANT_MORTON) {
+		for (int i = 0; i < 8; ++i) {
+			std::sort(items.begin() + octants[i], items.begin() + octants[i+1], [](const RaySortItem & a, const RaySortItem & b) {
+				return a.key < b.key;
+			});
+		}
+	}
+
+	// Apply the new order
+	std::vector<uint32_t> order(ray_count);
+	for (size_t i = 0; i < ray_count; ++i)
+		order[i] = items[i].index;
+	rs.permute(order);
+
+	return octants;
+}
+
+}
@@ -0,0 +1,56 @@
+/*
+ * This file and ray_reorder.cpp define the ray reordering stage that the
+ * Tracer runs on a batch of rays before traversing the scene with them.
+ */
+#ifndef RAY_REORDER_HPP
+#define RAY_REORDER_HPP
+
+#include <array>
+
+#include "numtype.h"
+
+#include "ray_stream.hpp"
+
+
+namespace RayReorder {
+
+/**
+ * @brief The available ray reordering strategies.
+ */
+enum Mode: int {
+	// Only group rays by direction octant
+	OCTANT = 0,
+
+	// Group rays by direction octant, and then sort each octant by a
+	// Morton code of ray origin and quantized direction.  Shadow rays are
+	// sorted after the other rays of their octant, and by their end point
+	// rather than their origin, which groups them by the light they're
+	// aimed at.
+	OCTANT_MORTON = 1,
+
+	MODE_COUNT
+};
+
+
+/**
+ * @brief Reorders a RayStream in preparation for tracing.
+ *
+ * Octants are numbered by the signs of the ray direction's components,
+ * with bit 2 being set for x <= 0, bit 1 for y <= 0, and bit 0 for z <= 0.
+ * So octant 0 is (+X +Y +Z) and octant 7 is (-X -Y -Z).
+ *
+ * All rays must be freshly initialized, i.e. with each ray's position
+ * equal to its id.
+ *
+ * @param rays The rays to reorder.
+ * @param mode The reordering strategy to use.
+ *
+ * @returns The start position of each octant, plus the end of the last
+ *          octant at index 8.  Octant n spans positions
+ *          [octants[n], octants[n+1]).
+ */
+std::array<size_t, 9> reorder(RayStream* rays, Mode mode);
+
+}
+
+#endif // RAY_REORDER_HPP
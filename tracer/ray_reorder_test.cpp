@@ -0,0 +1,90 @@
+#include "test.hpp"
+
+#include <vector>
+#include "vector.hpp"
+#include "ray.hpp"
+#include "ray_stream.hpp"
+#include "ray_reorder.hpp"
+
+
+/*
+ ************************************************************************
+ * Testing suite for RayReorder.
+ ************************************************************************
+ */
+
+static std::vector<WorldRay> make_world_rays(size_t count) {
+	std::vector<WorldRay> w_rays(count);
+	for (size_t i = 0; i < count; ++i) {
+		// Cycle through all octants, with scattered origins
+		const float sx = (i & 4) ? -1.0f : 1.0f;
+		const float sy = (i & 2) ? -1.0f : 1.0f;
+		const float sz = (i & 1) ? -1.0f : 1.0f;
+
+		WorldRay& wr = w_rays[i];
+		wr.o = Vec3((i * 7) % 13, (i * 5) % 11, (i * 3) % 17);
+		wr.d = Vec3(sx * (1.0f + (i % 3)), sy, sz * (1.0f + (i % 5)));
+		wr.odx = Vec3(0.0f, 0.0f, 0.0f);
+		wr.ody = Vec3(0.0f, 0.0f, 0.0f);
+		wr.ddx = Vec3(0.0f, 0.0f, 0.0f);
+		wr.ddy = Vec3(0.0f, 0.0f, 0.0f);
+		wr.time = 0.0f;
+		wr.type = (i % 4) == 0 ? WorldRay::OCCLUSION : WorldRay::CAMERA;
+	}
+	return w_rays;
+}
+
+static void check_reorder(RayReorder::Mode mode, bool indexed) {
+	const size_t count = 200;
+	const auto w_rays = make_world_rays(count);
+
+	RayStream rays;
+	rays.set_indexed(indexed);
+	rays.resize(count);
+	for (size_t i = 0; i < count; ++i)
+		rays.init_ray(i, w_rays[i]);
+
+	const auto octants = RayReorder::reorder(&rays, mode);
+
+	REQUIRE(octants[0] == 0);
+	REQUIRE(octants[8] == count);
+
+	std::vector<bool> seen(count, false);
+	for (int oct = 0; oct < 8; ++oct) {
+		REQUIRE(octants[oct] <= octants[oct+1]);
+
+		bool in_occlusion = false;
+		for (size_t i = octants[oct]; i < octants[oct+1]; ++i) {
+			const uint32_t id = rays.id(i);
+			REQUIRE(!seen[id]);
+			seen[id] = true;
+
+			// Every ray is in its octant
+			REQUIRE((id % 8) == oct);
+
+			// Ray data moves with the ray
+			REQUIRE(rays.gather(i).o == w_rays[id].o);
+			REQUIRE(rays.is_occlusion(i) == (w_rays[id].type == WorldRay::OCCLUSION));
+
+			// Shadow rays come after the other rays of an octant
+			if (mode == RayReorder::OCTANT_MORTON) {
+				REQUIRE((!in_occlusion || rays.is_occlusion(i)));
+				in_occlusion = rays.is_occlusion(i);
+			}
+		}
+	}
+}
+
+TEST_CASE("ray_reorder") {
+	SECTION("octant") {
+		check_reorder(RayReorder::OCTANT, false);
+	}
+
+	SECTION("octant_morton") {
+		check_reorder(RayReorder::OCTANT_MORTON, false);
+	}
+
+	SECTION("octant_morton_indexed") {
+		check_reorder(RayReorder::OCTANT_MORTON, true);
+	}
+}
@@ -1,6 +1,7 @@
 #include "patch_utils.hpp"
 
 #include "tracer.hpp"
+#include "ray_reorder.hpp"
 
 #include <iostream>
 #include <limits>
@@ -10,9 +11,12 @@
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <thread>
 #include <assert.h>
 
 #include "global.hpp"
+#include "config.hpp"
+#include "cpu_dispatch.hpp"
 #include "counting_sort.hpp"
 #include "utils.hpp"
 #include "range.hpp"
@@ -29,136 +33,333 @@
 #include "bvh.hpp"
 #include "bvh2.hpp"
 #include "bvh4.hpp"
+#include "bvh8.hpp"
 
 #include "surface_closure.hpp"
 #include "closure_union.hpp"
 
 
 
-uint32_t Tracer::trace(const WorldRay* w_rays_begin, const WorldRay* w_rays_end, Intersection* intersections_begin, Intersection* intersections_end) {
-	// Clear ID
-	element_id.clear();
+// Shader for surfaces that don't have one
+static const EmitShader missing_shader(Color(1.0, 0.0, 1.0));
+
+
+// Returns the shader to use for surfaces at the current point of traversal
+static inline const SurfaceShader* current_shader(const TraceContext* ctx) {
+	const SurfaceShader* shader = ctx->surface_shader_stack.back();
+	return shader != nullptr ? shader : &missing_shader;
+}
+
+
+// Returns the transform of a ray at the given time, from the transform time
+// samples [xbegin, xend) of the space it's in.  When instance transforms are
+// pre-interpolated into time buckets (see Assembly::trace_xforms()), the
+// samples are the buckets, and the ray uses the nearest one.
+static inline Transform xform_at(float time, const Transform* xbegin, const Transform* xend) {
+	const size_t buckets = Config::transform_time_buckets;
+	if (buckets > 0) {
+		assert(std::distance(xbegin, xend) == static_cast<ptrdiff_t>(buckets + 1));
+		return xbegin[time_bucket(time, buckets)];
+	} else {
+		return lerp_seq(time, xbegin, xend);
+	}
+}
+
+
+// The trace context of a pool thread, created on first use
+static TraceContext* pool_thread_context() {
+	thread_local TraceContext context;
+	return &context;
+}
+
+
+
+Tracer::~Tracer() {
+	// Helper jobs we pushed to the pool may still be waiting in its
+	// queue, and they reference us
+	std::unique_lock<std::mutex> lock(done_mutex);
+	done.wait(lock, [this]() {
+		return jobs_in_flight == 0;
+	});
+}
+
+
+
+uint32_t Tracer::trace(const WorldRay* w_rays_begin, const WorldRay* w_rays_end, HitRecord* hits_begin, HitRecord* hits_end) {
+	any_hit = false;
 
 	// Get rays
 	w_rays = make_range(w_rays_begin, w_rays_end);
 	Global::Stats::rays_shot += w_rays.size();
 
+	// Ray ids must fit in the id bits of the rays' flags
+	assert(w_rays.size() <= Ray::ID_MASK);
+
 	// Create initial rays
+	rays.set_indexed(Config::ray_index_partition);
 	rays.resize(w_rays.size());
 	for (size_t i = 0; i < rays.size(); ++i) {
-		rays[i] = w_rays[i].to_ray();
-		rays[i].set_id(i);
+		rays.init_ray(i, w_rays[i]);
 	}
 
-	// Get and initialize intersections
-	intersections = make_range(intersections_begin, intersections_end);
-	std::fill(intersections.begin(), intersections.end(), Intersection());
+	// Get and initialize hits
+	hits = make_range(hits_begin, hits_end);
+	std::fill(hits.begin(), hits.end(), HitRecord());
 
-	// Clear and initialize stacks
-	surface_shader_stack.clear();
-	surface_shader_stack.emplace_back(nullptr);
-	xform_stack.clear();
-	xform_stack.push_frame<Transform>(0);
-	data_stack.clear();
+	// Start tracing!
+	trace_rays();
+
+	return w_rays.size();
+}
+
+
+
+uint32_t Tracer::occluded(const WorldRay* w_rays_begin, const WorldRay* w_rays_end, uint32_t* occluded_bits) {
+	any_hit = true;
+
+	// Get rays
+	w_rays = make_range(w_rays_begin, w_rays_end);
+	Global::Stats::rays_shot += w_rays.size();
+
+	// Ray ids must fit in the id bits of the rays' flags
+	assert(w_rays.size() <= Ray::ID_MASK);
+
+	// Create initial rays
+	rays.set_indexed(Config::ray_index_partition);
+	rays.resize(w_rays.size());
+	for (size_t i = 0; i < rays.size(); ++i) {
+		rays.init_occlusion_ray(i, w_rays[i]);
+	}
+
+	// No hits to fill in
+	hits = make_range<HitRecord*>(nullptr, nullptr);
 
 	// Start tracing!
+	trace_rays();
 
-#if 1
-	// Split rays into groups based on direction signs before tracing
-	auto xsplit_4 = std::partition(rays.begin(), rays.end(), [](Ray r) {
-		return (r.d[0] > 0.0f);
-	});
+	// Occluded rays are the ones that are done
+	std::fill(occluded_bits, occluded_bits + ((rays.size() + 31) / 32), 0);
+	for (size_t i = 0; i < rays.size(); ++i) {
+		if (rays.is_done(i)) {
+			const uint32_t id = rays.id(i);
+			occluded_bits[id / 32] |= 1u << (id % 32);
+		}
+	}
 
-	auto ysplit_2 = std::partition(rays.begin(), xsplit_4, [](Ray r) {
-		return (r.d[1] > 0.0f);
-	});
-	auto ysplit_6 = std::partition(xsplit_4, rays.end(), [](Ray r) {
-		return (r.d[1] > 0.0f);
-	});
+	return w_rays.size();
+}
 
-	auto zsplit_1 = std::partition(rays.begin(), ysplit_2, [](Ray r) {
-		return (r.d[2] > 0.0f);
-	});
-	auto zsplit_3 = std::partition(ysplit_2, xsplit_4, [](Ray r) {
-		return (r.d[2] > 0.0f);
-	});
-	auto zsplit_5 = std::partition(xsplit_4, ysplit_6, [](Ray r) {
-		return (r.d[2] > 0.0f);
-	});
-	auto zsplit_7 = std::partition(ysplit_6, rays.end(), [](Ray r) {
-		return (r.d[2] > 0.0f);
+
+
+void Tracer::trace_rays() {
+	// Reorder rays for coherence, grouped by direction octant
+	const auto octants = RayReorder::reorder(&rays, static_cast<RayReorder::Mode>(Config::ray_reorder_mode));
+
+	// Split into tasks.  Each octant is traced separately: (+X +Y +Z),
+	// (+X +Y -Z), ... (-X -Y -Z).  And if we have a pool to share the work
+	// with, large octants are split further.
+	const size_t task_size = Config::trace_task_size;
+	tasks.clear();
+	for (int i = 0; i < 8; ++i) {
+		const size_t size = octants[i+1] - octants[i];
+		if (size == 0)
+			continue;
+
+		const size_t pieces = (pool != nullptr && task_size > 0) ? ((size + task_size - 1) / task_size) : 1;
+		for (size_t p = 0; p < pieces; ++p)
+			tasks.emplace_back(octants[i] + (size * p / pieces), octants[i] + (size * (p + 1) / pieces));
+	}
+
+	// Publish the tasks
+	tasks_remaining = tasks.size();
+	task_claim = static_cast<uint64_t>(tasks.size()) << 32;
+
+	// Get help from the pool, from as many threads as are waiting for work
+	if (pool != nullptr && tasks.size() > 1) {
+		const size_t helpers = std::min(tasks.size() - 1, pool->thread_count() + pool->helper_count());
+		for (size_t i = 0; i < helpers; ++i) {
+			++jobs_in_flight;
+			const bool pushed = pool->try_push([this]() {
+				run_tasks(pool_thread_context());
+				std::lock_guard<std::mutex> lock(done_mutex);
+				if (--jobs_in_flight == 0)
+					done.notify_all();
+			});
+			if (!pushed) {
+				--jobs_in_flight;
+				break;
+			}
+		}
+	}
+
+	// Do our share, and wait for the helpers to finish theirs
+	run_tasks(&context);
+	std::unique_lock<std::mutex> lock(done_mutex);
+	done.wait(lock, [this]() {
+		return tasks_remaining == 0;
 	});
+}
 
-	// +X +Y +Z
-	trace_assembly(scene->root.get(), &(*rays.begin()), &(*zsplit_1));
 
-	// +X +Y -Z
-	trace_assembly(scene->root.get(), &(*zsplit_1), &(*ysplit_2));
 
-	// +X -Y +Z
-	trace_assembly(scene->root.get(), &(*ysplit_2), &(*zsplit_3));
+void Tracer::reconstruct(const WorldRay& w_ray, const HitRecord& hit, Intersection* inter) {
+	*inter = Intersection();
+	inter->hit = true;
+	inter->id = hit.id;
 
-	// +X -Y -Z
-	trace_assembly(scene->root.get(), &(*zsplit_3), &(*xsplit_4));
+	// Walk down the instance hierarchy along the hit's id to find the
+	// space the hit took place in, merging transforms the same way
+	// trace_assembly() does
+	context.reset();
+	InstanceID id = hit.id;
+	const Assembly* assembly = scene->root.get();
+	while (true) {
+		const size_t instance_index = id.pop_front(assembly->element_id_bits());
+		const auto& instance = assembly->instances[instance_index];
 
-	// -X +Y +Z
-	trace_assembly(scene->root.get(), &(*xsplit_4), &(*zsplit_5));
+		if (instance.transform_count > 0) {
+			const auto parent_xforms = context.xform_stack.top_frame<Transform>();
+			const size_t parent_xforms_count = std::distance(parent_xforms.first, parent_xforms.second);
+			const auto instance_xforms = assembly->trace_xforms(instance_index);
+			const size_t instance_xforms_count = std::distance(instance_xforms.first, instance_xforms.second);
 
-	// -X +Y -Z
-	trace_assembly(scene->root.get(), &(*zsplit_5), &(*ysplit_6));
+			auto xforms = context.xform_stack.push_frame<Transform>(std::max(instance_xforms_count, parent_xforms_count));
+			merge(xforms.first, parent_xforms.first, parent_xforms.second, instance_xforms.first, instance_xforms.second);
+		}
+
+		if (instance.type == Instance::OBJECT)
+			break;
+		assembly = assembly->assemblies[instance.data_index].get();
+	}
 
-	// -X -Y +Z
-	trace_assembly(scene->root.get(), &(*ysplit_6), &(*zsplit_7));
+	// Get the ray in the space of the hit
+	const auto xforms = context.xform_stack.top_frame<Transform>();
+	if (xforms.first != xforms.second)
+		inter->space = xform_at(w_ray.time, xforms.first, xforms.second);
+	const Ray ray = xforms.first != xforms.second ? w_ray.to_ray(inter->space) : w_ray.to_ray();
+
+	switch (hit.object->get_type()) {
+		case Object::PATCH_SURFACE: {
+			inter->t = hit.t;
+			inter->geo.p = ray.o + (ray.d * hit.t);
+
+			// Surface normal and differential geometry
+			if (auto patch = dynamic_cast<const Bilinear*>(hit.object)) {
+				patch_differential_geometry<Bilinear>(*patch, ray.time, hit.u, hit.v, &inter->geo);
+			} else if (auto patch = dynamic_cast<const Bicubic*>(hit.object)) {
+				patch_differential_geometry<Bicubic>(*patch, ray.time, hit.u, hit.v, &inter->geo);
+			}
 
-	// -X -Y -Z
-	trace_assembly(scene->root.get(), &(*zsplit_7), &(*rays.end()));
-#else
-	// Just trace all the rays together
-	trace_assembly(scene->root.get(), &(*rays.begin()), &(*rays.end()));
-#endif
+			// Did the ray hit from the back-side of the surface?
+			inter->backfacing = dot(inter->geo.n, ray.d.normalized()) > 0.0f;
 
-	return w_rays.size();
+			inter->offset = inter->geo.n * hit.offset;
+			break;
+		}
+
+		// Surfaces and lights are simply intersected again, which finds
+		// the same hit
+		case Object::SURFACE:
+			static_cast<const Surface*>(hit.object)->intersect_ray(ray, inter);
+			break;
+
+		case Object::LIGHT:
+			static_cast<const Light*>(hit.object)->intersect_ray(ray, inter);
+			break;
+
+		default:
+			break;
+	}
 }
 
 
 
-void Tracer::trace_assembly(Assembly* assembly, Ray* rays, Ray* rays_end) {
-	BVH4StreamTraverser traverser;
+void Tracer::run_tasks(TraceContext* ctx) {
+	while (true) {
+		uint64_t claim = task_claim;
+		const uint32_t task_count = claim >> 32;
+		const uint32_t task_i = claim & 0xffffffff;
+
+		if (task_i >= task_count)
+			return;
+
+		if (task_claim.compare_exchange_weak(claim, claim + 1)) {
+			ctx->reset();
+			trace_assembly(ctx, scene->root.get(), tasks[task_i].first, tasks[task_i].second);
+			std::lock_guard<std::mutex> lock(done_mutex);
+			if (--tasks_remaining == 0)
+				done.notify_all();
+		}
+	}
+}
+
+
+
+void Tracer::trace_assembly(TraceContext* ctx, Assembly* assembly, size_t begin, size_t end) {
+	// Traverse with whichever accel the assembly has
+	if (assembly->accel_width == 8) {
+		BVH8StreamTraverser traverser;
+		traverser.init_accel(assembly->object_accel_8);
+		traverser.init_rays(&rays, begin, end);
+		trace_assembly_instances(ctx, assembly, &traverser);
+	} else {
+		// Each level of nesting gets its own mailboxes, since the
+		// traversals of the levels above are still in progress
+		if (ctx->mailboxes.size() <= ctx->assembly_depth)
+			ctx->mailboxes.resize(ctx->assembly_depth + 1);
+		BVH4Mailboxes* mailboxes = &ctx->mailboxes[ctx->assembly_depth];
+		++ctx->assembly_depth;
+
+		if (assembly->object_accel.is_static()) {
+			// No motion blur anywhere in the BVH, so skip support for it
+			BVH4StreamTraverser<StaticPolicy> traverser;
+			traverser.init_accel(assembly->object_accel);
+			traverser.set_mailboxes(mailboxes);
+			traverser.init_rays(&rays, begin, end);
+			trace_assembly_instances(ctx, assembly, &traverser);
+		} else {
+			BVH4StreamTraverser<MotionPolicy> traverser;
+			traverser.init_accel(assembly->object_accel);
+			traverser.set_mailboxes(mailboxes);
+			traverser.init_rays(&rays, begin, end);
+			trace_assembly_instances(ctx, assembly, &traverser);
+		}
+
+		--ctx->assembly_depth;
+	}
+}
 
-	// Initialize traverser
-	traverser.init_accel(assembly->object_accel);
-	traverser.init_rays(rays, rays_end);
 
+template <typename TRAVERSER>
+void Tracer::trace_assembly_instances(TraceContext* ctx, Assembly* assembly, TRAVERSER* traverser) {
 	// Trace rays one object at a time
-	std::tuple<Ray*, Ray*, size_t> hits = traverser.next_object();
+	std::tuple<size_t, size_t, size_t> hits = traverser->next_object();
 	while (std::get<0>(hits) != std::get<1>(hits)) {
 		const auto& instance = assembly->instances[std::get<2>(hits)]; // Short-hand for the current instance
 
 		// Push the current instance index onto the element id
 		const auto element_id_bits = assembly->element_id_bits();
-		element_id.push_back(std::get<2>(hits), element_id_bits);
+		ctx->element_id.push_back(std::get<2>(hits), element_id_bits);
 
 		// Propagate transforms (if necessary)
-		const auto parent_xforms = xform_stack.top_frame<Transform>();
+		const auto parent_xforms = ctx->xform_stack.top_frame<Transform>();
 		const size_t parent_xforms_count = std::distance(parent_xforms.first, parent_xforms.second);
 		if (instance.transform_count > 0) {
-			const auto xbegin = &(*(assembly->xforms.begin() + instance.transform_index));
-			const auto xend = xbegin + instance.transform_count;
-			const auto larger_xform_count = std::max(instance.transform_count, parent_xforms_count);
+			const auto instance_xforms = assembly->trace_xforms(std::get<2>(hits));
+			const size_t instance_xforms_count = std::distance(instance_xforms.first, instance_xforms.second);
+			const auto larger_xform_count = std::max(instance_xforms_count, parent_xforms_count);
 
 			// Push merged transforms onto transform stack
-			auto xforms = xform_stack.push_frame<Transform>(larger_xform_count);
-			merge(xforms.first, parent_xforms.first, parent_xforms.second, xbegin, xend);
+			auto xforms = ctx->xform_stack.push_frame<Transform>(larger_xform_count);
+			merge(xforms.first, parent_xforms.first, parent_xforms.second, instance_xforms.first, instance_xforms.second);
 
-			for (auto ray = std::get<0>(hits); ray != std::get<1>(hits); ++ray) {
-				w_rays[ray->id()].update_ray(ray, lerp_seq(ray->time, xforms.first, xforms.second));
-			}
+			transform_rays(xforms.first, xforms.second, std::get<0>(hits), std::get<1>(hits));
 		}
 
 		// Check for shader on the instance, and push to shader stack if it
 		// has one.
 		if (instance.surface_shader != nullptr) {
-			surface_shader_stack.emplace_back(instance.surface_shader);
+			ctx->surface_shader_stack.emplace_back(instance.surface_shader);
 		}
 
 		// Trace against the object or assembly
@@ -167,87 +368,129 @@ void Tracer::trace_assembly(Assembly* assembly, Ray* rays, Ray* rays_end) {
 			// Branch to different code path based on object type
 			switch (obj->get_type()) {
 				case Object::SURFACE:
-					trace_surface(reinterpret_cast<Surface*>(obj), std::get<0>(hits), std::get<1>(hits));
+					trace_surface(ctx, reinterpret_cast<Surface*>(obj), std::get<0>(hits), std::get<1>(hits));
 					break;
 				case Object::COMPLEX_SURFACE:
-					trace_complex_surface(reinterpret_cast<ComplexSurface*>(obj), std::get<0>(hits), std::get<1>(hits));
+					trace_complex_surface(ctx, reinterpret_cast<ComplexSurface*>(obj), std::get<0>(hits), std::get<1>(hits));
 					break;
 				case Object::PATCH_SURFACE:
-					trace_patch_surface(reinterpret_cast<PatchSurface*>(obj), std::get<0>(hits), std::get<1>(hits));
+					trace_patch_surface(ctx, reinterpret_cast<PatchSurface*>(obj), std::get<0>(hits), std::get<1>(hits));
 					break;
 				case Object::LIGHT:
-					trace_lightsource(reinterpret_cast<Light*>(obj), std::get<0>(hits), std::get<1>(hits));
+					trace_lightsource(ctx, reinterpret_cast<Light*>(obj), std::get<0>(hits), std::get<1>(hits));
 					break;
 				default:
 					//std::cout << "WARNING: unknown object type, skipping." << std::endl;
 					break;
 			}
 
-			Global::Stats::object_ray_tests += std::distance(std::get<0>(hits), std::get<1>(hits));
+			Global::Stats::object_ray_tests += std::get<1>(hits) - std::get<0>(hits);
 		} else { /* Instance::ASSEMBLY */
 			Assembly* asmb = assembly->assemblies[instance.data_index].get(); // Short-hand for the current object
-			trace_assembly(asmb, std::get<0>(hits), std::get<1>(hits));
+			trace_assembly(ctx, asmb, std::get<0>(hits), std::get<1>(hits));
 		}
 
 		// Pop shader stack if we pushed onto it earlier
 		if (instance.surface_shader != nullptr) {
-			surface_shader_stack.pop_back();
+			ctx->surface_shader_stack.pop_back();
 		}
 
 		// Un-transform rays if we transformed them earlier
 		if (instance.transform_count > 0) {
-			if (parent_xforms_count > 0) {
-				for (auto ray = std::get<0>(hits); ray != std::get<1>(hits); ++ray) {
-					w_rays[ray->id()].update_ray(ray, lerp_seq(ray->time, parent_xforms.first, parent_xforms.second));
-				}
-			} else {
-				for (auto ray = std::get<0>(hits); ray != std::get<1>(hits); ++ray) {
-					w_rays[ray->id()].update_ray(ray);
-				}
-			}
+			transform_rays(parent_xforms.first, parent_xforms.second, std::get<0>(hits), std::get<1>(hits));
 
 			// Pop top off of xform stack
-			xform_stack.pop_frame();
+			ctx->xform_stack.pop_frame();
 		}
 
 		// Pop the index of this instance off the element id
-		element_id.pop_back(element_id_bits);
+		ctx->element_id.pop_back(element_id_bits);
 
 		// Get next object to test against
-		hits = traverser.next_object();
+		hits = traverser->next_object();
+	}
+}
+
+
+
+CPU_DISPATCH void Tracer::transform_rays(const Transform* xbegin, const Transform* xend, size_t begin, size_t end) {
+	const size_t xform_count = std::distance(xbegin, xend);
+	const size_t buckets = Config::transform_time_buckets;
+
+	if (xform_count == 0) {
+		// World space
+		for (auto i = begin; i != end; ++i) {
+			rays.update_ray(i, w_rays[rays.id(i)]);
+		}
+	} else if (xform_count == 1) {
+		// No motion blur, so all rays share the same transform and can
+		// be transformed in batches
+		rays.update_rays(begin, end, w_rays.begin(), *xbegin);
+	} else if (buckets > 0) {
+		// Motion blur, pre-interpolated into time buckets that the rays
+		// share
+		for (auto i = begin; i != end; ++i) {
+			rays.update_ray(i, w_rays[rays.id(i)], xbegin[time_bucket(rays.time[rays.slot(i)], buckets)]);
+		}
+	} else {
+		// Motion blur, interpolated per ray
+		for (auto i = begin; i != end; ++i) {
+			rays.update_ray(i, w_rays[rays.id(i)], lerp_seq(rays.time[rays.slot(i)], xbegin, xend));
+		}
 	}
 }
 
 
 
-void Tracer::trace_surface(Surface* surface, Ray* rays, Ray* end) {
-	// Get parent transforms
-	const auto parent_xforms = xform_stack.top_frame<Transform>();
-	const size_t parent_xforms_count = std::distance(parent_xforms.first, parent_xforms.second);
+CPU_DISPATCH void Tracer::update_widths(TraceContext* ctx, size_t begin, size_t end) {
+	const auto xforms = ctx->xform_stack.top_frame<Transform>();
+	const size_t xform_count = std::distance(xforms.first, xforms.second);
+
+	for (auto i = begin; i != end; ++i) {
+		if (rays.is_done(i) || rays.has_width(i))
+			continue;
+
+		const WorldRay& w_ray = w_rays[rays.id(i)];
+		if (xform_count == 0) {
+			rays.update_width(i, w_ray);
+		} else if (xform_count == 1) {
+			rays.update_width(i, w_ray, *xforms.first);
+		} else {
+			// Same transform as transform_rays() used for the ray
+			rays.update_width(i, w_ray, xform_at(rays.time[rays.slot(i)], xforms.first, xforms.second));
+		}
+	}
+}
+
+
+
+void Tracer::trace_surface(TraceContext* ctx, Surface* surface, size_t begin, size_t end) {
+	Intersection inter; // Scratch space for the intersection tests, of which only t is kept
 
 	// Trace!
-	for (auto ritr = rays; ritr != end; ++ritr) {
-		Ray& ray = *ritr;  // Shorthand reference to the ray
-		Intersection& inter = intersections[ritr->id()]; // Shorthand reference to ray's intersection
+	for (auto i = begin; i != end; ++i) {
+		const Ray ray = rays.gather(i);  // Stand-alone copy of the ray
+
+		// Only testing for occlusion
+		if (any_hit) {
+			if (surface->intersect_ray(ray))
+				rays.set_done_true(i);
+			continue;
+		}
 
 		// Test against the ray
 		if (surface->intersect_ray(ray, &inter)) {
-			inter.hit = true;
-			inter.id = element_id;
+			HitRecord& hit = hits[ray.id()]; // Shorthand reference to ray's hit record
+			hit.hit = true;
+			hit.id = ctx->element_id;
 
 			if (ray.is_occlusion()) {
-				ray.set_done_true(); // Early out for shadow rays
+				rays.set_done_true(i); // Early out for shadow rays
 			} else {
-				ray.max_t = inter.t;
-				inter.space = parent_xforms_count > 0 ? lerp_seq(ray.time, parent_xforms.first, parent_xforms.second) : Transform();
-
-				// Do shading
-				auto shader = surface_shader_stack.back();
-				if (shader != nullptr) {
-					shader->shade(&inter);
-				} else {
-					inter.surface_closure.init(EmitClosure(Color(1.0, 0.0, 1.0)));
-				}
+				rays.max_t[rays.slot(i)] = inter.t;
+				hit.object = surface;
+				hit.shader = current_shader(ctx);
+				hit.t = inter.t;
 			}
 		}
 	}
@@ -256,57 +499,72 @@ void Tracer::trace_surface(Surface* surface, Ray* rays, Ray* end) {
 
 
 
-void Tracer::trace_complex_surface(ComplexSurface* surface, Ray* rays, Ray* end) {
-	// Get parent transforms
-	const auto parent_xforms = Range<const Transform*>(xform_stack.top_frame<Transform>());
+void Tracer::trace_complex_surface(TraceContext* ctx, ComplexSurface* surface, size_t begin, size_t end) {
+	// Complex surfaces are diced based on ray width
+	update_widths(ctx, begin, end);
 
 	// Trace!
-	surface->intersect_rays(rays, end,
-	                        &(intersections[0]),
-	                        parent_xforms,
-	                        &data_stack,
-	                        surface_shader_stack.back(),
-	                        element_id
+	surface->intersect_rays(&rays, begin, end,
+	                        hits.begin(),
+	                        &ctx->data_stack,
+	                        current_shader(ctx),
+	                        ctx->element_id
 	                       );
 }
 
 
 
 
-void Tracer::trace_patch_surface(PatchSurface* surface, Ray* rays, Ray* end) {
-	// Get parent transforms
-	const auto parent_xforms = Range<const Transform*>(xform_stack.top_frame<Transform>());
+void Tracer::trace_patch_surface(TraceContext* ctx, PatchSurface* surface, size_t begin, size_t end) {
+	// Patches are diced based on ray width
+	update_widths(ctx, begin, end);
 
 	// Trace!
 	if (auto patch = dynamic_cast<Bilinear*>(surface)) {
-		intersect_rays_with_patch<Bilinear>(*patch, parent_xforms, rays, end, &(intersections[0]), &data_stack, surface_shader_stack.back(), element_id);
+		if (patch->verts.size() == 1)
+			intersect_rays_with_patch<Bilinear, StaticPolicy>(*patch, &rays, begin, end, hits.begin(), &ctx->data_stack, current_shader(ctx), ctx->element_id);
+		else
+			intersect_rays_with_patch<Bilinear, MotionPolicy>(*patch, &rays, begin, end, hits.begin(), &ctx->data_stack, current_shader(ctx), ctx->element_id);
 	} else if (auto patch = dynamic_cast<Bicubic*>(surface)) {
-		intersect_rays_with_patch<Bicubic>(*patch, parent_xforms, rays, end, &(intersections[0]), &data_stack, surface_shader_stack.back(), element_id);
+		if (patch->verts.size() == 1)
+			intersect_rays_with_patch<Bicubic, StaticPolicy>(*patch, &rays, begin, end, hits.begin(), &ctx->data_stack, current_shader(ctx), ctx->element_id);
+		else
+			intersect_rays_with_patch<Bicubic, MotionPolicy>(*patch, &rays, begin, end, hits.begin(), &ctx->data_stack, current_shader(ctx), ctx->element_id);
 	}
 }
 
 
 
-void Tracer::trace_lightsource(Light* light, Ray* rays, Ray* end) {
-	// Get parent transforms
-	const auto parent_xforms = xform_stack.top_frame<Transform>();
-	const size_t parent_xforms_count = std::distance(parent_xforms.first, parent_xforms.second);
+void Tracer::trace_lightsource(TraceContext* ctx, Light* light, size_t begin, size_t end) {
+	Intersection inter; // Scratch space for the intersection tests, of which only t is kept
 
 	// Trace!
-	for (auto ritr = rays; ritr != end; ++ritr) {
-		Ray& ray = *ritr;  // Shorthand reference to the ray
-		Intersection& inter = intersections[ritr->id()]; // Shorthand reference to ray's intersection
+	for (auto i = begin; i != end; ++i) {
+		const Ray ray = rays.gather(i);  // Stand-alone copy of the ray
+
+		// Only testing for occlusion
+		if (any_hit) {
+			if (light->intersect_ray(ray))
+				rays.set_done_true(i);
+			continue;
+		}
 
 		// Test against the ray
 		if (light->intersect_ray(ray, &inter)) {
-			inter.hit = true;
-			inter.id = element_id;
+			HitRecord& hit = hits[ray.id()]; // Shorthand reference to ray's hit record
+			hit.hit = true;
+			hit.id = ctx->element_id;
 
 			if (ray.is_occlusion()) {
-				ray.set_done_true(); // Early out for shadow rays
+				rays.set_done_true(i); // Early out for shadow rays
 			} else {
-				ray.max_t = inter.t;
-				inter.space = parent_xforms_count > 0 ? lerp_seq(ray.time, parent_xforms.first, parent_xforms.second) : Transform();
+				rays.max_t[rays.slot(i)] = inter.t;
+				hit.object = light;
+
+				// Lights fill in their own closure, so there's no
+				// shader to run
+				hit.shader = nullptr;
+				hit.t = inter.t;
 			}
 		}
 	}
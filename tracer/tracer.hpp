@@ -6,19 +6,67 @@
 #define TRACER_HPP
 
 #include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <algorithm>
 
 #include "numtype.h"
 #include "range.hpp"
 #include "rng.hpp"
 #include "stack.hpp"
+#include "job_queue.hpp"
 
 #include "instance_id.hpp"
 #include "ray.hpp"
+#include "ray_stream.hpp"
 #include "intersection.hpp"
+#include "hit_record.hpp"
 #include "potentialinter.hpp"
 #include "scene.hpp"
 
 
+/**
+ * @brief The per-task state used while tracing rays.
+ *
+ * A single trace may be split into several tasks that run on different
+ * threads, and each of those needs its own stacks as it traverses the
+ * scene.
+ */
+struct TraceContext {
+	std::vector<const SurfaceShader*> surface_shader_stack;
+	Stack xform_stack; // Stack for transforms as we traverse into transform hierarchies
+	Stack data_stack; // Stack for arbitrary POD data, passed to other functions
+	InstanceID element_id;
+
+	// BVH4 mailboxes for each level of assembly nesting, kept across
+	// traces so they're only allocated once (see
+	// BVH4StreamTraverser::set_mailboxes()).  A deque, so that adding a
+	// level doesn't move the ones in use.
+	std::deque<BVH4Mailboxes> mailboxes;
+	size_t assembly_depth = 0;
+
+	TraceContext(): xform_stack(16*4*256*64, 256), data_stack(1024*1024*8, 256) {
+		surface_shader_stack.reserve(64);
+	}
+
+	/**
+	 * Resets the context to its state at the root of the scene.
+	 */
+	void reset() {
+		element_id.clear();
+		surface_shader_stack.clear();
+		surface_shader_stack.emplace_back(nullptr);
+		xform_stack.clear();
+		xform_stack.push_frame<Transform>(0);
+		data_stack.clear();
+		assembly_depth = 0;
+	}
+};
+
+
 /**
  * @brief Traces rays in a scene.
  *
@@ -36,31 +84,32 @@
  * number of rays at a time if necessary. But doing so may be far less
  * efficient depending on the scene.
  *
- * The simplest usage is to add a bunch of rays to the Tracer's queue with
- * queue_rays(), and then trace them all by calling trace_rays().  The
- * resulting intersection data is stored in the rays' data structures directly.
+ * The simplest usage is to trace a batch of rays with trace(), which only
+ * records a compact HitRecord for each ray's closest hit, and then call
+ * resolve() to reconstruct and shade the full Intersection of the hits.
  * Wash, rinse, repeat.
+ *
+ * If given a job queue, the Tracer splits each trace into tasks (by
+ * direction octant, and into sub-ranges of large octants) and lets the
+ * queue's threads help with them.  The calling thread works on the tasks as
+ * well, and trace() doesn't return until they're all done.  The job queue
+ * must outlive the Tracer.
  */
 class Tracer {
 public:
 	Scene *scene;
+	JobQueue<>* pool {nullptr}; // Optional shared pool of threads to split traces across
 	Range<const WorldRay*> w_rays; // Rays to trace
-	Range<Intersection*> intersections; // Resulting intersections
-	std::vector<Ray> rays;
+	Range<HitRecord*> hits; // Resulting hits
+	RayStream rays; // The rays being traced, in their current space
 	RNG rng;
-	std::vector<const SurfaceShader*> surface_shader_stack;
-	Stack xform_stack; // Stack for transforms as we traverse into transform hierarchies
-	Stack data_stack; // Stack for arbitrary POD data, passed to other functions
-	InstanceID element_id;
-	int element_id_pos = 0;
+	TraceContext context; // Context for the calling thread
 
-	Tracer(): xform_stack(16*4*256*64, 256), data_stack(1024*1024*8, 256) {
-		surface_shader_stack.reserve(64);
-	}
+	Tracer() {}
 
-	Tracer(Scene *scene_): scene {scene_}, xform_stack(16*4*256*64, 256), data_stack(1024*1024*8, 256) {
-		surface_shader_stack.reserve(64);
-	}
+	Tracer(Scene *scene_, JobQueue<>* pool_=nullptr): scene {scene_}, pool {pool_} {}
+
+	~Tracer();
 
 	void set_seed(uint32_t seed) {
 		rng.seed(seed);
@@ -68,21 +117,111 @@ public:
 
 
 	/**
-	 * Traces the provided rays, filling in the corresponding intersections.
+	 * Traces the provided rays, filling in the corresponding hit records.
+	 *
+	 * For occlusion rays only the hit and id of the records are filled in.
 	 *
 	 * @param [in] rays_ The rays to be traced.
-	 * @param [out] intersections_ The resulting intersections.
+	 * @param [out] hits_ The resulting hit records.
+	 */
+	uint32_t trace(const WorldRay* w_rays_begin, const WorldRay* w_rays_end, HitRecord* hits_begin, HitRecord* hits_end);
+
+	/**
+	 * Reconstructs and shades the full intersections of the hits of the
+	 * last call to trace().
+	 *
+	 * Only rays that hit something are resolved, and occlusion rays are
+	 * skipped.  The hits are shaded grouped by shader.
+	 *
+	 * @param inter_for A callable that takes a ray index and returns a
+	 *                  pointer to the Intersection to fill in for that ray.
+	 */
+	template <typename F>
+	void resolve(F inter_for) {
+		// Group the hits by shader
+		resolve_order.clear();
+		for (size_t i = 0, count = hits.size(); i < count; ++i) {
+			if (hits[i].hit && hits[i].object != nullptr)
+				resolve_order.emplace_back(hits[i].shader, i);
+		}
+		std::sort(resolve_order.begin(), resolve_order.end());
+
+		// Reconstruct and shade
+		for (const auto& item: resolve_order) {
+			Intersection* inter = inter_for(item.second);
+			reconstruct(w_rays[item.second], hits[item.second], inter);
+			if (item.first != nullptr)
+				item.first->shade(inter);
+		}
+	}
+
+	/**
+	 * Tests the provided rays for occlusion, without computing any
+	 * intersection information.
+	 *
+	 * All rays are treated as occlusion rays, i.e. as segments from o to
+	 * o + d, regardless of their type.  Traversal stops for each ray at
+	 * the first hit found, and no shading is done.
+	 *
+	 * @param [in] rays_ The rays to be tested.
+	 * @param [out] occluded_bits One bit per ray, set if the ray is
+	 *              occluded.  Ray i is bit (i % 32) of element (i / 32),
+	 *              so there must be room for (ray count + 31) / 32
+	 *              elements.
 	 */
-	uint32_t trace(const WorldRay* w_rays_begin, const WorldRay* w_rays_end, Intersection* intersections_begin, Intersection* intersections_end);
+	uint32_t occluded(const WorldRay* w_rays_begin, const WorldRay* w_rays_end, uint32_t* occluded_bits);
 
 private:
+	bool any_hit = false; // Whether we're only testing for occlusion
+
+	// The tasks of the current trace, as [begin, end) ranges of positions
+	// in the ray stream
+	std::vector<std::pair<size_t, size_t>> tasks;
+
+	// The task count in the upper 32 bits, and the next task to be claimed
+	// in the lower 32 bits.  Keeping both in one word lets helper jobs
+	// that are picked up late from the pool safely find nothing to do.
+	std::atomic<uint64_t> task_claim {0};
+
+	std::atomic<size_t> tasks_remaining {0}; // Tasks of the current trace not yet finished
+	std::atomic<size_t> jobs_in_flight {0}; // Helper jobs pushed to the pool and not yet finished
+
+	// For waiting on tasks_remaining and jobs_in_flight to reach zero.
+	// Both are only decremented with done_mutex held, so the wakeups
+	// can't be missed.
+	std::mutex done_mutex;
+	std::condition_variable done;
+
+	// Traces the initialized ray stream
+	void trace_rays();
+
+	// The order to resolve hits in, as (shader, ray index) pairs
+	std::vector<std::pair<const SurfaceShader*, uint32_t>> resolve_order;
+
+	// Transforms the rays at positions [begin, end) into the space given by
+	// the transform time samples [xbegin, xend), or back into world space
+	// if there are none
+	void transform_rays(const Transform* xbegin, const Transform* xend, size_t begin, size_t end);
+
+	// Computes the widths of the rays at positions [begin, end) that don't
+	// have an up to date one, in the current space of the context
+	void update_widths(TraceContext* ctx, size_t begin, size_t end);
+
+	// Reconstructs the full intersection of a ray's hit
+	void reconstruct(const WorldRay& w_ray, const HitRecord& hit, Intersection* inter);
+
+	// Claims and runs tasks of the current trace until there are none left
+	void run_tasks(TraceContext* ctx);
+
 	// Various methods for tracing different object types
-	void trace_assembly(Assembly* assembly, Ray* rays, Ray* rays_end);
-	void trace_surface(Surface* surface, Ray* rays, Ray* end);
-	void trace_complex_surface(ComplexSurface* surface, Ray* rays, Ray* end);
-	void trace_patch_surface(PatchSurface* surface, Ray* rays, Ray* end);
-	void trace_lightsource(Light* light, Ray* rays, Ray* end);
+	// Each takes the range [begin, end) of positions in the ray stream
+	void trace_assembly(TraceContext* ctx, Assembly* assembly, size_t begin, size_t end);
+	template <typename TRAVERSER>
+	void trace_assembly_instances(TraceContext* ctx, Assembly* assembly, TRAVERSER* traverser);
+	void trace_surface(TraceContext* ctx, Surface* surface, size_t begin, size_t end);
+	void trace_complex_surface(TraceContext* ctx, ComplexSurface* surface, size_t begin, size_t end);
+	void trace_patch_surface(TraceContext* ctx, PatchSurface* surface, size_t begin, size_t end);
+	void trace_lightsource(TraceContext* ctx, Light* light, size_t begin, size_t end);
 };
 
 #endif // TRACER_HPP
-
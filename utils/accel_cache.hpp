@@ -0,0 +1,277 @@
+#ifndef ACCEL_CACHE_HPP
+#define ACCEL_CACHE_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <vector>
+#include <string>
+
+#include "hash.hpp"
+
+
+/*
+ * A persistent on-disk cache for acceleration structures and other
+ * expensive-to-compute scene data, so that later renders of the same
+ * assets can load them instead of recomputing them.
+ *
+ * Each cached item is a file in the cache directory, named after the kind
+ * of item and a key that hashes everything it was computed from.  A file
+ * is a small header followed by flat arrays, each aligned to 16 bytes, so
+ * it can be memory-mapped and copied straight into place.
+ *
+ * Files are written to a temporary name and then renamed, so several
+ * processes sharing a cache directory never see partial files.
+ */
+namespace AccelCache {
+
+// Bump whenever the layout of any cached data changes
+static constexpr uint32_t FORMAT_VERSION = 2;
+
+static constexpr char MAGIC[8] = {'P', 'S', 'Y', 'A', 'C', 'C', 'E', 'L'};
+static constexpr size_t ALIGNMENT = 16;
+
+
+/**
+ * @brief Builds a cache key by hashing the data that an item is computed
+ * from.
+ *
+ * The data must not contain pointers or padding, since it's hashed
+ * bytewise.
+ */
+class Key {
+	uint64_t hash = hash_bytes(&FORMAT_VERSION, sizeof(FORMAT_VERSION));
+
+public:
+	template <typename T>
+	void add(const T& value) {
+		hash = hash_bytes(&value, sizeof(T), hash);
+	}
+
+	template <typename T>
+	void add(const std::vector<T>& values) {
+		add(values.size());
+		hash = hash_bytes(values.data(), values.size() * sizeof(T), hash);
+	}
+
+	uint64_t value() const {
+		return hash;
+	}
+};
+
+
+/**
+ * Returns the path of the cache file for the given kind of item and key
+ * in the given cache directory.
+ */
+inline std::string path(const std::string& dir, const std::string& kind, const uint64_t key) {
+	char name[17];
+	snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+	return dir + "/" + kind + "-" + name + ".psyc";
+}
+
+
+/**
+ * @brief Writes a cache file.
+ *
+ * The arrays written with write() are read back in the same order by
+ * Reader::read().  Nothing is visible at the final path until commit().
+ */
+class Writer {
+	std::string final_path;
+	std::string temp_path;
+	std::ofstream file;
+	size_t offset = 0;
+
+	void write_bytes(const void* data, size_t size) {
+		file.write(static_cast<const char*>(data), size);
+		offset += size;
+	}
+
+	void pad() {
+		static const char zeros[ALIGNMENT] = {};
+		write_bytes(zeros, (ALIGNMENT - (offset % ALIGNMENT)) % ALIGNMENT);
+	}
+
+public:
+	Writer(const std::string& dir, const std::string& kind, const uint64_t key) {
+		mkdir(dir.c_str(), 0777); // Fails harmlessly if it exists
+
+		final_path = path(dir, kind, key);
+		temp_path = final_path + ".tmp" + std::to_string(getpid());
+		file.open(temp_path, std::ios::binary | std::ios::trunc);
+
+		write_bytes(MAGIC, sizeof(MAGIC));
+		write_bytes(&FORMAT_VERSION, sizeof(FORMAT_VERSION));
+		pad();
+		write_bytes(&key, sizeof(key));
+	}
+
+	~Writer() {
+		if (file.is_open()) {
+			file.close();
+			remove(temp_path.c_str());
+		}
+	}
+
+	/**
+	 * Writes an array of elements, which must be safe to copy bytewise.
+	 */
+	template <typename T>
+	void write(const T* data, const uint64_t count) {
+		const uint64_t element_size = sizeof(T);
+		write_bytes(&element_size, sizeof(element_size));
+		write_bytes(&count, sizeof(count));
+		pad();
+		write_bytes(data, count * sizeof(T));
+		pad();
+	}
+
+	template <typename T>
+	void write(const std::vector<T>& values) {
+		write(values.data(), values.size());
+	}
+
+	/**
+	 * Writes a single value, which must be safe to copy bytewise.
+	 */
+	template <typename T>
+	void write_value(const T& value) {
+		write(&value, 1);
+	}
+
+	/**
+	 * Finishes the file and moves it into place.  Returns whether that
+	 * succeeded.
+	 */
+	bool commit() {
+		file.close();
+		if (file.fail() || rename(temp_path.c_str(), final_path.c_str()) != 0) {
+			remove(temp_path.c_str());
+			return false;
+		}
+		return true;
+	}
+};
+
+
+/**
+ * @brief Reads a cache file written by Writer, via a memory mapping.
+ *
+ * Every read checks the file's contents against what's expected, so a
+ * corrupt or mismatched file makes a read fail rather than misbehave.
+ */
+class Reader {
+	const char* data = nullptr;
+	size_t size = 0;
+	size_t offset = 0;
+
+	bool read_bytes(void* out, size_t n) {
+		if (n > size - offset)
+			return false;
+		memcpy(out, data + offset, n);
+		offset += n;
+		return true;
+	}
+
+	void pad() {
+		offset += (ALIGNMENT - (offset % ALIGNMENT)) % ALIGNMENT;
+		offset = (offset < size) ? offset : size;
+	}
+
+public:
+	Reader() {}
+	Reader(const Reader&) = delete;
+	Reader& operator=(const Reader&) = delete;
+
+	~Reader() {
+		close();
+	}
+
+	/**
+	 * Unmaps the currently open file, if any.
+	 */
+	void close() {
+		if (data != nullptr)
+			munmap(const_cast<char*>(data), size);
+		data = nullptr;
+		size = 0;
+		offset = 0;
+	}
+
+	/**
+	 * Opens the cache file for the given kind of item and key, closing
+	 * any file that was open before.  Returns false if there isn't a
+	 * valid one.
+	 */
+	bool open(const std::string& dir, const std::string& kind, const uint64_t key) {
+		close();
+
+		const int fd = ::open(path(dir, kind, key).c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping != MAP_FAILED) {
+				data = static_cast<const char*>(mapping);
+				size = st.st_size;
+			}
+		}
+		::close(fd);
+		if (data == nullptr)
+			return false;
+
+		char magic[sizeof(MAGIC)];
+		uint32_t version = 0;
+		uint64_t file_key = 0;
+		bool valid = read_bytes(magic, sizeof(magic)) && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0
+		             && read_bytes(&version, sizeof(version)) && version == FORMAT_VERSION;
+		pad();
+		valid = valid && read_bytes(&file_key, sizeof(file_key)) && file_key == key;
+		if (!valid)
+			close();
+		return valid;
+	}
+
+	/**
+	 * Reads the next array into out.  Returns false if it doesn't hold
+	 * elements of type T.
+	 */
+	template <typename T>
+	bool read(std::vector<T>* out) {
+		uint64_t element_size = 0, count = 0;
+		if (!read_bytes(&element_size, sizeof(element_size)) || element_size != sizeof(T))
+			return false;
+		if (!read_bytes(&count, sizeof(count)) || count > (size / sizeof(T)))
+			return false;
+		pad();
+		out->resize(count);
+		if (!read_bytes(out->data(), count * sizeof(T)))
+			return false;
+		pad();
+		return true;
+	}
+
+	/**
+	 * Reads the next single value into out.
+	 */
+	template <typename T>
+	bool read_value(T* out) {
+		std::vector<T> values;
+		if (!read(&values) || values.size() != 1)
+			return false;
+		*out = values[0];
+		return true;
+	}
+};
+
+}
+
+#endif // ACCEL_CACHE_HPP
@@ -0,0 +1,80 @@
+#include "test.hpp"
+
+#include <unistd.h>
+#include <vector>
+#include <string>
+
+#include "accel_cache.hpp"
+
+
+TEST_CASE("accel_cache") {
+	const std::string dir = "/tmp/psychopath_accel_cache_test_" + std::to_string(getpid());
+	const std::vector<int> ints {1, 2, 3, 4, 5};
+	const std::vector<double> doubles {0.5, 1.5};
+
+	AccelCache::Key key_a, key_b;
+	key_a.add(ints);
+	key_b.add(doubles);
+	REQUIRE(key_a.value() != key_b.value());
+
+	{
+		AccelCache::Writer writer(dir, "test", key_a.value());
+		writer.write(ints);
+		writer.write(doubles);
+		writer.write_value(42.0f);
+		REQUIRE(writer.commit());
+	}
+
+	SECTION("round_trip") {
+		AccelCache::Reader reader;
+		std::vector<int> ints_in;
+		std::vector<double> doubles_in;
+		float value = 0.0f;
+		REQUIRE(reader.open(dir, "test", key_a.value()));
+		REQUIRE(reader.read(&ints_in));
+		REQUIRE(reader.read(&doubles_in));
+		REQUIRE(reader.read_value(&value));
+		REQUIRE(ints_in == ints);
+		REQUIRE(doubles_in == doubles);
+		REQUIRE(value == 42.0f);
+	}
+
+	SECTION("reopen") {
+		AccelCache::Reader reader;
+		std::vector<int> ints_in;
+		REQUIRE(reader.open(dir, "test", key_a.value()));
+		REQUIRE(!reader.open(dir, "test", key_b.value()));
+		REQUIRE(!reader.read(&ints_in));
+		REQUIRE(reader.open(dir, "test", key_a.value()));
+		REQUIRE(reader.read(&ints_in));
+		REQUIRE(ints_in == ints);
+	}
+
+	SECTION("missing_file") {
+		AccelCache::Reader reader;
+		REQUIRE(!reader.open(dir, "test", key_b.value()));
+		REQUIRE(!reader.open(dir, "other", key_a.value()));
+	}
+
+	SECTION("type_mismatch") {
+		AccelCache::Reader reader;
+		std::vector<double> wrong;
+		REQUIRE(reader.open(dir, "test", key_a.value()));
+		REQUIRE(!reader.read(&wrong));
+	}
+
+	SECTION("past_end") {
+		AccelCache::Reader reader;
+		std::vector<int> ints_in;
+		std::vector<double> doubles_in;
+		float value;
+		REQUIRE(reader.open(dir, "test", key_a.value()));
+		REQUIRE(reader.read(&ints_in));
+		REQUIRE(reader.read(&doubles_in));
+		REQUIRE(reader.read_value(&value));
+		REQUIRE(!reader.read(&ints_in));
+	}
+
+	remove(AccelCache::path(dir, "test", key_a.value()).c_str());
+	rmdir(dir.c_str());
+}
@@ -22,10 +22,10 @@ namespace CountingSort {
  * @param list Pointer to the beginning of the array.
  * @param list_length Length of the array.
  * @param max_items The largest integer that can come out of an item in the array.
- * @param indexer Pointer to a function that can turn type T into an integer.
+ * @param indexer A function (or function object) that can turn type T into an integer.
  */
-template <class T>
-bool sort(T *list, size_t list_length, size_t max_items, size_t(*indexer)(const T &)) {
+template <class T, class Indexer>
+bool sort(T *list, size_t list_length, size_t max_items, Indexer indexer) {
 	size_t item_counts[max_items];
 	for (size_t i = 0; i < max_items; i++) {
 		item_counts[i] = 0;
@@ -0,0 +1,71 @@
+#ifndef CPU_DISPATCH_HPP
+#define CPU_DISPATCH_HPP
+
+/*
+ * Runtime CPU feature dispatch for hot SIMD code.
+ *
+ * Functions marked with CPU_DISPATCH are compiled once for each of the
+ * instruction sets listed below, and the best version that the CPU supports
+ * is picked when the program is loaded (via GCC's target_clones, which
+ * checks cpuid).  Inline functions they call, such as
+ * BBox4::intersect_ray(), are inlined into each version and compiled for
+ * its instruction set as well.
+ *
+ * Only code generation is affected.  Data layouts that depend on
+ * compile-time flags (e.g. SIMD::float8 without __AVX__) stay the same, and
+ * FMA isn't enabled, so every version gives identical results.  Code that
+ * needs wider registers than the build targets, like 8-wide BVH8 node
+ * tests, can instead provide its own AVX2 path (marked
+ * __attribute__((target("avx2")))) and pick it with has_avx2().  It's
+ * inlined into the AVX2 versions of CPU_DISPATCH functions.
+ *
+ * Dispatch is disabled where target_clones isn't available, when the whole
+ * build already targets AVX2, or if NO_CPU_DISPATCH is defined (see
+ * USE_CPU_DISPATCH in CMakeLists.txt).
+ */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__) && !defined(__AVX2__) && !defined(NO_CPU_DISPATCH)
+#define CPU_DISPATCH_ENABLED
+#define CPU_DISPATCH __attribute__((target_clones("avx2", "avx", "default")))
+#else
+#define CPU_DISPATCH
+#endif
+
+
+namespace CPUDispatch {
+
+/**
+ * Returns the name of the instruction set that CPU_DISPATCH functions
+ * run with on this CPU.
+ */
+inline const char* instruction_set() {
+#ifdef CPU_DISPATCH_ENABLED
+	if (__builtin_cpu_supports("avx2"))
+		return "AVX2";
+	else if (__builtin_cpu_supports("avx"))
+		return "AVX";
+	else
+		return "SSE3 (default)";
+#elif defined(__AVX2__)
+	return "AVX2 (compile-time)";
+#else
+	return "SSE3 (compile-time)";
+#endif
+}
+
+
+/**
+ * Returns whether the CPU supports AVX2.
+ */
+inline bool has_avx2() {
+#ifdef CPU_DISPATCH_ENABLED
+	return __builtin_cpu_supports("avx2");
+#elif defined(__AVX2__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+}
+
+#endif // CPU_DISPATCH_HPP
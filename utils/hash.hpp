@@ -2,6 +2,7 @@
 #define HASH_HPP
 
 #include <cstdint>
+#include <cstddef>
 
 static inline uint32_t hash_u32(uint32_t n, uint32_t seed) {
 	uint32_t hash = n;
@@ -27,6 +28,24 @@ static inline float hash_f32(uint32_t n, uint32_t seed) {
 	return w-1.f;
 }
 
+/**
+ * @brief 64-bit FNV-1a hash of a block of bytes.
+ *
+ * To hash several blocks together, pass the hash of the previous ones as
+ * the seed.
+ */
+static inline uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ull) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	uint64_t hash = seed;
+
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
 /**
  * @brief A seedable hash class.
  *
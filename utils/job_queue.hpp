@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include <vector>
 #include <thread>
+#include <atomic>
 #include <functional>
 
 #include "ring_buffer_concurrent.hpp"
@@ -22,8 +23,9 @@ template <class T=std::function<void()>>
 class JobQueue {
 	RingBufferConcurrent<T> queue;
 	std::vector<std::thread> threads;
+	std::atomic<size_t> helpers {0}; // Outside threads currently in help()
 
-	bool done;
+	std::atomic<bool> done {false};
 
 	// A consumer thread, which watches the queue for jobs and
 	// executes them.
@@ -46,8 +48,6 @@ public:
 	 *                   automatically from number of threads.
 	 */
 	explicit JobQueue(size_t thread_count=1, size_t queue_size=0) {
-		done = false;
-
 		// Set up queue
 		if (queue_size == 0)
 			queue_size = thread_count * 4;
@@ -74,9 +74,8 @@ public:
 	 * empty so they can terminate.
 	 */
 	void finish() {
-		if (!done) {
+		if (!done.exchange(true)) {
 			// Notify all threads that the queue is done
-			done = true;
 			queue.disallow_blocking();
 
 			// Wait for threads to finish
@@ -99,6 +98,49 @@ public:
 	}
 
 
+	/**
+	 * @brief Adds a job to the queue, without blocking.
+	 *
+	 * @param job The job to add.
+	 *
+	 * @return True on success, false if the queue is full or closed.
+	 */
+	bool try_push(const T &job) {
+		return queue.push_unless_stopped(job);
+	}
+
+
+	/**
+	 * @brief Returns the number of consumer threads.
+	 */
+	size_t thread_count() const {
+		return threads.size();
+	}
+
+
+	/**
+	 * @brief Returns the number of outside threads currently helping
+	 *        with jobs via help().
+	 */
+	size_t helper_count() const {
+		return helpers;
+	}
+
+
+	/**
+	 * @brief Processes jobs on the calling thread until the queue is
+	 *        done and empty.
+	 *
+	 * This lets threads that aren't the queue's own consumers, e.g.
+	 * threads that have run out of other work, pick up its jobs.
+	 */
+	void help() {
+		++helpers;
+		run_consumer();
+		--helpers;
+	}
+
+
 	/**
 	 * @brief Gets the next job, removing it from the queue.
 	 *
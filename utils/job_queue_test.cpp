@@ -1,4 +1,6 @@
 #include "test.hpp"
+#include <atomic>
+#include <functional>
 #include "job_queue.hpp"
 
 // Simple callable class that does nothing more than set an integer
@@ -65,7 +67,64 @@ TEST_CASE("job_queue") {
 
 		REQUIRE(test);
 	}
-}
 
+	SECTION("try_push") {
+		JobQueue<TestJob> q(4);
+		REQUIRE(q.thread_count() == 4);
+
+		int ints[100];
+		for (int i = 0; i < 100; i++) {
+			// Fall back to running the job ourselves if the queue is full
+			if (!q.try_push(TestJob(&(ints[i]), i)))
+				TestJob(&(ints[i]), i)();
+		}
+		q.finish();
 
+		REQUIRE(!q.try_push(TestJob(&(ints[0]), 0)));
 
+		bool test = true;
+		for (int i = 0; i < 100; i++)
+			test = test && ints[i] == i;
+
+		REQUIRE(test);
+	}
+	SECTION("help") {
+		JobQueue<TestJob> q(0, 200); // No threads of its own
+		REQUIRE(q.thread_count() == 0);
+		REQUIRE(q.helper_count() == 0);
+
+		int ints[100];
+		for (int i = 0; i < 100; i++)
+			q.push(TestJob(&(ints[i]), i));
+
+		// Stops once the queue is finished, after doing the queued jobs
+		std::thread helper(&JobQueue<TestJob>::help, &q);
+		q.finish();
+		helper.join();
+		REQUIRE(q.helper_count() == 0);
+
+		bool test = true;
+		for (int i = 0; i < 100; i++)
+			test = test && ints[i] == i;
+
+		REQUIRE(test);
+	}
+	SECTION("try_push_during_finish") {
+		// Every job that try_push() accepts runs, even when finish() is
+		// called at the same time
+		for (int n = 0; n < 20; ++n) {
+			JobQueue<std::function<void()>> q(2, 8);
+			std::atomic<int> pushed {0};
+			std::atomic<int> ran {0};
+			std::thread pusher([&]() {
+				for (int i = 0; i < 1000; ++i) {
+					if (q.try_push([&ran]() { ++ran; }))
+						++pushed;
+				}
+			});
+			q.finish();
+			pusher.join();
+			REQUIRE(ran == pushed);
+		}
+	}
+}
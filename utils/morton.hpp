@@ -35,6 +35,31 @@ static inline uint32_t xy2d(uint32_t x, uint32_t y) {
 	return x | (y << 1);
 }
 
+/**
+ * @brief Encodes x, y, and z coordinates into a morton code index.
+ *
+ * Only the lowest 10 bits of x, y, and z are used, giving a 30 bit
+ * index.
+ */
+static inline uint32_t xyz2d(uint32_t x, uint32_t y, uint32_t z) {
+	x &= 0x000003ff;
+	y &= 0x000003ff;
+	z &= 0x000003ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	y = (y | (y << 16)) & 0x030000ff;
+	z = (z | (z << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	y = (y | (y << 8)) & 0x0300f00f;
+	z = (z | (z << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	y = (y | (y << 4)) & 0x030c30c3;
+	z = (z | (z << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	y = (y | (y << 2)) & 0x09249249;
+	z = (z | (z << 2)) & 0x09249249;
+	return x | (y << 1) | (z << 2);
+}
+
 /**
  * @brief Decodes a morton code index into x and y coordinates.
  */
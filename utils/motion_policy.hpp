@@ -0,0 +1,41 @@
+#ifndef MOTION_POLICY_HPP
+#define MOTION_POLICY_HPP
+
+#include <iterator>
+#include <cassert>
+
+#include "numtype.h"
+#include "utils.hpp"
+
+
+/*
+ * Policies for specializing code at compile time on whether the data it
+ * works with is motion blurred.
+ *
+ * Both provide a lerp_seq() that works the same as the free function of
+ * the same name.  StaticPolicy's assumes there is only one time sample,
+ * and ignores the time entirely, so static data pays nothing for motion
+ * blur support.
+ */
+
+struct StaticPolicy {
+	static constexpr bool MOTION = false;
+
+	template<typename RandIt, typename T = typename std::iterator_traits<RandIt>::value_type>
+	static T lerp_seq(float, const RandIt& seq, int seq_length) {
+		assert(seq_length == 1);
+		return seq[0];
+	}
+};
+
+
+struct MotionPolicy {
+	static constexpr bool MOTION = true;
+
+	template<typename RandIt, typename T = typename std::iterator_traits<RandIt>::value_type>
+	static T lerp_seq(float alpha, const RandIt& seq, int seq_length) {
+		return ::lerp_seq(alpha, seq, seq_length);
+	}
+};
+
+#endif // MOTION_POLICY_HPP
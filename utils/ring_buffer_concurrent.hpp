@@ -115,6 +115,31 @@ public:
 		return true;
 	}
 
+	/**
+	 * @brief Pushes an item onto the front of the buffer, unless blocking
+	 * calls have been disallowed.
+	 *
+	 * Checks that under the same lock as the push, so that no item gets
+	 * pushed after a call to disallow_blocking() has returned.
+	 *
+	 * @param [in] item The item to push.
+	 *
+	 * @return Whether the item was successfully pushed or not.
+	 */
+	bool push_unless_stopped(const T &item) {
+		std::unique_lock<std::mutex> lock(mut);
+		if (stop || buffer.is_full())
+			return false;
+
+		// Push item
+		buffer.push(item);
+
+		// Notify waiting poppers that there's an item in the queue
+		empty.notify_all();
+
+		return true;
+	}
+
 	/**
 	 * @brief Pushes an item onto the front of the buffer.
 	 *
@@ -105,11 +105,16 @@ TEST_CASE("ring_buffer_concurrent") {
 
 		REQUIRE(!test);
 	}
-}
-
-
-
-
-
-
+	SECTION("push_unless_stopped") {
+		RingBufferConcurrent<int> rb(100);
+		REQUIRE(rb.push_unless_stopped(1));
+		rb.disallow_blocking();
+		REQUIRE(!rb.push_unless_stopped(2));
 
+		// What was pushed before can still be popped
+		int result {0};
+		REQUIRE(rb.pop_blocking(&result));
+		REQUIRE(result == 1);
+		REQUIRE(!rb.pop_blocking(&result));
+	}
+}
@@ -1,6 +1,8 @@
 #ifndef SIMD_HPP
 #define SIMD_HPP
 
+#include <cstdint>
+#include <cstring>
 #include <x86intrin.h>
 
 namespace SIMD {
@@ -80,6 +82,13 @@ inline float4 operator&&(const float4& a, const float4& b) {
 	return float4(_mm_and_ps(a.data, b.data));
 }
 
+/**
+ * @brief Returns the elements of a where mask is set, and of b elsewhere.
+ */
+inline float4 select(const float4& mask, const float4& a, const float4& b) {
+	return float4(_mm_or_ps(_mm_and_ps(mask.data, a.data), _mm_andnot_ps(mask.data, b.data)));
+}
+
 
 inline float4 min(const float4& a, const float4& b) {
 	return float4(_mm_min_ps(a.data, b.data));
@@ -106,6 +115,150 @@ inline unsigned int to_bitmask(const float4& a) {
 	return _mm_movemask_ps(a.data);
 }
 
+/**
+ * @brief Loads four unsigned 8-bit integers and converts them to floats.
+ */
+inline float4 to_float4(const uint8_t* a) {
+	int32_t packed;
+	std::memcpy(&packed, a, sizeof(packed));
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i a16 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+	return float4(_mm_cvtepi32_ps(_mm_unpacklo_epi16(a16, zero)));
+}
+
+/**
+ * @brief Loads four unsigned 16-bit integers and converts them to floats.
+ */
+inline float4 to_float4(const uint16_t* a) {
+	const __m128i a16 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(a));
+	return float4(_mm_cvtepi32_ps(_mm_unpacklo_epi16(a16, _mm_setzero_si128())));
+}
+
+/**
+ * @brief Eight floats, for 8-wide SIMD.
+ *
+ * Uses AVX when the build targets it (see the USE_AVX2 CMake option), and
+ * otherwise falls back to a pair of float4's.  Code that needs 256-bit
+ * operations in a non-AVX build has to use intrinsics in an AVX2 target
+ * function instead (see BBox8::intersect_ray_avx2()).
+ *
+ * Unlike float4, this is not meant to be stored in memory directly: under
+ * AVX it needs 32-byte alignment, which e.g. std::vector doesn't provide.
+ * Store plain floats instead, and use load() and store().
+ */
+struct float8 {
+#ifdef __AVX__
+	__m256 data;
+
+	float8(): data() {}
+	float8(const float f): data(_mm256_set1_ps(f)) {}
+	float8(const __m256& s): data(s) {}
+
+	static float8 load(const float* fs) {
+		return float8(_mm256_loadu_ps(fs));
+	}
+
+	void store(float* fs) const {
+		_mm256_storeu_ps(fs, data);
+	}
+#else
+	float4 lo, hi;
+
+	float8() {}
+	float8(const float f): lo(f), hi(f) {}
+	float8(const float4& lo_, const float4& hi_): lo(lo_), hi(hi_) {}
+
+	static float8 load(const float* fs) {
+		return float8(float4(_mm_loadu_ps(fs)), float4(_mm_loadu_ps(fs + 4)));
+	}
+
+	void store(float* fs) const {
+		_mm_storeu_ps(fs, lo.data);
+		_mm_storeu_ps(fs + 4, hi.data);
+	}
+#endif
+
+	float operator[](const int i) const {
+		float fs[8];
+		store(fs);
+		return fs[i];
+	}
+};
+
+#ifdef __AVX__
+inline float8 operator+(const float8& a, const float8& b) {
+	return float8(_mm256_add_ps(a.data, b.data));
+}
+
+inline float8 operator-(const float8& a, const float8& b) {
+	return float8(_mm256_sub_ps(a.data, b.data));
+}
+
+inline float8 operator*(const float8& a, const float8& b) {
+	return float8(_mm256_mul_ps(a.data, b.data));
+}
+
+inline float8 lt(const float8& a, const float8& b) {
+	return float8(_mm256_cmp_ps(a.data, b.data, _CMP_LT_OS));
+}
+
+inline float8 lte(const float8& a, const float8& b) {
+	return float8(_mm256_cmp_ps(a.data, b.data, _CMP_LE_OS));
+}
+
+inline float8 operator&&(const float8& a, const float8& b) {
+	return float8(_mm256_and_ps(a.data, b.data));
+}
+
+inline float8 min(const float8& a, const float8& b) {
+	return float8(_mm256_min_ps(a.data, b.data));
+}
+
+inline float8 max(const float8& a, const float8& b) {
+	return float8(_mm256_max_ps(a.data, b.data));
+}
+
+inline unsigned int to_bitmask(const float8& a) {
+	return _mm256_movemask_ps(a.data);
+}
+#else
+inline float8 operator+(const float8& a, const float8& b) {
+	return float8(a.lo + b.lo, a.hi + b.hi);
+}
+
+inline float8 operator-(const float8& a, const float8& b) {
+	return float8(a.lo - b.lo, a.hi - b.hi);
+}
+
+inline float8 operator*(const float8& a, const float8& b) {
+	return float8(a.lo * b.lo, a.hi * b.hi);
+}
+
+inline float8 lt(const float8& a, const float8& b) {
+	return float8(lt(a.lo, b.lo), lt(a.hi, b.hi));
+}
+
+inline float8 lte(const float8& a, const float8& b) {
+	return float8(lte(a.lo, b.lo), lte(a.hi, b.hi));
+}
+
+inline float8 operator&&(const float8& a, const float8& b) {
+	return float8(a.lo && b.lo, a.hi && b.hi);
+}
+
+inline float8 min(const float8& a, const float8& b) {
+	return float8(min(a.lo, b.lo), min(a.hi, b.hi));
+}
+
+inline float8 max(const float8& a, const float8& b) {
+	return float8(max(a.lo, b.lo), max(a.hi, b.hi));
+}
+
+inline unsigned int to_bitmask(const float8& a) {
+	return to_bitmask(a.lo) | (to_bitmask(a.hi) << 4);
+}
+#endif
+
 // Inverts a 4x4 matrix and returns the determinate
 inline float invert_44_matrix(float* src) {
 	// Code pulled from "Streaming SIMD Extensions - Inverse of 4x4 Matrix"